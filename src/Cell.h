@@ -43,30 +43,46 @@ struct CellFlags {
 // do not contain Objects directly.
 //
 
-struct Cell
+// The IndexType is the type used to store the flag and the index (uint16_t or
+// uint32_t), so we can have up to 2^15 (or 2^31) cells.
+//
+template <typename IndexType>
+struct CellT
 {
     // We will do an ugly trick here, to avoid mem align problems
-    // We will use an uint16_t to merge the flag and the index in the same
-    // uint16_t.
+    // We will use an IndexType to merge the flag and the index in the same
+    // integer: the highest bit is the flag and the rest the index.
     // The flag will indicate if it is a leaf cell or if it is a matrix
     //
-    uint16_t data;
+    IndexType data;
+
+    // the bit used for the flag and the maximum index we can store
+    static const IndexType LEAF_FLAG = IndexType(1) << (sizeof(IndexType) * 8 - 1);
+    static const IndexType MAX_INDEX = LEAF_FLAG - 1;
 
     // auxiliary methods to get the index and the flag
     //
     inline bool
-    isLeaf(void) const {return data & (1 << 15);}
-    inline uint16_t
-    index(void) const {return data & 0x7FFF;}
+    isLeaf(void) const {return data & LEAF_FLAG;}
+    inline IndexType
+    index(void) const {return data & MAX_INDEX;}
 
     // Configure the cell from a flag and a index
     //
     inline void
-    configure(bool isLeaf, uint16_t index)
+    configure(bool isLeaf, IndexType index)
     {
-        data = ((int)isLeaf << 15) | (index & 0x7FFF);
+        data = (isLeaf ? LEAF_FLAG : 0) | (index & MAX_INDEX);
     }
 };
 
+template <typename IndexType>
+const IndexType CellT<IndexType>::LEAF_FLAG;
+template <typename IndexType>
+const IndexType CellT<IndexType>::MAX_INDEX;
+
+// the default (compact) cell
+typedef CellT<uint16_t> Cell;
+
 } /* namespace mgsp */
 #endif /* CELL_H_ */
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#include "CellStructBuilder.h"
+
+#include <queue>
+#include <cmath>
+
+
+namespace {
+
+// Get the range of cells [col0, col1] x [row0, row1] of a grid covered by an
+// AABB (clamped as MatrixPartition does).
+//
+struct GridRange {
+    unsigned int col0, col1, row0, row1;
+};
+
+inline unsigned int
+clampedCell(mgsp::float32 value, mgsp::float32 cellSize, unsigned int count)
+{
+    if (value <= 0.f) {
+        return 0;
+    }
+    const unsigned int cell = static_cast<unsigned int>(value / cellSize);
+    return cell >= count ? count - 1 : cell;
+}
+
+inline GridRange
+getGridRange(const mgsp::AABB& region,
+             mgsp::float32 cellWidth,
+             mgsp::float32 cellHeight,
+             unsigned int columns,
+             unsigned int rows,
+             const mgsp::AABB& aabb)
+{
+    GridRange range;
+    range.col0 = clampedCell(aabb.tl.x - region.tl.x, cellWidth, columns);
+    range.col1 = clampedCell(aabb.br.x - region.tl.x, cellWidth, columns);
+    range.row0 = clampedCell(aabb.br.y - region.br.y, cellHeight, rows);
+    range.row1 = clampedCell(aabb.tl.y - region.br.y, cellHeight, rows);
+    return range;
+}
+
+// The grid sizes (for the longest side) we will try for each region
+//
+const unsigned int GRID_CANDIDATES[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64,
+                                        96, 128, 192, 255};
+
+// A region we still need to process
+//
+struct Region {
+    mgsp::CellStructInfo* info;
+    mgsp::AABB aabb;
+    unsigned int depth;
+    std::vector<unsigned int> objects;
+    std::vector<unsigned int> queries;
+};
+
+}
+
+namespace mgsp {
+
+////////////////////////////////////////////////////////////////////////////
+CellStructBuilder::CellStructBuilder(const Config& config) :
+    mConfig(config)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////
+CellStructBuilder::~CellStructBuilder()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////
+float32
+CellStructBuilder::gridCost(BuildState& state,
+                            const AABB& region,
+                            uint8_t columns,
+                            uint8_t rows,
+                            const std::vector<unsigned int>& objects,
+                            const std::vector<unsigned int>& queries) const
+{
+    ASSERT(columns > 0 && rows > 0);
+    const float32 cellWidth = region.getWidth() / static_cast<float32>(columns);
+    const float32 cellHeight = region.getHeight() / static_cast<float32>(rows);
+    const size_t stride = columns + 1;
+    const size_t size = stride * (rows + 1);
+
+    // We count the objects of each cell using a 2D difference array (4 updates
+    // per object) and then we build the summed area table of the counts, so
+    // each query can get the number of objects it will check in O(1).
+    state.tmpDiff.assign(size, 0);
+    state.tmpTable.assign(size, 0);
+    int32_t* diff = state.tmpDiff.data();
+    uint32_t* table = state.tmpTable.data();
+    float32 copies = 0.f;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const GridRange r = getGridRange(region, cellWidth, cellHeight,
+                                         columns, rows, (*state.objects)[objects[i]]);
+        copies += static_cast<float32>((r.col1 - r.col0 + 1) * (r.row1 - r.row0 + 1));
+        diff[r.row0 * stride + r.col0] += 1;
+        diff[r.row0 * stride + r.col1 + 1] -= 1;
+        diff[(r.row1 + 1) * stride + r.col0] -= 1;
+        diff[(r.row1 + 1) * stride + r.col1 + 1] += 1;
+    }
+    // integrating the differences (rows and then columns) we get the number
+    // of objects of each cell
+    for (unsigned int row = 0; row < rows; ++row) {
+        for (unsigned int col = 1; col < columns; ++col) {
+            diff[row * stride + col] += diff[row * stride + col - 1];
+        }
+    }
+    for (unsigned int row = 1; row < rows; ++row) {
+        for (unsigned int col = 0; col < columns; ++col) {
+            diff[row * stride + col] += diff[(row - 1) * stride + col];
+        }
+    }
+    // table[(row+1, col+1)] = number of objects in the cells [0,row]x[0,col]
+    for (unsigned int row = 0; row < rows; ++row) {
+        for (unsigned int col = 0; col < columns; ++col) {
+            table[(row + 1) * stride + col + 1] = diff[row * stride + col] +
+                table[row * stride + col + 1] + table[(row + 1) * stride + col] -
+                table[row * stride + col];
+        }
+    }
+
+    float32 checks = 0.f;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const GridRange r = getGridRange(region, cellWidth, cellHeight,
+                                         columns, rows, (*state.queries)[queries[i]]);
+        const float32 cells = static_cast<float32>((r.col1 - r.col0 + 1) *
+                                                   (r.row1 - r.row0 + 1));
+        const uint32_t objs = table[(r.row1 + 1) * stride + r.col1 + 1] -
+                              table[r.row0 * stride + r.col1 + 1] -
+                              table[(r.row1 + 1) * stride + r.col0] +
+                              table[r.row0 * stride + r.col0];
+        checks += mConfig.cellCost * cells + static_cast<float32>(objs);
+    }
+
+    return checks * state.queryWeight +
+        mConfig.replicationCost * copies * state.objectWeight;
+}
+
+////////////////////////////////////////////////////////////////////////////
+CellStructBuilder::GridChoice
+CellStructBuilder::chooseGrid(BuildState& state,
+                              const AABB& region,
+                              const std::vector<unsigned int>& objects,
+                              const std::vector<unsigned int>& queries,
+                              unsigned int maxCount) const
+{
+    // we want (almost) square cells, so the longest side gets the candidate
+    // size and the other one the proportional part
+    const float32 width = region.getWidth();
+    const float32 height = region.getHeight();
+    const float32 aspect = width > height ? height / width : width / height;
+
+    GridChoice best;
+    best.columns = best.rows = 1;
+    best.cost = gridCost(state, region, 1, 1, objects, queries);
+    const size_t numCandidates = sizeof(GRID_CANDIDATES) / sizeof(GRID_CANDIDATES[0]);
+    for (size_t i = 1; i < numCandidates; ++i) {
+        if (GRID_CANDIDATES[i] > mConfig.maxSubdivisions) {
+            break;
+        }
+        const unsigned int longSide = GRID_CANDIDATES[i];
+        unsigned int shortSide = static_cast<unsigned int>(
+            std::floor(static_cast<float32>(longSide) * aspect + 0.5f));
+        shortSide = shortSide == 0 ? 1 : shortSide;
+        const uint8_t columns = width > height ? longSide : shortSide;
+        const uint8_t rows = width > height ? shortSide : longSide;
+        if (static_cast<unsigned int>(columns) * rows > maxCount) {
+            break;
+        }
+        const float32 cost = gridCost(state, region, columns, rows, objects, queries);
+        if (cost < best.cost) {
+            best.columns = columns;
+            best.rows = rows;
+            best.cost = cost;
+        }
+    }
+    return best;
+}
+
+////////////////////////////////////////////////////////////////////////////
+bool
+CellStructBuilder::build(const AABB& world,
+                         const std::vector<AABB>& objects,
+                         const std::vector<AABB>& queries,
+                         CellStructInfo& result) const
+{
+    result = CellStructInfo();
+    if (world.getWidth() <= 0.f || world.getHeight() <= 0.f ||
+        mConfig.maxSubdivisions == 0 || mConfig.maxCells < 2) {
+        DEBUG_PRINT("Error: invalid world or configuration for the builder\n");
+        return false;
+    }
+
+    // if we have no queries we will use the objects
+    BuildState state;
+    state.objects = &objects;
+    state.queries = queries.empty() ? &objects : &queries;
+    state.objectWeight = objects.empty() ? 0.f : 1.f / static_cast<float32>(objects.size());
+    state.queryWeight = state.queries->empty() ? 0.f :
+        1.f / static_cast<float32>(state.queries->size());
+    const std::vector<AABB>& querySamples = *state.queries;
+
+    // We process the regions breadth first so the cell budget is spent in
+    // the first levels before going deeper.
+    std::queue<Region> regions;
+    regions.push(Region());
+    Region& root = regions.back();
+    root.info = &result;
+    root.aabb = world;
+    root.depth = 0;
+    for (unsigned int i = 0; i < objects.size(); ++i) {
+        if (objects[i].collide(world)) root.objects.push_back(i);
+    }
+    for (unsigned int i = 0; i < querySamples.size(); ++i) {
+        if (querySamples[i].collide(world)) root.queries.push_back(i);
+    }
+
+    unsigned int numCells = 1;
+    while (!regions.empty()) {
+        Region& region = regions.front();
+        const bool isRoot = region.depth == 0;
+
+        // check if we should subdivide this region
+        GridChoice choice;
+        choice.columns = choice.rows = 1;
+        if (isRoot || (region.depth < mConfig.maxDepth &&
+                       region.objects.size() >= mConfig.minObjectsToSplit)) {
+            choice = chooseGrid(state, region.aabb, region.objects,
+                                region.queries, mConfig.maxCells - numCells);
+        }
+        const unsigned int count = choice.columns * choice.rows;
+        if (!isRoot && count == 1) {
+            // this will be a leaf cell
+            regions.pop();
+            continue;
+        }
+        numCells += count;
+        region.info->createSubDivisions(choice.columns, choice.rows);
+
+        // distribute the objects and queries in the new cells and queue them
+        const float32 cellWidth = region.aabb.getWidth() / choice.columns;
+        const float32 cellHeight = region.aabb.getHeight() / choice.rows;
+        // (adding elements at the end of the queue keeps the references)
+        std::vector<Region*> children;
+        children.reserve(count);
+        for (uint8_t row = 0; row < choice.rows; ++row) {
+            for (uint8_t col = 0; col < choice.columns; ++col) {
+                regions.push(Region());
+                Region& child = regions.back();
+                children.push_back(&child);
+                child.info = &region.info->getSubCell(row, col);
+                child.depth = region.depth + 1;
+                const float32 bottom = region.aabb.br.y + cellHeight * row;
+                const float32 left = region.aabb.tl.x + cellWidth * col;
+                child.aabb = AABB(bottom + cellHeight, left, bottom, left + cellWidth);
+            }
+        }
+        for (size_t i = 0; i < region.objects.size(); ++i) {
+            const GridRange r = getGridRange(region.aabb, cellWidth, cellHeight,
+                choice.columns, choice.rows, objects[region.objects[i]]);
+            for (unsigned int row = r.row0; row <= r.row1; ++row) {
+                for (unsigned int col = r.col0; col <= r.col1; ++col) {
+                    children[row * choice.columns + col]->objects.push_back(region.objects[i]);
+                }
+            }
+        }
+        for (size_t i = 0; i < region.queries.size(); ++i) {
+            const GridRange r = getGridRange(region.aabb, cellWidth, cellHeight,
+                choice.columns, choice.rows, querySamples[region.queries[i]]);
+            for (unsigned int row = r.row0; row <= r.row1; ++row) {
+                for (unsigned int col = r.col0; col <= r.col1; ++col) {
+                    children[row * choice.columns + col]->queries.push_back(region.queries[i]);
+                }
+            }
+        }
+        regions.pop();
+    }
+
+    return true;
+}
+
+} /* namespace mgsp */
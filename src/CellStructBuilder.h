@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef CELLSTRUCTBUILDER_H_
+#define CELLSTRUCTBUILDER_H_
+
+#include <vector>
+
+#include <math/AABB.h>
+
+#include "TypeDefs.h"
+#include "MultiGridSpacePartition.h"
+
+namespace mgsp {
+
+// This class will generate a CellStructInfo (the layout of the multi grid)
+// from a sample of the objects (and optionally of the queries) we expect to
+// have, instead of writing the subdivisions by hand.
+//
+// For each region (starting with the world) we try different grid sizes and
+// pick the cheapest one using a simple cost model:
+//
+//  cost = (cellCost * cellsVisited + objectsChecked) / numQueries +
+//         replicationCost * objectCopies / numObjects
+//
+// where cellsVisited and objectsChecked are the sum over all the query
+// samples, and objectCopies is the number of leaf cells the objects are
+// stored in (each copy makes the inserts / updates more expensive).
+// Then each cell of the chosen grid is handled as a new region, if it is
+// cheaper to subdivide it again it will become a matrix cell.
+// If no query samples are given we use the objects themselves as queries
+// (collision checks).
+//
+class CellStructBuilder
+{
+public:
+    // The parameters used to build the structure
+    //
+    struct Config {
+        // the cost of visiting one cell relative to checking one object
+        float32 cellCost;
+        // the cost of storing one extra copy of an object
+        float32 replicationCost;
+        // the maximum number of rows / columns of a matrix
+        uint8_t maxSubdivisions;
+        // the maximum number of levels (the world is the level 0)
+        unsigned int maxDepth;
+        // regions with less objects than this will not be subdivided (except
+        // the world)
+        unsigned int minObjectsToSplit;
+        // the maximum number of cells (leaf and matrix) of the structure,
+        // by default the ones we can address with the 16 bits cells
+        unsigned int maxCells;
+
+        Config() :
+            cellCost(1.f)
+        ,   replicationCost(0.5f)
+        ,   maxSubdivisions(32)
+        ,   maxDepth(3)
+        ,   minObjectsToSplit(16)
+        ,   maxCells(Cell::MAX_INDEX + 1)
+        {}
+    };
+
+public:
+    CellStructBuilder(const Config& config = Config());
+    ~CellStructBuilder();
+
+    // @brief Set / get the configuration to use
+    //
+    inline void
+    setConfig(const Config& config);
+    inline const Config&
+    config(void) const;
+
+    // @brief Build the structure information for a given world and object
+    //        (and queries) distribution. The builder is not modified, so
+    //        several threads can build with the same builder.
+    // @param world     The world we want to map (the same used in build())
+    // @param objects   The sample of object AABBs
+    // @param queries   The sample of query AABBs (could be empty)
+    // @param result    The resulting structure information
+    // @return true on success | false otherwise
+    //
+    bool
+    build(const AABB& world,
+          const std::vector<AABB>& objects,
+          const std::vector<AABB>& queries,
+          CellStructInfo& result) const;
+    inline bool
+    build(const AABB& world,
+          const std::vector<AABB>& objects,
+          CellStructInfo& result) const;
+
+private:
+
+    // The best grid found for a region
+    //
+    struct GridChoice {
+        uint8_t columns;
+        uint8_t rows;
+        float32 cost;
+    };
+
+    // The samples of one build() call and its temporary buffers, so the
+    // builder itself is not modified while building
+    //
+    struct BuildState {
+        const std::vector<AABB>* objects;
+        const std::vector<AABB>* queries;
+        float32 objectWeight;
+        float32 queryWeight;
+        std::vector<int32_t> tmpDiff;
+        std::vector<uint32_t> tmpTable;
+    };
+
+    // @brief Get the cost of a grid of columns x rows over a region
+    // @param state     The state of the current build
+    // @param region    The region
+    // @param columns   The number of columns
+    // @param rows      The number of rows
+    // @param objects   The objects (indices) intersecting the region
+    // @param queries   The queries (indices) intersecting the region
+    // @return the cost (see the class description)
+    //
+    float32
+    gridCost(BuildState& state,
+             const AABB& region,
+             uint8_t columns,
+             uint8_t rows,
+             const std::vector<unsigned int>& objects,
+             const std::vector<unsigned int>& queries) const;
+
+    // @brief Choose the best grid for a region
+    // @param state     The state of the current build
+    // @param region    The region
+    // @param objects   The objects (indices) intersecting the region
+    // @param queries   The queries (indices) intersecting the region
+    // @param maxCount  The maximum number of cells of the grid
+    //
+    GridChoice
+    chooseGrid(BuildState& state,
+               const AABB& region,
+               const std::vector<unsigned int>& objects,
+               const std::vector<unsigned int>& queries,
+               unsigned int maxCount) const;
+
+private:
+    Config mConfig;
+};
+
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline stuff
+//
+
+inline void
+CellStructBuilder::setConfig(const Config& config)
+{
+    mConfig = config;
+}
+
+inline const CellStructBuilder::Config&
+CellStructBuilder::config(void) const
+{
+    return mConfig;
+}
+
+inline bool
+CellStructBuilder::build(const AABB& world,
+                         const std::vector<AABB>& objects,
+                         CellStructInfo& result) const
+{
+    return build(world, objects, std::vector<AABB>(), result);
+}
+
+} /* namespace mgsp */
+#endif /* CELLSTRUCTBUILDER_H_ */
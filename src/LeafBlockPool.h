@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2014 agudpp
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef LEAFBLOCKPOOL_H_
+#define LEAFBLOCKPOOL_H_
+
+#include <vector>
+#include <mutex>
+#include <cstdlib>
+
+#include "debug.h"
+#include "TypeDefs.h"
+
+namespace mgsp {
+
+// Pool of the memory blocks used by the leaf cells that don't fit in their
+// inline storage (see LeafCell). The blocks are grouped in size classes (the
+// LeafCell uses the class k for a capacity of 2^k objects) and taken from big
+// slabs. The released blocks are kept in a free list per size class and
+// reused, so growing / shrinking the leaf cells doesn't hit the global
+// allocator. The memory of the slabs is only returned when the pool is
+// cleared or when there are no blocks in use (see releaseIfUnused()).
+// The pool can be used from several threads at the same time (insertBulk()
+// and the parallel writers fill different leaf cells concurrently).
+//
+class LeafBlockPool
+{
+public:
+    // the maximum number of size classes
+    static const unsigned int NUM_CLASSES = 32;
+    // the minimum size of the slabs
+    static const size_t SLAB_BYTES = 64 * 1024;
+
+public:
+    LeafBlockPool();
+    ~LeafBlockPool();
+
+    // @brief Get a block of a given size class. All the blocks of the same
+    //        size class must have the same size.
+    // @param sizeClass The size class of the block
+    // @param bytes     The size of the block in bytes
+    // @return the block (aligned to 8 bytes)
+    //
+    inline void*
+    allocate(unsigned int sizeClass, size_t bytes);
+
+    // @brief Give back a block taken with allocate()
+    // @param block     The block
+    // @param sizeClass The size class used to allocate it
+    //
+    inline void
+    deallocate(void* block, unsigned int sizeClass);
+
+    // @brief Return the memory of all the slabs. All the blocks given by the
+    //        pool are invalid after this.
+    //
+    inline void
+    clear(void);
+
+    // @brief Return the memory of all the slabs only if there are no blocks
+    //        in use.
+    // @return true if the memory was returned | false otherwise
+    //
+    inline bool
+    releaseIfUnused(void);
+
+    // @brief Return the bytes of the blocks in use and the bytes allocated
+    //        for all the slabs.
+    //
+    inline size_t
+    usedBytes(void) const;
+    inline size_t
+    reservedBytes(void) const;
+
+private:
+    // avoid copying
+    LeafBlockPool(const LeafBlockPool&);
+    LeafBlockPool& operator=(const LeafBlockPool&);
+
+    // the free blocks are linked using its first bytes
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+private:
+    mutable std::mutex mMutex;
+    FreeBlock* mFreeLists[NUM_CLASSES];
+    size_t mBlockBytes[NUM_CLASSES];
+    std::vector<char*> mSlabs;
+    // the part of the last slab not given yet
+    char* mSlabPos;
+    size_t mSlabLeft;
+    size_t mUsedBytes;
+    size_t mReservedBytes;
+};
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline stuff
+//
+
+inline
+LeafBlockPool::LeafBlockPool() :
+    mSlabPos(0)
+,   mSlabLeft(0)
+,   mUsedBytes(0)
+,   mReservedBytes(0)
+{
+    for (unsigned int i = 0; i < NUM_CLASSES; ++i) {
+        mFreeLists[i] = 0;
+        mBlockBytes[i] = 0;
+    }
+}
+
+inline
+LeafBlockPool::~LeafBlockPool()
+{
+    clear();
+}
+
+inline void*
+LeafBlockPool::allocate(unsigned int sizeClass, size_t bytes)
+{
+    ASSERT(sizeClass < NUM_CLASSES);
+    // we need space to link the block when it is free and keep the alignment
+    bytes = (bytes < sizeof(FreeBlock) ? sizeof(FreeBlock) : bytes + 7) & ~size_t(7);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ASSERT(mBlockBytes[sizeClass] == 0 || mBlockBytes[sizeClass] == bytes);
+    mBlockBytes[sizeClass] = bytes;
+    mUsedBytes += bytes;
+
+    if (mFreeLists[sizeClass] != 0) {
+        FreeBlock* block = mFreeLists[sizeClass];
+        mFreeLists[sizeClass] = block->next;
+        return block;
+    }
+
+    // the end of the current slab is lost if the block doesn't fit there
+    if (mSlabLeft < bytes) {
+        size_t slabBytes = SLAB_BYTES;
+        if (bytes > slabBytes) {
+            slabBytes = bytes;
+        }
+        mSlabPos = static_cast<char*>(std::malloc(slabBytes));
+        ASSERT(mSlabPos != 0);
+        mSlabs.push_back(mSlabPos);
+        mSlabLeft = slabBytes;
+        mReservedBytes += slabBytes;
+    }
+    void* block = mSlabPos;
+    mSlabPos += bytes;
+    mSlabLeft -= bytes;
+    return block;
+}
+
+inline void
+LeafBlockPool::deallocate(void* block, unsigned int sizeClass)
+{
+    ASSERT(block != 0);
+    ASSERT(sizeClass < NUM_CLASSES);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ASSERT(mUsedBytes >= mBlockBytes[sizeClass]);
+    mUsedBytes -= mBlockBytes[sizeClass];
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+    freeBlock->next = mFreeLists[sizeClass];
+    mFreeLists[sizeClass] = freeBlock;
+}
+
+inline void
+LeafBlockPool::clear(void)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (size_t i = 0; i < mSlabs.size(); ++i) {
+        std::free(mSlabs[i]);
+    }
+    std::vector<char*>().swap(mSlabs);
+    for (unsigned int i = 0; i < NUM_CLASSES; ++i) {
+        mFreeLists[i] = 0;
+    }
+    mSlabPos = 0;
+    mSlabLeft = 0;
+    mUsedBytes = 0;
+    mReservedBytes = 0;
+}
+
+inline bool
+LeafBlockPool::releaseIfUnused(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mUsedBytes > 0) {
+            return false;
+        }
+    }
+    clear();
+    return true;
+}
+
+inline size_t
+LeafBlockPool::usedBytes(void) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mUsedBytes;
+}
+
+inline size_t
+LeafBlockPool::reservedBytes(void) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mReservedBytes + mSlabs.capacity() * sizeof(char*);
+}
+
+} /* namespace mgsp */
+#endif /* LEAFBLOCKPOOL_H_ */
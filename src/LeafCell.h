@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef LEAFCELL_H_
+#define LEAFCELL_H_
+
+#include <vector>
+#include <algorithm>
+
+#include <math/AABB.h>
+#include <math/Vec2.h>
+
+#include "debug.h"
+#include "TypeDefs.h"
+#include "LeafBlockPool.h"
+
+// The number of objects each leaf cell can hold without taking memory from the
+// LeafBlockPool (see LeafCell).
+//
+#ifndef MGSP_LEAF_INLINE_COUNT
+#define MGSP_LEAF_INLINE_COUNT 2
+#endif
+
+namespace mgsp {
+
+// A read only view of the objects of a leaf cell: the object indices and the
+// AABB arrays (minX, minY, maxX, maxY). The arrays can be the ones of a
+// LeafCell or a range of the packed arrays of a frozen structure (see
+// MultiGridSpacePartitionT::freeze()), so the queries work with both.
+//
+template <typename IndexType>
+class LeafView
+{
+public:
+    LeafView(const IndexType* indices,
+             const float32* minX,
+             const float32* minY,
+             const float32* maxX,
+             const float32* maxY,
+             size_t size) :
+        mIndices(indices)
+    ,   mMinX(minX)
+    ,   mMinY(minY)
+    ,   mMaxX(maxX)
+    ,   mMaxY(maxY)
+    ,   mSize(size)
+    {}
+
+    // @brief Return the number of objects in the cell
+    //
+    inline size_t
+    size(void) const {return mSize;}
+    inline bool
+    empty(void) const {return mSize == 0;}
+
+    // @brief Access to the object indices and the AABB arrays
+    //
+    inline IndexType
+    index(size_t i) const {ASSERT(i < size()); return mIndices[i];}
+    inline const IndexType*
+    indices(void) const {return mIndices;}
+    inline const float32*
+    minX(void) const {return mMinX;}
+    inline const float32*
+    minY(void) const {return mMinY;}
+    inline const float32*
+    maxX(void) const {return mMaxX;}
+    inline const float32*
+    maxY(void) const {return mMaxY;}
+
+    // @brief Return the AABB of the object i
+    //
+    inline AABB
+    box(size_t i) const;
+
+    // @brief Check if the AABB of the object i collides with a given AABB /
+    //        point.
+    //
+    inline bool
+    collide(size_t i, const AABB& aabb) const;
+    inline bool
+    checkPointInside(size_t i, const Vector2& p) const;
+
+    // @brief Check the objects [begin, begin + AABB_MASK_BITS) against an AABB
+    //        at once (see collideMask()).
+    // @param begin     The first object to check
+    // @param aabb      The AABB to check
+    // @return the mask of the objects colliding (bit i => object begin + i)
+    //
+    inline uint32_t
+    collideMask(size_t begin, const AABB& aabb) const;
+
+private:
+    const IndexType* mIndices;
+    const float32* mMinX;
+    const float32* mMinY;
+    const float32* mMaxX;
+    const float32* mMaxY;
+    size_t mSize;
+};
+
+// This class represents the content of a leaf cell. For each object in the
+// cell we will save its index and also a copy of its AABB, split in 4 arrays
+// (minX, minY, maxX, maxY), so we can check all the objects of the cell reading
+// contiguous memory without accessing the objects themselves.
+// The first InlineCount objects are stored inside of the cell itself (most of
+// the leaf cells have only a few objects), when the cell needs more space all
+// the arrays are moved into one block of a LeafBlockPool owned by the
+// partition (the methods that can allocate / release memory receive it).
+// The cell doesn't own the pooled block: it must be given back with release()
+// before destroying the cell (or the whole pool cleared). When objects are
+// removed the cell moves them back to the inline storage (or to a smaller
+// block) so the sparse cells don't keep the block of their peak size.
+// The order of the objects is not maintained when removing them.
+//
+template <typename IndexType, unsigned int InlineCount = MGSP_LEAF_INLINE_COUNT>
+class LeafCell
+{
+public:
+    // the number of objects stored in the cell without using the pool
+    static const unsigned int INLINE_COUNT = InlineCount;
+    // the bytes used by each object (the index and its AABB)
+    static const size_t ENTRY_BYTES = sizeof(IndexType) + 4 * sizeof(float32);
+
+public:
+    LeafCell() :
+        mSize(0)
+    ,   mCapacity(InlineCount)
+    ,   mBlock(0)
+    ,   mInlineBoxes()
+    ,   mInlineIndices()
+    {}
+    ~LeafCell(){}
+
+    // the cells can only be moved (the pooled block is not duplicated)
+    inline LeafCell(LeafCell&& other);
+    inline LeafCell&
+    operator=(LeafCell&& other) {swap(other); return *this;}
+
+    // @brief Return the number of objects in the cell
+    //
+    inline size_t
+    size(void) const {return mSize;}
+    inline bool
+    empty(void) const {return mSize == 0;}
+
+    // @brief Check if the objects are in the inline storage of the cell
+    //
+    inline bool
+    isInline(void) const {return mBlock == 0;}
+
+    // @brief Return the bytes used by the objects of the cell (indices and
+    //        AABBs) and the bytes of its pooled block (0 if the objects are
+    //        in the inline storage, counted as part of the cell).
+    //
+    inline size_t
+    usedBytes(void) const {return size() * ENTRY_BYTES;}
+    inline size_t
+    reservedBytes(void) const {return isInline() ? 0 : mCapacity * ENTRY_BYTES;}
+
+    // @brief Access to the object indices and the AABB arrays
+    //
+    inline IndexType
+    index(size_t i) const {ASSERT(i < size()); return indices()[i];}
+    inline const IndexType*
+    indices(void) const;
+    inline const float32*
+    minX(void) const {return boxes();}
+    inline const float32*
+    minY(void) const {return boxes() + mCapacity;}
+    inline const float32*
+    maxX(void) const {return boxes() + 2 * mCapacity;}
+    inline const float32*
+    maxY(void) const {return boxes() + 3 * mCapacity;}
+
+    // @brief Return a read only view of the objects of the cell
+    //
+    inline LeafView<IndexType>
+    view(void) const;
+
+    // @brief Return the AABB of the object i
+    //
+    inline AABB
+    box(size_t i) const {return view().box(i);}
+
+    // @brief Check if the AABB of the object i collides with a given AABB /
+    //        point.
+    //
+    inline bool
+    collide(size_t i, const AABB& aabb) const {return view().collide(i, aabb);}
+    inline bool
+    checkPointInside(size_t i, const Vector2& p) const
+    {
+        return view().checkPointInside(i, p);
+    }
+
+    // @brief Check the objects [begin, begin + AABB_MASK_BITS) against an AABB
+    //        at once (see LeafView::collideMask()).
+    //
+    inline uint32_t
+    collideMask(size_t begin, const AABB& aabb) const
+    {
+        return view().collideMask(begin, aabb);
+    }
+
+    // @brief Reserve memory for a given number of objects
+    // @param count     The number of objects
+    // @param pool      The pool used if the inline storage is not enough
+    //
+    inline void
+    reserve(size_t count, LeafBlockPool& pool);
+
+    // @brief Add a new object to the cell.
+    // @param index     The index of the object
+    // @param aabb      The AABB of the object
+    // @param pool      The pool used if the cell needs to grow
+    //
+    inline void
+    push_back(IndexType index, const AABB& aabb, LeafBlockPool& pool);
+
+    // @brief Remove an object from the cell. When only a quarter of the
+    //        pooled block is used the objects are moved to the inline storage
+    //        (if they fit) or to a block of half the capacity.
+    // @param index     The index of the object
+    // @param pool      The pool used to allocate the block
+    // @return true if the object was removed | false if it was not here
+    //
+    inline bool
+    remove(IndexType index, LeafBlockPool& pool);
+
+    // @brief Update the AABB of an object in the cell
+    // @param index     The index of the object
+    // @param aabb      The new AABB
+    // @return true if the object was found | false otherwise
+    //
+    inline bool
+    updateBox(IndexType index, const AABB& aabb);
+
+    // @brief Remove all the objects and give back the pooled block (if any)
+    // @param pool      The pool used to allocate the block
+    //
+    inline void
+    release(LeafBlockPool& pool);
+
+    // @brief Swap the contents of two cells
+    //
+    inline void
+    swap(LeafCell& other);
+
+private:
+    // avoid copying
+    LeafCell(const LeafCell&);
+    LeafCell& operator=(const LeafCell&);
+
+    // @brief The AABB arrays and the indices (inline or in the pooled block).
+    //        The block contains [minX, minY, maxX, maxY, indices] each one
+    //        with mCapacity elements.
+    //
+    inline const float32*
+    boxes(void) const {return isInline() ? mInlineBoxes : mBlock;}
+    inline float32*
+    boxes(void) {return isInline() ? mInlineBoxes : mBlock;}
+    inline IndexType*
+    indices(void);
+
+    // @brief Return the size class of the pool used for a given capacity
+    //
+    static inline unsigned int
+    sizeClass(size_t capacity);
+
+    // @brief Move the objects into a pooled block for (at least) count
+    //        objects
+    //
+    inline void
+    grow(size_t count, LeafBlockPool& pool);
+
+    // @brief Move the objects into the inline storage or into a smaller
+    //        pooled block if only a quarter of the current one is used
+    //
+    inline void
+    shrink(LeafBlockPool& pool);
+
+    // @brief Copy the objects into new arrays (block == 0 for the inline
+    //        storage) of a given capacity, giving back the current block
+    //
+    inline void
+    moveTo(float32* block, size_t capacity, LeafBlockPool& pool);
+
+    // @brief Find the position of an object in the cell (or size() if not)
+    //
+    inline size_t
+    find(IndexType index) const;
+
+private:
+    uint32_t mSize;
+    uint32_t mCapacity;
+    float32* mBlock;
+    float32 mInlineBoxes[4 * InlineCount];
+    IndexType mInlineIndices[InlineCount];
+};
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline stuff
+//
+
+template <typename IndexType>
+inline bool
+LeafView<IndexType>::collide(size_t i, const AABB& aabb) const
+{
+    ASSERT(i < size());
+    // same than AABB::collide()
+    return !((mMaxX[i] < aabb.tl.x) || (mMinX[i] > aabb.br.x) ||
+             (mMaxY[i] < aabb.br.y) || (aabb.tl.y < mMinY[i]));
+}
+
+template <typename IndexType>
+inline AABB
+LeafView<IndexType>::box(size_t i) const
+{
+    ASSERT(i < size());
+    return AABB(mMaxY[i], mMinX[i], mMinY[i], mMaxX[i]);
+}
+
+template <typename IndexType>
+inline bool
+LeafView<IndexType>::checkPointInside(size_t i, const Vector2& p) const
+{
+    ASSERT(i < size());
+    return p.x >= mMinX[i] && p.x <= mMaxX[i] && p.y >= mMinY[i] && p.y <= mMaxY[i];
+}
+
+template <typename IndexType>
+inline uint32_t
+LeafView<IndexType>::collideMask(size_t begin, const AABB& aabb) const
+{
+    ASSERT(begin < size());
+    const size_t count = size() - begin < AABB_MASK_BITS ? size() - begin : AABB_MASK_BITS;
+    return mgsp::collideMask(aabb,
+                             mMinX + begin,
+                             mMinY + begin,
+                             mMaxX + begin,
+                             mMaxY + begin,
+                             count);
+}
+
+template <typename IndexType, unsigned int InlineCount>
+const unsigned int LeafCell<IndexType, InlineCount>::INLINE_COUNT;
+template <typename IndexType, unsigned int InlineCount>
+const size_t LeafCell<IndexType, InlineCount>::ENTRY_BYTES;
+
+template <typename IndexType, unsigned int InlineCount>
+inline
+LeafCell<IndexType, InlineCount>::LeafCell(LeafCell&& other) :
+    mSize(0)
+,   mCapacity(InlineCount)
+,   mBlock(0)
+,   mInlineBoxes()
+,   mInlineIndices()
+{
+    swap(other);
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline const IndexType*
+LeafCell<IndexType, InlineCount>::indices(void) const
+{
+    return isInline() ? mInlineIndices :
+        reinterpret_cast<const IndexType*>(mBlock + 4 * mCapacity);
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline IndexType*
+LeafCell<IndexType, InlineCount>::indices(void)
+{
+    return isInline() ? mInlineIndices :
+        reinterpret_cast<IndexType*>(mBlock + 4 * mCapacity);
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline LeafView<IndexType>
+LeafCell<IndexType, InlineCount>::view(void) const
+{
+    return LeafView<IndexType>(indices(), minX(), minY(), maxX(), maxY(), size());
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline unsigned int
+LeafCell<IndexType, InlineCount>::sizeClass(size_t capacity)
+{
+    unsigned int result = 0;
+    for (; (size_t(1) << result) < capacity; ++result);
+    ASSERT((size_t(1) << result) == capacity);
+    return result;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::grow(size_t count, LeafBlockPool& pool)
+{
+    // the pooled blocks have a capacity of 2^k and at least double the current
+    // one
+    size_t capacity = 1;
+    while (capacity < count || capacity < 2 * mCapacity) {
+        capacity <<= 1;
+    }
+    float32* block = static_cast<float32*>(
+        pool.allocate(sizeClass(capacity), capacity * ENTRY_BYTES));
+    moveTo(block, capacity, pool);
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::shrink(LeafBlockPool& pool)
+{
+    // we only shrink when a quarter of the block is used, so adding and
+    // removing one object doesn't allocate / release a block each time
+    if (isInline() || mSize > mCapacity / 4) {
+        return;
+    }
+    if (mSize <= InlineCount) {
+        moveTo(0, InlineCount, pool);
+    } else {
+        const size_t capacity = mCapacity / 2;
+        float32* block = static_cast<float32*>(
+            pool.allocate(sizeClass(capacity), capacity * ENTRY_BYTES));
+        moveTo(block, capacity, pool);
+    }
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::moveTo(float32* block,
+                                         size_t capacity,
+                                         LeafBlockPool& pool)
+{
+    ASSERT(mSize <= capacity);
+    float32* newBoxes = block == 0 ? mInlineBoxes : block;
+    IndexType* newIndices = block == 0 ? mInlineIndices :
+        reinterpret_cast<IndexType*>(block + 4 * capacity);
+
+    // copy each array into its place in the new storage (the inline one is
+    // only the destination when we come from a block, so they don't overlap)
+    const float32* oldBoxes = boxes();
+    for (unsigned int a = 0; a < 4; ++a) {
+        std::copy(oldBoxes + a * mCapacity, oldBoxes + a * mCapacity + mSize,
+                  newBoxes + a * capacity);
+    }
+    const IndexType* oldIndices = indices();
+    std::copy(oldIndices, oldIndices + mSize, newIndices);
+
+    if (!isInline()) {
+        pool.deallocate(mBlock, sizeClass(mCapacity));
+    }
+    mBlock = block;
+    mCapacity = capacity;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::reserve(size_t count, LeafBlockPool& pool)
+{
+    if (count > mCapacity) {
+        grow(count, pool);
+    }
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::push_back(IndexType index,
+                                            const AABB& aabb,
+                                            LeafBlockPool& pool)
+{
+    if (mSize == mCapacity) {
+        grow(mSize + 1, pool);
+    }
+    float32* b = boxes();
+    b[mSize] = aabb.tl.x;
+    b[mCapacity + mSize] = aabb.br.y;
+    b[2 * mCapacity + mSize] = aabb.br.x;
+    b[3 * mCapacity + mSize] = aabb.tl.y;
+    indices()[mSize] = index;
+    ++mSize;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline bool
+LeafCell<IndexType, InlineCount>::remove(IndexType index, LeafBlockPool& pool)
+{
+    const size_t i = find(index);
+    if (i == size()) {
+        return false;
+    }
+    // move the last one here
+    --mSize;
+    float32* b = boxes();
+    for (unsigned int a = 0; a < 4; ++a) {
+        b[a * mCapacity + i] = b[a * mCapacity + mSize];
+    }
+    indices()[i] = indices()[mSize];
+    shrink(pool);
+    return true;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline bool
+LeafCell<IndexType, InlineCount>::updateBox(IndexType index, const AABB& aabb)
+{
+    const size_t i = find(index);
+    if (i == size()) {
+        return false;
+    }
+    float32* b = boxes();
+    b[i] = aabb.tl.x;
+    b[mCapacity + i] = aabb.br.y;
+    b[2 * mCapacity + i] = aabb.br.x;
+    b[3 * mCapacity + i] = aabb.tl.y;
+    return true;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::release(LeafBlockPool& pool)
+{
+    if (!isInline()) {
+        pool.deallocate(mBlock, sizeClass(mCapacity));
+    }
+    mSize = 0;
+    mCapacity = InlineCount;
+    mBlock = 0;
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline void
+LeafCell<IndexType, InlineCount>::swap(LeafCell& other)
+{
+    std::swap(mSize, other.mSize);
+    std::swap(mCapacity, other.mCapacity);
+    std::swap(mBlock, other.mBlock);
+    for (unsigned int i = 0; i < 4 * InlineCount; ++i) {
+        std::swap(mInlineBoxes[i], other.mInlineBoxes[i]);
+    }
+    for (unsigned int i = 0; i < InlineCount; ++i) {
+        std::swap(mInlineIndices[i], other.mInlineIndices[i]);
+    }
+}
+
+template <typename IndexType, unsigned int InlineCount>
+inline size_t
+LeafCell<IndexType, InlineCount>::find(IndexType index) const
+{
+    const IndexType* ids = indices();
+    size_t i = 0;
+    for (; i < mSize && ids[i] != index; ++i);
+    return i;
+}
+
+} /* namespace mgsp */
+#endif /* LEAFCELL_H_ */
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef MAPPEDARRAY_H_
+#define MAPPEDARRAY_H_
+
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "TypeDefs.h"
+
+namespace mgsp {
+
+// This class will map a file (read only / copy on write) into memory. The
+// pages are shared between all the processes mapping the same file until
+// somebody writes on them.
+//
+class MappedFile
+{
+public:
+    MappedFile() : mData(0), mSize(0) {}
+    ~MappedFile() {close();}
+
+    // @brief Map a file into memory. If there was a file already mapped it
+    //        will be unmapped first.
+    // @param filename  The file to map
+    // @return true on success | false otherwise
+    //
+    inline bool
+    open(const char* filename);
+
+    // @brief Unmap the current file (if any)
+    //
+    inline void
+    close(void);
+
+    // @brief Return the mapped memory and its size
+    //
+    inline char*
+    data(void) const {return mData;}
+    inline size_t
+    size(void) const {return mSize;}
+    inline bool
+    isOpen(void) const {return mData != 0;}
+
+private:
+    // avoid copying
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    char* mData;
+    size_t mSize;
+};
+
+
+// This class will behave like a (very reduced) std::vector but can also
+// point to external memory (for example a mapped file) without owning it.
+// Any operation that changes the size of the array will copy the external
+// memory into the owned vector first (detach).
+// Note that T should be a plain old data structure since we will not construct
+// the elements that live in the external memory.
+//
+template <typename T>
+class MappedArray
+{
+public:
+    MappedArray() : mExtData(0), mExtSize(0) {}
+    ~MappedArray() {}
+
+    // @brief Use external memory as the content of this array. The memory
+    //        should be valid while this array is using it.
+    // @param data      The external memory
+    // @param size      The number of elements
+    //
+    inline void
+    adopt(T* data, size_t size);
+
+    // @brief Check if we are using external memory or not
+    //
+    inline bool
+    isMapped(void) const {return mExtData != 0;}
+
+    // @brief Copy the external memory (if any) into our own memory
+    //
+    inline void
+    detach(void);
+
+    // std::vector like interface
+    //
+    inline size_t
+    size(void) const {return isMapped() ? mExtSize : mData.size();}
+    inline bool
+    empty(void) const {return size() == 0;}
+    inline size_t
+    capacity(void) const {return isMapped() ? mExtSize : mData.capacity();}
+    inline T*
+    data(void) {return isMapped() ? mExtData : mData.data();}
+    inline const T*
+    data(void) const {return isMapped() ? mExtData : mData.data();}
+    inline T&
+    operator[](size_t i) {ASSERT(i < size()); return data()[i];}
+    inline const T&
+    operator[](size_t i) const {ASSERT(i < size()); return data()[i];}
+    inline T&
+    back(void) {ASSERT(!empty()); return data()[size()-1];}
+
+    inline void
+    clear(void);
+    inline void
+    resize(size_t size);
+    inline void
+    reserve(size_t size) {detach(); mData.reserve(size);}
+    inline void
+    push_back(const T& elem) {detach(); mData.push_back(elem);}
+
+private:
+    std::vector<T> mData;
+    T* mExtData;
+    size_t mExtSize;
+};
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline stuff
+//
+
+inline bool
+MappedFile::open(const char* filename)
+{
+    close();
+    ASSERT(filename != 0);
+
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        DEBUG_PRINT("Error opening file " << filename << std::endl);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        DEBUG_PRINT("Error getting the size of the file " << filename << std::endl);
+        ::close(fd);
+        return false;
+    }
+
+    // we map it private so we can still write on the pages (copy on write)
+    // if we need it, and the rest of the pages still be shared.
+    void* mem = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps its own reference to the file
+    if (mem == MAP_FAILED) {
+        DEBUG_PRINT("Error mapping the file " << filename << std::endl);
+        return false;
+    }
+    mData = static_cast<char*>(mem);
+    mSize = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+inline void
+MappedFile::close(void)
+{
+    if (mData != 0) {
+        munmap(mData, mSize);
+        mData = 0;
+        mSize = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename T>
+inline void
+MappedArray<T>::adopt(T* data, size_t size)
+{
+    mData.clear();
+    mData.shrink_to_fit();
+    mExtData = data;
+    mExtSize = size;
+}
+
+template <typename T>
+inline void
+MappedArray<T>::detach(void)
+{
+    if (!isMapped()) {
+        return;
+    }
+    mData.assign(mExtData, mExtData + mExtSize);
+    mExtData = 0;
+    mExtSize = 0;
+}
+
+template <typename T>
+inline void
+MappedArray<T>::clear(void)
+{
+    mExtData = 0;
+    mExtSize = 0;
+    mData.clear();
+}
+
+template <typename T>
+inline void
+MappedArray<T>::resize(size_t size)
+{
+    detach();
+    mData.resize(size);
+}
+
+} /* namespace mgsp */
+#endif /* MAPPEDARRAY_H_ */
@@ -35,6 +35,21 @@
 
 namespace mgsp {
 
+// A range of rows and columns [begin, end] of a matrix
+//
+struct CellRange {
+    size_t rowBegin;
+    size_t rowEnd;
+    size_t colBegin;
+    size_t colEnd;
+
+    inline bool
+    contains(size_t row, size_t col) const
+    {
+        return row >= rowBegin && row <= rowEnd && col >= colBegin && col <= colEnd;
+    }
+};
+
 template <typename IndexType>
 class MatrixPartition
 {
@@ -94,6 +109,44 @@ public:
     inline void
     getCells(const AABB& aabb, std::vector<IndexType>& result) const;
 
+    // @brief Get the associated cells indices that intersects a given circle
+    //        (only the cells whose rectangle touch the circle).
+    // @param center    The center of the circle
+    // @param radius    The radius of the circle
+    // @param result    The list of cells intersecting the circle
+    //
+    inline void
+    getCells(const Vector2& center, float32 radius, std::vector<IndexType>& result) const;
+
+    // @brief Get the range of rows and columns that intersects a given AABB
+    // @param aabb      The AABB of the query
+    // @param range     The resulting range
+    // @return false if the AABB doesn't intersect this matrix | true otherwise
+    //
+    inline bool
+    getCellRange(const AABB& aabb, CellRange& range) const;
+
+    // @brief Get the (clamped) row / column of a y / x world position
+    //
+    inline size_t
+    getRow(float32 y) const;
+    inline size_t
+    getColumn(float32 x) const;
+
+    // @brief Return the size of each one of the cells
+    //
+    inline float32
+    cellWidth(void) const;
+    inline float32
+    cellHeight(void) const;
+
+    // @brief Get the bounding box (world space) of a cell
+    // @param row   The row
+    // @param col   The column
+    //
+    inline AABB
+    getCellBoundingBox(size_t row, size_t col) const;
+
     // @brief Check if a cell id is valid
     // @param index   The index of the cell to be checked
     //
@@ -230,33 +283,121 @@ inline void
 MatrixPartition<IndexType>::getCells(const AABB& aabb, std::vector<IndexType>& result) const
 {
     result.clear();
-    // do fast check first
-    if (!mBoundingBox.collide(aabb)) {
+    CellRange range;
+    if (!getCellRange(aabb, range)) {
         DEBUG_PRINT("ERROR: aabb:" << aabb << "\nand the current matrix world: " << mBoundingBox);
         ASSERT(false);
         return;
     }
 
-    // we can ensure that we have a intersection, get the x ranges and y ranges
-    size_t rowBegin = getClampedY(aabb.br.y),
-                 rowEnd = getClampedY(aabb.tl.y),
-                 colBegin = getClampedX(aabb.tl.x),
-                 colEnd = getClampedX(aabb.br.x);
-
     // we will not reserve space for the result since we assume that the vector
     // was used before and already contains sufficient space to allocate this
 
     // TODO: optimize this
-    DEBUG_PRINT("rowBegin: " << rowBegin << ", rowEnd: " << rowEnd <<
-                ", colBegin: " << colBegin << ", colEnd: " << colEnd <<
+    DEBUG_PRINT("rowBegin: " << range.rowBegin << ", rowEnd: " << range.rowEnd <<
+                ", colBegin: " << range.colBegin << ", colEnd: " << range.colEnd <<
                 ", numRows: " << (int)mNumRows << ", numCols: " << (int)mNumColumns << std::endl);
-    for (; rowBegin <= rowEnd; ++rowBegin) {
-        for (size_t col = colBegin; col <= colEnd; ++col) {
-            result.push_back(getCellIndex(rowBegin, col));
+    for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+        for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+            result.push_back(getCellIndex(row, col));
         }
     }
 }
 
+template<typename IndexType>
+inline void
+MatrixPartition<IndexType>::getCells(const Vector2& center,
+                                     float32 radius,
+                                     std::vector<IndexType>& result) const
+{
+    result.clear();
+    CellRange range;
+    const AABB circleBB(center.y + radius, center.x - radius,
+                        center.y - radius, center.x + radius);
+    if (!getCellRange(circleBB, range)) {
+        return;
+    }
+
+    // check each cell of the range against the circle, per row we only need
+    // the vertical distance once
+    const float32 width = cellWidth();
+    const float32 height = cellHeight();
+    const float32 radius2 = radius * radius;
+    for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+        const float32 bottom = mBoundingBox.br.y + height * static_cast<float32>(row);
+        const float32 dy = center.y < bottom ? bottom - center.y :
+            (center.y > bottom + height ? center.y - bottom - height : 0.f);
+        const float32 dy2 = dy * dy;
+        if (dy2 > radius2) {
+            continue;
+        }
+        for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+            const float32 left = mBoundingBox.tl.x + width * static_cast<float32>(col);
+            const float32 dx = center.x < left ? left - center.x :
+                (center.x > left + width ? center.x - left - width : 0.f);
+            if (dx * dx + dy2 <= radius2) {
+                result.push_back(getCellIndex(row, col));
+            }
+        }
+    }
+}
+
+template<typename IndexType>
+inline bool
+MatrixPartition<IndexType>::getCellRange(const AABB& aabb, CellRange& range) const
+{
+    // do fast check first
+    if (!mBoundingBox.collide(aabb)) {
+        return false;
+    }
+
+    // we can ensure that we have a intersection, get the x ranges and y ranges
+    range.rowBegin = getClampedY(aabb.br.y);
+    range.rowEnd = getClampedY(aabb.tl.y);
+    range.colBegin = getClampedX(aabb.tl.x);
+    range.colEnd = getClampedX(aabb.br.x);
+    return true;
+}
+
+template<typename IndexType>
+inline size_t
+MatrixPartition<IndexType>::getRow(float32 y) const
+{
+    return getClampedY(y);
+}
+template<typename IndexType>
+inline size_t
+MatrixPartition<IndexType>::getColumn(float32 x) const
+{
+    return getClampedX(x);
+}
+
+template<typename IndexType>
+inline float32
+MatrixPartition<IndexType>::cellWidth(void) const
+{
+    return mBoundingBox.getWidth() / static_cast<float32>(mNumColumns);
+}
+template<typename IndexType>
+inline float32
+MatrixPartition<IndexType>::cellHeight(void) const
+{
+    return mBoundingBox.getHeight() / static_cast<float32>(mNumRows);
+}
+
+template<typename IndexType>
+inline AABB
+MatrixPartition<IndexType>::getCellBoundingBox(size_t row, size_t col) const
+{
+    ASSERT(row < mNumRows);
+    ASSERT(col < mNumColumns);
+    const float32 width = cellWidth();
+    const float32 height = cellHeight();
+    const float32 bottom = mBoundingBox.br.y + height * static_cast<float32>(row);
+    const float32 left = mBoundingBox.tl.x + width * static_cast<float32>(col);
+    return AABB(bottom + height, left, bottom, left + width);
+}
+
 template<typename IndexType>
 inline bool
 MatrixPartition<IndexType>::isIndexValid(IndexType index) const
@@ -20,9 +20,17 @@
  */
 
 #include <map>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <new>
+#include <cmath>
+#include <limits>
+#include <functional>
 
 
 #include "MultiGridSpacePartition.h"
+#include "ThreadPool.h"
 
 
 // Helper methods
@@ -89,85 +97,123 @@ struct CellInfoContext{
 
 ////////////////////////////////////////////////////////////////////////////
 
-struct IndexAction {
-    enum Action { MAINTAIN = 0, ADD, REMOVE } action;
-    mgsp::uint16_t index;
-    IndexAction(Action a, mgsp::uint16_t i) : action(a), index(i) {}
-    IndexAction(){}
-};
-
-// @brief This method will return a list of {index,action} indicating the action
-//        to take to all the indices. Basically, from two lists (old, new) indices,
-//        we need to mark the indices as ADD, REMOVE, MAINTAIN.
-// @param newIndices    The list of new indices
-// @param oldIndices    The list with the old indices
-// @param result        The resulting IndexAction buffer.
-// @param resultSize    The resulting IndexAction buffer size.
+// The action we need to do over a leaf cell when committing the updates
 //
-inline void
-getIndexAction(const std::vector<mgsp::uint16_t>& newIndices,
-               const std::vector<mgsp::uint16_t>& oldIndices,
-               IndexAction* result,
-               mgsp::size_t& size)
-{
-    // TODO: optimize this, this could be optimized a lot. Now we will assume
-    // that the number of newIndices and oldIndices are not too much, so
-    // we hope that we can have a good performance thanks to cache.
-    // We can use a bitset<mLeafCells.size()> or something like that to do a fast
-    // check (note the cost for the initialization of the bitset).
-    //
-    size = newIndices.size();
-    for (mgsp::size_t i = 0; i < size; ++i) {
-        result[i].index = newIndices[i];
-        result[i].action = IndexAction::ADD;
-    }
+struct LeafAction {
+    mgsp::uint32_t leaf;
+    mgsp::uint16_t action;
+    mgsp::ObjectIndex object;
+    const mgsp::AABB* aabb;
+
+    LeafAction(mgsp::uint32_t l, int a, mgsp::ObjectIndex o, const mgsp::AABB* bb) :
+        leaf(l), action(a), object(o), aabb(bb)
+    {}
 
-    // now for each old index we have to check if the index already exists
-    for (mgsp::size_t i = 0; i < oldIndices.size(); ++i) {
-        mgsp::size_t j = 0;
-        for (; j < newIndices.size(); ++j) {
-            if (result[j].index == oldIndices[i]) {
-                // we need to mark this one as "Maintain"
-                result[j].action = IndexAction::MAINTAIN;
-                break; // no more elements are needed to analyze
-            }
-        }
-        // if we didn't find any we need to add the element to the result
-        if (j == newIndices.size()) {
-            result[size++] = IndexAction(IndexAction::REMOVE, oldIndices[i]);
-        }
+    // sort them by leaf and then by action (LeafChange order)
+    inline bool
+    operator<(const LeafAction& o) const
+    {
+        return leaf < o.leaf || (leaf == o.leaf && action < o.action);
     }
-}
-
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 
-// @brief Helper method to remove an element from a vector without maintaining
-//        the order of it.
-// @param vec       The vector
-// @param elem      The element to remove
+// The structure file format. All the sections are aligned to
+// STRUCT_FILE_ALIGNMENT bytes from the beginning of the file so we can use
+// them directly from the mapped memory.
+//
+// [StructFileHeader][Cells][Matrices]
+//
+const char STRUCT_FILE_MAGIC[4] = {'M', 'G', 'S', 'P'};
+const mgsp::uint32_t STRUCT_FILE_VERSION = 1;
+const mgsp::uint32_t STRUCT_FILE_BYTE_ORDER = 0x01020304;
+const mgsp::uint64_t STRUCT_FILE_ALIGNMENT = 16;
+
+struct StructFileHeader {
+    char magic[4];
+    mgsp::uint32_t version;
+    mgsp::uint32_t byteOrder;
+    // sizes of the types we are writing, if they not match we cannot load it
+    mgsp::uint32_t cellSize;
+    mgsp::uint32_t matrixSize;
+    mgsp::uint32_t objectIndexSize;
+    // the world
+    mgsp::float32 worldTop;
+    mgsp::float32 worldLeft;
+    mgsp::float32 worldBottom;
+    mgsp::float32 worldRight;
+    // the sections
+    mgsp::uint64_t numCells;
+    mgsp::uint64_t numMatrices;
+    mgsp::uint64_t numLeaves;
+    mgsp::uint64_t cellsOffset;
+    mgsp::uint64_t matricesOffset;
+    mgsp::uint64_t fileSize;
+};
+
+inline mgsp::uint64_t
+alignOffset(mgsp::uint64_t offset)
+{
+    return (offset + STRUCT_FILE_ALIGNMENT - 1) & ~(STRUCT_FILE_ALIGNMENT - 1);
+}
+
+// Squared distance from a point to a rectangle (0 if it is inside). Same
+// than AABB::squaredDistance() but for bounds we don't have as an AABB: the
+// SoA bounds of the leaf cells and the ring strips of getNearest().
 //
-template <typename T>
-inline void
-removeUnsorted(std::vector<T>& vec, const T& elem)
+inline mgsp::float32
+squaredDistance(const mgsp::Vector2& p,
+                mgsp::float32 minX,
+                mgsp::float32 minY,
+                mgsp::float32 maxX,
+                mgsp::float32 maxY)
 {
-    mgsp::size_t i = 0;
-    for (; i < vec.size() && vec[i] != elem; ++i);
-    if (i == vec.size()) return;
-    vec[i] = vec.back();
-    vec.pop_back();
+    const mgsp::float32 dx = p.x < minX ? minX - p.x : (p.x > maxX ? p.x - maxX : 0.f);
+    const mgsp::float32 dy = p.y < minY ? minY - p.y : (p.y > maxY ? p.y - maxY : 0.f);
+    return dx * dx + dy * dy;
 }
 
+// The bounds of an empty leaf cell in the loose mode (doesn't collide with
+// anything and grows to contain the first object added)
+//
+const mgsp::AABB EMPTY_LOOSE_BOUNDS(-std::numeric_limits<mgsp::float32>::max(),
+                                    std::numeric_limits<mgsp::float32>::max(),
+                                    std::numeric_limits<mgsp::float32>::max(),
+                                    -std::numeric_limits<mgsp::float32>::max());
+
 }
 
 
 namespace mgsp {
 
+template <typename IndexType>
+const unsigned int MultiGridSpacePartitionT<IndexType>::NO_PENDING_UPDATE;
+template <typename IndexType>
+const uint16_t MultiGridSpacePartitionT<IndexType>::NEAREST_LEAF;
+template <typename IndexType>
+const IndexType MultiGridSpacePartitionT<IndexType>::NO_INDEX;
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getIDsFromAABB(const AABB& aabb,
+                                                    std::vector<IndexType>& ids) const
+{
+    getIDsFromAABB(aabb, ids, mTmpMatrixIds, mTmpIndices);
+}
+
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::getIDsFromAABB(const AABB& aabb,
-                                        std::vector<uint16_t>& ids) const
+MultiGridSpacePartitionT<IndexType>::getIDsFromAABB(const AABB& aabb,
+                                                    std::vector<IndexType>& ids,
+                                                    std::vector<IndexType>& matrixIds,
+                                                    std::vector<IndexType>& cellIndices,
+                                                    QueryStats* stats) const
 {
+    // the stats are only used when compiling with MGSP_STATS
+    (void)stats;
     ids.clear();
 
     // Here what we need to do is:
@@ -178,63 +224,603 @@ MultiGridSpacePartition::getIDsFromAABB(const AABB& aabb,
     //
 
     // start with the first one
-    mTmpMatrixIds.clear();
-    mTmpMatrixIds.push_back(0); //0 == getRootMatrix()
+    matrixIds.clear();
+    matrixIds.push_back(0); //0 == getRootMatrix()
 
     DEBUG_PRINT("Getting ids for an AABB: " << aabb << std::endl);
-    while (!mTmpMatrixIds.empty()) {
-        const uint16_t mindex = mTmpMatrixIds.back();
-        mTmpMatrixIds.pop_back();
+    while (!matrixIds.empty()) {
+        const IndexType mindex = matrixIds.back();
+        matrixIds.pop_back();
+        MGSP_STAT(if (stats != 0) ++stats->matrices;)
 
-        // get all the cells that intersects this matrix
+        // get all the cells that intersects this matrix (and the objects
+        // spanning it)
         ASSERT(mindex < mMatrixCells.size());
-        const MatrixPartition<uint16_t>& matrix = mMatrixCells[mindex];
-        matrix.getCells(aabb, mTmpIndices);
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+        if (hasSpanningObjects(mindex)) {
+            ids.push_back(mMatrixSpanning[mindex]);
+        }
+        matrix.getCells(aabb, cellIndices);
         DEBUG_PRINT("Getting cells for matrix (index): " << mindex <<
                     " and with bounding box: " << matrix.boundingBox() <<
                     "\nWith child indices: \n");
 
         // iterate over all the cells and check if is a matrix or leaf cell
-        for (size_t i = 0; i < mTmpIndices.size(); ++i) {
-            DEBUG_PRINT("\tChild Cell Index: " << mTmpIndices[i]);
-            ASSERT(mTmpIndices[i] < mCells.size());
-            const Cell& cell = mCells[mTmpIndices[i]];
+        for (size_t i = 0; i < cellIndices.size(); ++i) {
+            DEBUG_PRINT("\tChild Cell Index: " << cellIndices[i]);
+            ASSERT(cellIndices[i] < mCells.size());
+            const CellType& cell = mCells[cellIndices[i]];
             if (cell.isLeaf()) {
                 ids.push_back(cell.index());
                 DEBUG_PRINT("\tleaf\n");
             } else {
-                mTmpMatrixIds.push_back(cell.index());
+                matrixIds.push_back(cell.index());
                 DEBUG_PRINT("\tmatrix\n");
             }
         }
     }
 }
 
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getIDsFromCircle(const Vector2& center,
+                                                      float32 radius,
+                                                      std::vector<IndexType>& ids,
+                                                      std::vector<IndexType>& matrixIds,
+                                                      std::vector<IndexType>& cellIndices,
+                                                      QueryStats* stats) const
+{
+    (void)stats;
+    ids.clear();
+    if (mMatrixCells.empty()) {
+        return;
+    }
+
+    // same than getIDsFromAABB() but each matrix only returns the cells that
+    // touch the circle, so we cull the corners at every level.
+    matrixIds.clear();
+    matrixIds.push_back(0); //0 == getRootMatrix()
+    while (!matrixIds.empty()) {
+        const IndexType mindex = matrixIds.back();
+        matrixIds.pop_back();
+        MGSP_STAT(if (stats != 0) ++stats->matrices;)
+
+        ASSERT(mindex < mMatrixCells.size());
+        if (hasSpanningObjects(mindex)) {
+            ids.push_back(mMatrixSpanning[mindex]);
+        }
+        mMatrixCells[mindex].getCells(center, radius, cellIndices);
+        for (size_t i = 0; i < cellIndices.size(); ++i) {
+            ASSERT(cellIndices[i] < mCells.size());
+            const CellType& cell = mCells[cellIndices[i]];
+            if (cell.isLeaf()) {
+                ids.push_back(cell.index());
+            } else {
+                matrixIds.push_back(cell.index());
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getLooseIDsFromAABB(const AABB& aabb,
+                                                         std::vector<IndexType>& ids,
+                                                         std::vector<IndexType>& matrixIds,
+                                                         QueryStats* stats) const
+{
+    (void)stats;
+    ids.clear();
+    if (mMatrixCells.empty()) {
+        return;
+    }
+
+    // same than getIDsFromAABB() but the objects placed in a cell can be
+    // outside of it (as far as the reach of the matrix), so we widen the
+    // AABB in each matrix and then check the bounds of each leaf cell.
+    matrixIds.clear();
+    matrixIds.push_back(0); //0 == getRootMatrix()
+    while (!matrixIds.empty()) {
+        const IndexType mindex = matrixIds.back();
+        matrixIds.pop_back();
+        MGSP_STAT(if (stats != 0) ++stats->matrices;)
+
+        ASSERT(mindex < mMatrixCells.size());
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+        const Vector2& reach = mLooseReach[mindex];
+        const AABB widened(aabb.tl.y + reach.y, aabb.tl.x - reach.x,
+                           aabb.br.y - reach.y, aabb.br.x + reach.x);
+        CellRange range;
+        if (!matrix.getCellRange(widened, range)) {
+            continue;
+        }
+        for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+            for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+                const CellType& cell = mCells[matrix.getCellIndex(row, col)];
+                if (!cell.isLeaf()) {
+                    matrixIds.push_back(cell.index());
+                } else if (mLooseBounds[cell.index()].collide(aabb)) {
+                    ids.push_back(cell.index());
+                }
+            }
+        }
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////
-MultiGridSpacePartition::MultiGridSpacePartition()
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjectLeaves(const AABB& aabb,
+                                                     std::vector<IndexType>& ids,
+                                                     std::vector<IndexType>& matrixIds) const
 {
+    ids.clear();
+    if (mLoose) {
+        ids.push_back(getLeafIndex(loosePoint(aabb)));
+        return;
+    }
 
+    // same than getIDsFromAABB() but we stop in the matrices the object spans
+    matrixIds.clear();
+    matrixIds.push_back(0); //0 == getRootMatrix()
+    while (!matrixIds.empty()) {
+        const IndexType mindex = matrixIds.back();
+        matrixIds.pop_back();
+
+        ASSERT(mindex < mMatrixCells.size());
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+        CellRange range;
+        if (!matrix.getCellRange(aabb, range)) {
+            continue;
+        }
+        if (isSpanning(mindex, range)) {
+            ids.push_back(mMatrixSpanning[mindex]);
+            continue;
+        }
+        for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+            for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+                const CellType& cell = mCells[matrix.getCellIndex(row, col)];
+                if (cell.isLeaf()) {
+                    ids.push_back(cell.index());
+                } else {
+                    matrixIds.push_back(cell.index());
+                }
+            }
+        }
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////
-MultiGridSpacePartition::~MultiGridSpacePartition()
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::addLooseObject(IndexType leaf, const AABB& aabb)
 {
+    ASSERT(leaf < mLooseBounds.size());
+    ASSERT(mLeafParents[leaf] != NO_INDEX);
+    mLooseBounds[leaf].increaseToContain(aabb);
+
+    // the reach of each matrix contains the reach of its children, so we can
+    // stop once a matrix already covers this object
+    const Vector2 point = loosePoint(aabb);
+    const float32 reachX = std::max(point.x - aabb.tl.x, aabb.br.x - point.x);
+    const float32 reachY = std::max(point.y - aabb.br.y, aabb.tl.y - point.y);
+    IndexType mindex = mCellOwners[mLeafParents[leaf]];
+    while (true) {
+        ASSERT(mindex < mLooseReach.size());
+        Vector2& reach = mLooseReach[mindex];
+        if (reach.x >= reachX && reach.y >= reachY) {
+            break;
+        }
+        reach.x = std::max(reach.x, reachX);
+        reach.y = std::max(reach.y, reachY);
+        if (mindex == 0) {
+            break;
+        }
+        mindex = mCellOwners[mMatrixParents[mindex]];
+    }
 }
 
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+template <typename ChangeFunc>
+void
+MultiGridSpacePartitionT<IndexType>::diffLeafCells(const AABB& oldBB,
+                                                   const AABB& newBB,
+                                                   DiffMatrixVec& matrices,
+                                                   ChangeFunc&& change) const
+{
+    // For each matrix we will have the range of cells covered by the old AABB
+    // and the range covered by the new one:
+    // - Cells in both ranges: the object stays (update), if the cell is a
+    //   matrix we need to go down with both AABBs.
+    // - Cells only in the old range: we need to remove it (or go down with
+    //   only the old AABB).
+    // - Cells only in the new range: we need to add it (or go down with only
+    //   the new AABB).
+    // Note that we do the same checks than getIDsFromAABB() so we will get
+    // exactly the same leaf cells.
+    // In the loose mode the object is only in the leaf cell of its center.
+    //
+    if (mLoose) {
+        const IndexType oldLeaf = getLeafIndex(loosePoint(oldBB));
+        const IndexType newLeaf = getLeafIndex(loosePoint(newBB));
+        if (oldLeaf == newLeaf) {
+            change(oldLeaf, LEAF_UPDATE);
+        } else {
+            change(oldLeaf, LEAF_REMOVE);
+            change(newLeaf, LEAF_ADD);
+        }
+        return;
+    }
+    matrices.clear();
+    matrices.push_back(std::make_pair(0, LEAF_UPDATE));
+
+    while (!matrices.empty()) {
+        const IndexType mindex = matrices.back().first;
+        const uint8_t mchange = matrices.back().second;
+        matrices.pop_back();
+
+        ASSERT(mindex < mMatrixCells.size());
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+        CellRange oldRange, newRange;
+        bool hasOld = mchange != LEAF_ADD && matrix.getCellRange(oldBB, oldRange);
+        bool hasNew = mchange != LEAF_REMOVE && matrix.getCellRange(newBB, newRange);
+
+        // the AABBs spanning the matrix are only in its spanning list
+        const bool oldSpans = hasOld && isSpanning(mindex, oldRange);
+        const bool newSpans = hasNew && isSpanning(mindex, newRange);
+        if (oldSpans && newSpans) {
+            change(mMatrixSpanning[mindex], LEAF_UPDATE);
+            continue;
+        } else if (oldSpans) {
+            change(mMatrixSpanning[mindex], LEAF_REMOVE);
+            hasOld = false;
+        } else if (newSpans) {
+            change(mMatrixSpanning[mindex], LEAF_ADD);
+            hasNew = false;
+        }
+
+        for (unsigned int pass = 0; pass < 2; ++pass) {
+            // first pass: old range, second pass: the new range not in the old
+            const bool isOld = pass == 0;
+            if ((isOld && !hasOld) || (!isOld && !hasNew)) {
+                continue;
+            }
+            const CellRange& range = isOld ? oldRange : newRange;
+            for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+                for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+                    LeafChange cellChange;
+                    if (isOld) {
+                        const bool inNew = hasNew && newRange.contains(row, col);
+                        cellChange = inNew ? LEAF_UPDATE : LEAF_REMOVE;
+                    } else if (hasOld && oldRange.contains(row, col)) {
+                        // already processed in the first pass
+                        continue;
+                    } else {
+                        cellChange = LEAF_ADD;
+                    }
+
+                    const IndexType cindex = matrix.getCellIndex(row, col);
+                    ASSERT(cindex < mCells.size());
+                    const CellType& cell = mCells[cindex];
+                    if (cell.isLeaf()) {
+                        change(cell.index(), cellChange);
+                    } else {
+                        matrices.push_back(std::make_pair(cell.index(), cellChange));
+                    }
+                }
+            }
+        }
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////
-// Construction methods
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::moveObject(Object* object,
+                                                const AABB& aabb,
+                                                DiffMatrixVec& matrices)
+{
+    // To update the position of an already existent object we need to:
+    // 1) Get the cells where the object is and will be (without building the
+    //    lists, see diffLeafCells()).
+    // 2) Add the object to the new ones, remove it from the ones where it is
+    //    not anymore and update the AABB in the cells where it stays.
+    // NOTE: the other option is: Remove from all the current places, add to all
+    //       the new places (easier but slower).
+    const ObjectIndex index = object->_mgsp_index;
+    diffLeafCells(object->_mgsp_aabb, aabb, matrices,
+        [this, index, &aabb](IndexType leaf, LeafChange change) {
+            ASSERT(leaf < mLeafCells.size());
+            LeafCell<IndexType>& cell = mLeafCells[leaf];
+            if (change == LEAF_ADD) {
+                cell.push_back(index, aabb, mLeafPool);
+            } else if (change == LEAF_REMOVE) {
+                cell.remove(index, mLeafPool);
+            } else {
+                cell.updateBox(index, aabb);
+            }
+        });
+
+    // update the aabb of the current object
+    object->_mgsp_aabb = aabb;
+}
 
 ////////////////////////////////////////////////////////////////////////////
-bool
-MultiGridSpacePartition::build(const AABB& worldSize, const CellStructInfo& info)
+template <typename IndexType>
+template <typename RootCellFunc>
+void
+MultiGridSpacePartitionT<IndexType>::groupByRootCell(size_t count,
+                                                     RootCellFunc&& rootCell,
+                                                     RootShards& shards) const
+{
+    // counting sort by root cell, the items touching several root cells go to
+    // the shared list
+    const MatrixPartition<IndexType>& root = getRootMatrix();
+    const size_t numShards = root.numRows() * root.numColumns();
+    std::vector<uint32_t>& begins = shards.begins;
+    begins.assign(numShards + 1, 0);
+    shards.shared.clear();
+
+    std::vector<uint32_t>& items = shards.items;
+    items.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t cell;
+        if (rootCell(i, cell)) {
+            ASSERT(cell < numShards);
+            items[i] = cell;
+            ++begins[cell + 1];
+        } else {
+            items[i] = ~0u;
+            shards.shared.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < numShards; ++i) {
+        begins[i + 1] += begins[i];
+    }
+
+    // now place each item in its shard
+    std::vector<uint32_t> next(begins.begin(), begins.end() - 1);
+    std::vector<uint32_t> cells;
+    cells.swap(items);
+    items.resize(begins.back());
+    for (size_t i = 0; i < count; ++i) {
+        if (cells[i] != ~0u) {
+            items[next[cells[i]]++] = i;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+template <typename Task>
+void
+MultiGridSpacePartitionT<IndexType>::runShards(const RootShards& shards,
+                                               ThreadPool* pool,
+                                               Task&& task)
+{
+    const size_t numShards = shards.begins.size() - 1;
+    const unsigned int numThreads = pool == 0 ? 1 : pool->numThreads();
+    if (mWriterContexts.size() < numThreads) {
+        mWriterContexts.resize(numThreads);
+    }
+
+    auto runRange = [&](size_t begin, size_t end, unsigned int thread) {
+        for (size_t s = begin; s < end; ++s) {
+            for (uint32_t i = shards.begins[s]; i < shards.begins[s + 1]; ++i) {
+                task(shards.items[i], thread);
+            }
+        }
+    };
+    if (pool == 0) {
+        runRange(0, numShards, 0);
+    } else {
+        // one root cell per chunk, so the threads balance the crowded ones
+        pool->parallelFor(numShards, 1, runRange);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::clearAll(void)
 {
-    // clear everything
     mCells.clear();
     mLeafCells.clear();
+    mLeafPool.clear();
+    clearFrozen();
     mMatrixCells.clear();
     mObjects.clear();
+    mObjectFreeIndices = std::queue<unsigned int>();
+    mStructureFile.close();
+    mLeafFlags.clear();
+    mDirtyLeafCells.clear();
+    mQueueingUpdates = false;
+    mPendingUpdates.clear();
+    mPendingSlots.clear();
+    buildTopology();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::clearDirtyLeafCells(void)
+{
+    for (size_t i = 0; i < mDirtyLeafCells.size(); ++i) {
+        mLeafFlags[mDirtyLeafCells[i]].dirty = 0;
+    }
+    mDirtyLeafCells.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::buildTopology(void)
+{
+    mLeafParents.assign(mLeafCells.size(), NO_INDEX);
+    mMatrixParents.assign(mMatrixCells.size(), NO_INDEX);
+    mCellOwners.assign(mCells.size(), NO_INDEX);
+    mFreeLeaves.clear();
+    mFreeMatrices.clear();
+    mFreeCells.clear();
+    mLooseBounds.assign(mLeafCells.size(), EMPTY_LOOSE_BOUNDS);
+    mLooseReach.assign(mMatrixCells.size(), Vector2());
+    mMatrixSpanning.assign(mMatrixCells.size(), NO_INDEX);
+    if (mCells.empty()) {
+        return;
+    }
+
+    // walk all the cells we can reach from the root one
+    std::vector<IndexType>& cells = mTmpIndices;
+    cells.clear();
+    cells.push_back(0);
+    while (!cells.empty()) {
+        const IndexType cindex = cells.back();
+        cells.pop_back();
+        const CellType& cell = mCells[cindex];
+        if (cell.isLeaf()) {
+            mLeafParents[cell.index()] = cindex;
+            continue;
+        }
+        if (mMatrixParents[cell.index()] != NO_INDEX) {
+            // invalid structure, each matrix should be used only once
+            ASSERT(false);
+            continue;
+        }
+        mMatrixParents[cell.index()] = cindex;
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[cell.index()];
+        const size_t count = matrix.numRows() * matrix.numColumns();
+        for (size_t i = 0; i < count; ++i) {
+            const IndexType child = matrix.getCellIndex(i);
+            mCellOwners[child] = cell.index();
+            cells.push_back(child);
+        }
+    }
+
+    // everything we didn't reach is free
+    for (size_t i = 0; i < mLeafParents.size(); ++i) {
+        if (mLeafParents[i] == NO_INDEX) mFreeLeaves.push_back(i);
+    }
+    for (size_t i = 0; i < mMatrixParents.size(); ++i) {
+        if (mMatrixParents[i] == NO_INDEX) mFreeMatrices.push_back(i);
+    }
+    for (size_t i = 1; i < mCellOwners.size(); ++i) {
+        if (mCellOwners[i] != NO_INDEX) {
+            continue;
+        }
+        if (!mFreeCells.empty() &&
+            mFreeCells.back().first + mFreeCells.back().second == i) {
+            ++mFreeCells.back().second;
+        } else {
+            mFreeCells.push_back(std::make_pair(IndexType(i), IndexType(1)));
+        }
+    }
+    configureSpanningLists();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+IndexType
+MultiGridSpacePartitionT<IndexType>::allocateLeaf(void)
+{
+    if (!mFreeLeaves.empty()) {
+        const IndexType leaf = mFreeLeaves.back();
+        mFreeLeaves.pop_back();
+        return leaf;
+    }
+    mLeafCells.push_back(LeafCell<IndexType>());
+    mLeafFlags.push_back(CellFlags());
+    mLeafParents.push_back(NO_INDEX);
+    mLooseBounds.push_back(EMPTY_LOOSE_BOUNDS);
+    return mLeafCells.size() - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+IndexType
+MultiGridSpacePartitionT<IndexType>::allocateMatrix(void)
+{
+    if (!mFreeMatrices.empty()) {
+        const IndexType matrix = mFreeMatrices.back();
+        mFreeMatrices.pop_back();
+        return matrix;
+    }
+    mMatrixCells.push_back(MatrixPartition<IndexType>());
+    mMatrixParents.push_back(NO_INDEX);
+    mLooseReach.push_back(Vector2());
+    mMatrixSpanning.push_back(NO_INDEX);
+    return mMatrixCells.size() - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+IndexType
+MultiGridSpacePartitionT<IndexType>::allocateCells(size_t count)
+{
+    // first fit from the free blocks
+    for (size_t i = 0; i < mFreeCells.size(); ++i) {
+        std::pair<IndexType, IndexType>& block = mFreeCells[i];
+        if (block.second < count) {
+            continue;
+        }
+        const IndexType begin = block.first;
+        block.first += count;
+        block.second -= count;
+        if (block.second == 0) {
+            mFreeCells.erase(mFreeCells.begin() + i);
+        }
+        return begin;
+    }
+    const IndexType begin = mCells.size();
+    mCells.resize(mCells.size() + count);
+    mCellOwners.resize(mCells.size(), NO_INDEX);
+    return begin;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+unsigned int
+MultiGridSpacePartitionT<IndexType>::matrixLevel(IndexType matrix) const
+{
+    unsigned int level = 1;
+    while (matrix != 0) {
+        ASSERT(mMatrixParents[matrix] != NO_INDEX);
+        matrix = mCellOwners[mMatrixParents[matrix]];
+        ++level;
+    }
+    return level;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+MultiGridSpacePartitionT<IndexType>::MultiGridSpacePartitionT() :
+    mFrozen(false)
+,   mLoose(false)
+,   mSpanningFraction(1.f)
+,   mQueueingUpdates(false)
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+MultiGridSpacePartitionT<IndexType>::~MultiGridSpacePartitionT()
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Construction methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::build(const AABB& worldSize, const CellStructInfo& info)
+{
+    // clear everything
+    clearAll();
 
     // check if we have correct information
     if (info.getXSubdivisions() == 0 || info.getYSubdivisions() == 0) {
@@ -252,6 +838,14 @@ MultiGridSpacePartition::build(const AABB& worldSize, const CellStructInfo& info
     // we will have a base cell that will map the world
     numCells.second += 1;
 
+    // check that all the cells can be indexed with the IndexType we use
+    if (numCells.first + uint64_t(numCells.second) > CellType::MAX_INDEX + uint64_t(1)) {
+        DEBUG_PRINT("Error: we cannot index " << numCells.first + numCells.second <<
+            " cells using " << sizeof(IndexType) * 8 << " bits indices, use a "
+            "bigger IndexType\n");
+        return false;
+    }
+
     // we need to generate the bounding box for each "Matrix" cell.
     //
     std::map<const CellStructInfo*, AABB> aabbMap;
@@ -261,6 +855,7 @@ MultiGridSpacePartition::build(const AABB& worldSize, const CellStructInfo& info
     mCells.resize(numCells.first + numCells.second);
     mLeafCells.resize(numCells.first);
     mMatrixCells.resize(numCells.second);
+    mLeafFlags.resize(numCells.first);
 
     // now we need to configure each cell, for this we will use a recursive
     // algorithm
@@ -319,22 +914,177 @@ MultiGridSpacePartition::build(const AABB& worldSize, const CellStructInfo& info
     DEBUG_PRINT("We build a new mgsp: NumCells: " << cellIndex << "\tNumMatrix: " <<
                 matrixIndex << "\tNumLeafs: " << leafIndex << std::endl);
 
+    mWorld = worldSize;
+    buildTopology();
+
     return true;
 }
 
-// TODO: add the import / export method to read all this from a file (we
-// can serialize the structure directly into memory since we will use
-// only indices and not pointers).
-//
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::exportStructure(const char* filename) const
+{
+    ASSERT(filename != 0);
+    if (mMatrixCells.empty()) {
+        DEBUG_PRINT("Error: we cannot export an empty structure\n");
+        return false;
+    }
+
+    StructFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, STRUCT_FILE_MAGIC, sizeof(header.magic));
+    header.version = STRUCT_FILE_VERSION;
+    header.byteOrder = STRUCT_FILE_BYTE_ORDER;
+    header.cellSize = sizeof(CellType);
+    header.matrixSize = sizeof(MatrixPartition<IndexType>);
+    header.objectIndexSize = sizeof(IndexType);
+    header.worldTop = mWorld.tl.y;
+    header.worldLeft = mWorld.tl.x;
+    header.worldBottom = mWorld.br.y;
+    header.worldRight = mWorld.br.x;
+    header.numCells = mCells.size();
+    header.numMatrices = mMatrixCells.size();
+    header.numLeaves = mLeafCells.size();
+    header.cellsOffset = alignOffset(sizeof(header));
+    header.matricesOffset = alignOffset(header.cellsOffset +
+                                        header.numCells * sizeof(CellType));
+    header.fileSize = header.matricesOffset +
+        header.numMatrices * sizeof(MatrixPartition<IndexType>);
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        DEBUG_PRINT("Error: cannot open the file " << filename << std::endl);
+        return false;
+    }
+
+    // write each section padding with zeros until the next offset
+    const char padding[STRUCT_FILE_ALIGNMENT] = {0};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(padding, header.cellsOffset - sizeof(header));
+    out.write(reinterpret_cast<const char*>(mCells.data()),
+              header.numCells * sizeof(CellType));
+    out.write(padding, header.matricesOffset -
+                       (header.cellsOffset + header.numCells * sizeof(CellType)));
+    // the matrices have padding bytes, so we write a copy of each one built
+    // over zeroed memory instead of the memory of the matrix itself
+    typedef MatrixPartition<IndexType> MatrixType;
+    alignas(MatrixType) char matrixBytes[sizeof(MatrixType)];
+    for (size_t i = 0; i < mMatrixCells.size(); ++i) {
+        const MatrixType& matrix = mMatrixCells[i];
+        std::memset(matrixBytes, 0, sizeof(matrixBytes));
+        MatrixType* copy = new (matrixBytes) MatrixType();
+        copy->construct(matrix.numRows(), matrix.numColumns(),
+                        matrix.boundingBox(), matrix.getCellIndex(0, 0));
+        out.write(matrixBytes, sizeof(matrixBytes));
+    }
+
+    return out.good();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::importStructure(const char* filename)
+{
+    ASSERT(filename != 0);
+    clearAll();
+
+    if (!mStructureFile.open(filename)) {
+        return false;
+    }
+    const char* mem = mStructureFile.data();
+    const size_t memSize = mStructureFile.size();
+
+    // check that the header is what we expect
+    if (memSize < sizeof(StructFileHeader)) {
+        DEBUG_PRINT("Error: invalid structure file " << filename << std::endl);
+        mStructureFile.close();
+        return false;
+    }
+    StructFileHeader header;
+    std::memcpy(&header, mem, sizeof(header));
+    if (std::memcmp(header.magic, STRUCT_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != STRUCT_FILE_VERSION ||
+        header.byteOrder != STRUCT_FILE_BYTE_ORDER ||
+        header.cellSize != sizeof(CellType) ||
+        header.matrixSize != sizeof(MatrixPartition<IndexType>) ||
+        header.objectIndexSize != sizeof(IndexType) ||
+        header.fileSize != memSize ||
+        header.numMatrices == 0 ||
+        header.numCells > CellType::MAX_INDEX + uint64_t(1) ||
+        header.numMatrices > CellType::MAX_INDEX + uint64_t(1) ||
+        header.numLeaves > CellType::MAX_INDEX + uint64_t(1) ||
+        header.cellsOffset % STRUCT_FILE_ALIGNMENT != 0 ||
+        header.matricesOffset % STRUCT_FILE_ALIGNMENT != 0 ||
+        header.cellsOffset < sizeof(header) ||
+        header.cellsOffset > header.matricesOffset ||
+        header.matricesOffset > memSize ||
+        // (dividing the section sizes so they cannot overflow)
+        header.numCells > (header.matricesOffset - header.cellsOffset) /
+            sizeof(CellType) ||
+        header.numMatrices > (memSize - header.matricesOffset) /
+            sizeof(MatrixPartition<IndexType>)) {
+        DEBUG_PRINT("Error: invalid or incompatible structure file " <<
+                    filename << std::endl);
+        mStructureFile.close();
+        return false;
+    }
+
+    CellType* cells = reinterpret_cast<CellType*>(mStructureFile.data() + header.cellsOffset);
+    MatrixPartition<IndexType>* matrices =
+        reinterpret_cast<MatrixPartition<IndexType>*>(mStructureFile.data() +
+                                                     header.matricesOffset);
+
+    // check that all the indices are inside of the ranges, we will use them
+    // directly without checking later
+    for (size_t i = 0; i < header.numCells; ++i) {
+        const CellType& cell = cells[i];
+        if ((cell.isLeaf() && cell.index() >= header.numLeaves) ||
+            (!cell.isLeaf() && cell.index() >= header.numMatrices)) {
+            DEBUG_PRINT("Error: invalid cell " << i << " in " << filename << std::endl);
+            mStructureFile.close();
+            return false;
+        }
+    }
+    for (size_t i = 0; i < header.numMatrices; ++i) {
+        const MatrixPartition<IndexType>& matrix = matrices[i];
+        const size_t matrixCells = matrix.numRows() * matrix.numColumns();
+        if (matrixCells == 0 ||
+            static_cast<size_t>(matrix.getCellIndex(0,0)) + matrixCells > header.numCells) {
+            DEBUG_PRINT("Error: invalid matrix " << i << " in " << filename << std::endl);
+            mStructureFile.close();
+            return false;
+        }
+    }
+
+    mWorld = AABB(header.worldTop, header.worldLeft,
+                  header.worldBottom, header.worldRight);
+    mCells.adopt(cells, header.numCells);
+    mMatrixCells.adopt(matrices, header.numMatrices);
+    mLeafCells.resize(header.numLeaves);
+    mLeafFlags.resize(header.numLeaves);
+    buildTopology();
+
+    DEBUG_PRINT("We imported a new mgsp: NumCells: " << mCells.size() <<
+                "\tNumMatrix: " << mMatrixCells.size() << "\tNumLeafs: " <<
+                mLeafCells.size() << std::endl);
+
+    return true;
+}
 
 ////////////////////////////////////////////////////////////////////////////
 // Insertion / removal methods
 
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::insert(Object* object)
+MultiGridSpacePartitionT<IndexType>::insert(Object* object)
 {
     ASSERT(object != 0);
+    if (mFrozen) {
+        thaw();
+    }
 
     // if the object already exists then we don't need to do anything
     if (checkObjectExists(object)) {
@@ -342,80 +1092,176 @@ MultiGridSpacePartition::insert(Object* object)
         return;
     }
 
-    // add it to the list, check if we have a free place to add it
-    if (mObjectFreeIndices.empty()) {
-        object->_mgsp_index = mObjects.size();
-        mObjects.push_back(object);
-    } else {
-        object->_mgsp_index = mObjectFreeIndices.front();
-        mObjectFreeIndices.pop();
-        mObjects[object->_mgsp_index] = object;
+    if (!addObjectToList(object)) {
+        DEBUG_PRINT("Error: we cannot index more objects, the object was not "
+            "inserted\n");
+        return;
     }
 
     // insert the element to the matrix
     DEBUG_PRINT("\n\nINSERTING OBJECT!: " << object->_mgsp_aabb << "\n");
-    getIDsFromAABB(object->_mgsp_aabb, mLeafTmpIndices);
+    getObjectLeaves(object->_mgsp_aabb, mLeafTmpIndices, mTmpMatrixIds);
     for (size_t i = 0; i < mLeafTmpIndices.size(); ++i) {
         ASSERT(mLeafTmpIndices[i] < mLeafCells.size());
         // insert the object to the leaf cell
-        mLeafCells[mLeafTmpIndices[i]].push_back(object->_mgsp_index);
+        mLeafCells[mLeafTmpIndices[i]].push_back(object->_mgsp_index,
+                                                 object->_mgsp_aabb,
+                                                 mLeafPool);
+        if (mLoose) {
+            addLooseObject(mLeafTmpIndices[i], object->_mgsp_aabb);
+        }
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::update(Object* object, const AABB& aabb)
+MultiGridSpacePartitionT<IndexType>::insertBulk(Object** objects, size_t count, ThreadPool* pool)
 {
-    ASSERT(object != 0);
+    ASSERT(objects != 0 || count == 0);
+    if (mFrozen) {
+        thaw();
+    }
 
-    // if object doesn't exists we will do nothing...
-    if (!checkObjectExists(object)) {
-        DEBUG_PRINT("Object couldn't be updated since it doesn't exists in the mgsp\n");
+    // 1) Add all the new objects to the list (ignoring the ones that already
+    //    exists, also the repeated ones).
+    std::vector<Object*> newObjects;
+    newObjects.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT(objects[i] != 0);
+        if (checkObjectExists(objects[i])) {
+            DEBUG_PRINT("Trying to insert an object that is already inserted\n");
+            continue;
+        }
+        if (!addObjectToList(objects[i])) {
+            DEBUG_PRINT("Error: we cannot index more objects, the object was "
+                "not inserted\n");
+            continue;
+        }
+        newObjects.push_back(objects[i]);
+    }
+    if (newObjects.empty()) {
         return;
     }
 
-    // To update the position of an already existent object we need to:
-    // 1) Get the current cells where the object is (CurrentList).
-    // 2) Get the new cells where the object will should go (NewList).
-    // 3) After that we need to get two sub lists:
-    //    ToAdd:    id € {NewList} && id !€ {CurrentList}
-    //    ToRemove: id € {CurrentList} && id !€ {NewList}
-    // 4) Add the object to each of the matrices from ToAdd.
-    //    Remove the object from all the matrices of ToRemove.
-    // NOTE: the other option is: Remove from all the current places, add to all
-    //       the new places (easier but slower).
-
-    // get the current indices in mTmpIndices2
-    getIDsFromAABB(object->_mgsp_aabb, mTmpIndices2);
-    // get the new indices in mLeafTmpIndices
-    getIDsFromAABB(aabb, mLeafTmpIndices);
-
-    // get the IndexAction
-    size_t totalIndices = mTmpIndices2.size() + mLeafTmpIndices.size();
-    IndexAction toProcess[totalIndices]; // c99
-    getIndexAction(mLeafTmpIndices, mTmpIndices2, toProcess, totalIndices);
-
-    // now we need to update the cells
-    for (size_t i = 0; i < totalIndices; ++i) {
-        ASSERT(toProcess[i].index < mLeafCells.size());
-        if (toProcess[i].action == IndexAction::ADD) {
-            // we need to add this element to the cell
-            mLeafCells[toProcess[i].index].push_back(object->_mgsp_index);
-        } else if (toProcess[i].action == IndexAction::REMOVE) {
-            // else we need to remove the element from the cell
-            removeUnsorted(mLeafCells[toProcess[i].index], object->_mgsp_index);
+    // 2) Get the leaf cells of each object. Each thread will save the ids of
+    //    the objects it process in its own buffer, and we will save for each
+    //    object where its ids are [thread, begin, end).
+    struct ThreadData {
+        std::vector<IndexType> ids;
+        std::vector<IndexType> tmpIds;
+        std::vector<IndexType> matrixIds;
+    };
+    struct ObjectIds {
+        unsigned int thread;
+        size_t begin;
+        size_t end;
+    };
+    const unsigned int numThreads = pool == 0 ? 1 : pool->numThreads();
+    std::vector<ThreadData> threadsData(numThreads);
+    std::vector<ObjectIds> objectIds(newObjects.size());
+
+    auto calculateIds = [&](size_t begin, size_t end, unsigned int thread) {
+        ThreadData& td = threadsData[thread];
+        for (size_t i = begin; i < end; ++i) {
+            getObjectLeaves(newObjects[i]->_mgsp_aabb, td.tmpIds, td.matrixIds);
+            objectIds[i].thread = thread;
+            objectIds[i].begin = td.ids.size();
+            td.ids.insert(td.ids.end(), td.tmpIds.begin(), td.tmpIds.end());
+            objectIds[i].end = td.ids.size();
         }
+    };
+    if (pool == 0) {
+        calculateIds(0, newObjects.size(), 0);
+    } else {
+        pool->parallelFor(newObjects.size(), 256, calculateIds);
     }
 
-    // update the aabb of the current object
-    object->_mgsp_aabb = aabb;
+    // 3) Count how many objects we will add in each leaf cell and reserve the
+    //    exact memory we need.
+    std::vector<unsigned int> leafCounts(mLeafCells.size(), 0);
+    for (unsigned int t = 0; t < numThreads; ++t) {
+        const std::vector<IndexType>& ids = threadsData[t].ids;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            ASSERT(ids[i] < mLeafCells.size());
+            ++leafCounts[ids[i]];
+        }
+    }
+    for (size_t i = 0; i < leafCounts.size(); ++i) {
+        if (leafCounts[i] > 0) {
+            mLeafCells[i].reserve(mLeafCells[i].size() + leafCounts[i], mLeafPool);
+        }
+    }
+
+    // 4) Fill the leaf cells, if we have a pool each root cell is filled by
+    //    one thread (see the parallel writer methods).
+    auto fillCells = [&](size_t i) {
+        const ObjectIds& oids = objectIds[i];
+        const std::vector<IndexType>& ids = threadsData[oids.thread].ids;
+        const ObjectIndex index = newObjects[i]->_mgsp_index;
+        const AABB& aabb = newObjects[i]->_mgsp_aabb;
+        for (size_t j = oids.begin; j < oids.end; ++j) {
+            mLeafCells[ids[j]].push_back(index, aabb, mLeafPool);
+        }
+    };
+    if (pool == 0) {
+        for (size_t i = 0; i < newObjects.size(); ++i) {
+            fillCells(i);
+        }
+    } else {
+        groupByRootCell(newObjects.size(), [&](size_t i, uint32_t& cell) {
+                const AABB aabb = placementBox(newObjects[i]->_mgsp_aabb);
+                return getRootCell(aabb, aabb, cell);
+            }, mShards);
+        runShards(mShards, pool, [&](uint32_t i, unsigned int) {fillCells(i);});
+        for (size_t i = 0; i < mShards.shared.size(); ++i) {
+            fillCells(mShards.shared[i]);
+        }
+    }
+
+    // 5) The loose bounds of the matrices are shared by the threads, we grow
+    //    them here.
+    if (mLoose) {
+        for (size_t i = 0; i < newObjects.size(); ++i) {
+            const ObjectIds& oids = objectIds[i];
+            ASSERT(oids.end == oids.begin + 1);
+            addLooseObject(threadsData[oids.thread].ids[oids.begin],
+                           newObjects[i]->_mgsp_aabb);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::update(Object* object, const AABB& aabb)
+{
+    ASSERT(object != 0);
+    if (mFrozen) {
+        thaw();
+    }
+
+    // if object doesn't exists we will do nothing...
+    if (!checkObjectExists(object)) {
+        DEBUG_PRINT("Object couldn't be updated since it doesn't exists in the mgsp\n");
+        return;
+    }
+
+    moveObject(object, aabb, mTmpDiffMatrices);
+    if (mLoose) {
+        addLooseObject(getLeafIndex(loosePoint(aabb)), aabb);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::remove(Object* object)
+MultiGridSpacePartitionT<IndexType>::remove(Object* object)
 {
     ASSERT(object != 0);
+    if (mFrozen) {
+        thaw();
+    }
 
     // check if the object exists
     if (!checkObjectExists(object)) {
@@ -424,11 +1270,26 @@ MultiGridSpacePartition::remove(Object* object)
     }
 
     // we need to get the current collision cells and remove the element from them
-    getIDsFromAABB(object->_mgsp_aabb, mLeafTmpIndices);
+    getObjectLeaves(object->_mgsp_aabb, mLeafTmpIndices, mTmpMatrixIds);
     for (size_t i = 0; i < mLeafTmpIndices.size(); ++i) {
         ASSERT(mLeafTmpIndices[i] < mLeafCells.size());
         // remove the object from the leaf cell
-        removeUnsorted(mLeafCells[mLeafTmpIndices[i]], object->_mgsp_index);
+        mLeafCells[mLeafTmpIndices[i]].remove(object->_mgsp_index, mLeafPool);
+    }
+
+    releaseObject(object);
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::releaseObject(Object* object)
+{
+    // if we had a queued update for it we discard it
+    if (object->_mgsp_index < mPendingSlots.size() &&
+        mPendingSlots[object->_mgsp_index] != NO_PENDING_UPDATE) {
+        mPendingUpdates[mPendingSlots[object->_mgsp_index]].object = 0;
+        mPendingSlots[object->_mgsp_index] = NO_PENDING_UPDATE;
     }
 
     // remove it from the list of objects and check if it is the last one or not
@@ -441,81 +1302,1702 @@ MultiGridSpacePartition::remove(Object* object)
         mObjects[object->_mgsp_index] = 0;
         mObjectFreeIndices.push(object->_mgsp_index);
     }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Parallel writer methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::updateParallel(Object* const* objects,
+                                                    const AABB* aabbs,
+                                                    size_t count,
+                                                    ThreadPool* pool)
+{
+    ASSERT((objects != 0 && aabbs != 0) || count == 0);
+    if (count == 0 || mMatrixCells.empty()) {
+        return;
+    }
+    if (mFrozen) {
+        thaw();
+    }
+
+    // the objects that don't exist are ignored (put in the shared list and
+    // skipped there)
+    groupByRootCell(count, [&](size_t i, uint32_t& cell) {
+            ASSERT(objects[i] != 0);
+            return checkObjectExists(objects[i]) &&
+                getRootCell(placementBox(objects[i]->_mgsp_aabb),
+                            placementBox(aabbs[i]), cell);
+        }, mShards);
+
+    runShards(mShards, pool, [&](uint32_t i, unsigned int thread) {
+        moveObject(objects[i], aabbs[i], mWriterContexts[thread].diffMatrices);
+    });
+    // the loose bounds of the matrices are shared by the threads
+    if (mLoose) {
+        for (size_t i = 0; i < mShards.items.size(); ++i) {
+            const AABB& aabb = aabbs[mShards.items[i]];
+            addLooseObject(getLeafIndex(loosePoint(aabb)), aabb);
+        }
+    }
+
+    // the objects crossing root cells
+    for (size_t i = 0; i < mShards.shared.size(); ++i) {
+        const uint32_t item = mShards.shared[i];
+        update(objects[item], aabbs[item]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::removeParallel(Object* const* objects,
+                                                    size_t count,
+                                                    ThreadPool* pool)
+{
+    ASSERT(objects != 0 || count == 0);
+    if (count == 0 || mMatrixCells.empty()) {
+        return;
+    }
+    if (mFrozen) {
+        thaw();
+    }
+
+    groupByRootCell(count, [&](size_t i, uint32_t& cell) {
+            ASSERT(objects[i] != 0);
+            const AABB aabb = placementBox(objects[i]->_mgsp_aabb);
+            return checkObjectExists(objects[i]) && getRootCell(aabb, aabb, cell);
+        }, mShards);
+
+    // remove the objects from the leaf cells in parallel
+    runShards(mShards, pool, [&](uint32_t i, unsigned int thread) {
+        WriterContext& context = mWriterContexts[thread];
+        getObjectLeaves(objects[i]->_mgsp_aabb, context.ids, context.matrixIds);
+        for (size_t j = 0; j < context.ids.size(); ++j) {
+            ASSERT(context.ids[j] < mLeafCells.size());
+            mLeafCells[context.ids[j]].remove(objects[i]->_mgsp_index, mLeafPool);
+        }
+    });
+
+    // release the indices of the removed ones in this thread
+    for (size_t s = 0; s + 1 < mShards.begins.size(); ++s) {
+        for (uint32_t i = mShards.begins[s]; i < mShards.begins[s + 1]; ++i) {
+            Object* object = objects[mShards.items[i]];
+            if (checkObjectExists(object)) {
+                releaseObject(object);
+            }
+        }
+    }
 
+    // the objects crossing root cells
+    for (size_t i = 0; i < mShards.shared.size(); ++i) {
+        remove(objects[mShards.shared[i]]);
+    }
 }
 
 
 ////////////////////////////////////////////////////////////////////////////
-// Query methods
+// Deferred update methods
 
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::getObjects(const Vector2& point, ObjectPtrVec& result)
+MultiGridSpacePartitionT<IndexType>::beginUpdates(void)
 {
-    result.clear();
-    // check if the point is in the matrix
-    if (!getRootMatrix().isPointInMatrix(point)) {
+    ASSERT(!mQueueingUpdates && "beginUpdates() called twice without commit()");
+    mQueueingUpdates = true;
+    mPendingUpdates.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::queueUpdate(Object* object, const AABB& aabb)
+{
+    ASSERT(object != 0);
+
+    if (!mQueueingUpdates) {
+        update(object, aabb);
+        return;
+    }
+    if (!checkObjectExists(object)) {
+        DEBUG_PRINT("Object couldn't be queued since it doesn't exists in the mgsp\n");
         return;
     }
 
-    // We will get cells until we hit a leaf one. The algorithm should be
-    // something like this:
-    //
-    uint16_t index = 0;
-    while (!mCells[index].isLeaf()) {
-        // is a matrix
-        const size_t mindex = mCells[index].index();
-        const MatrixPartition<uint16_t>& matrix = mMatrixCells[mindex];
-        // get the index of the cell that intersect the point
-        index = matrix.getCellIndex(point);
+    if (mPendingSlots.size() < mObjects.size()) {
+        mPendingSlots.resize(mObjects.size(), NO_PENDING_UPDATE);
+    }
+    unsigned int& slot = mPendingSlots[object->_mgsp_index];
+    if (slot == NO_PENDING_UPDATE) {
+        slot = mPendingUpdates.size();
+        mPendingUpdates.push_back(PendingUpdate(object, aabb));
+    } else {
+        // we only keep the last one
+        ASSERT(mPendingUpdates[slot].object == object);
+        mPendingUpdates[slot].aabb = aabb;
     }
+}
 
-    const size_t lindex = mCells[index].index();
-    ASSERT(lindex < mLeafCells.size());
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::commit(void)
+{
+    ASSERT(mQueueingUpdates && "commit() called without beginUpdates()");
+    if (mFrozen) {
+        thaw();
+    }
+    mQueueingUpdates = false;
+    clearDirtyLeafCells();
+
+    // 1) For each object get the list of leaf cells where we need to remove
+    //    it, add it or update it.
+    std::vector<LeafAction> actions;
+    for (size_t i = 0; i < mPendingUpdates.size(); ++i) {
+        Object* object = mPendingUpdates[i].object;
+        if (object == 0) {
+            // removed while it was queued
+            continue;
+        }
+        mPendingSlots[object->_mgsp_index] = NO_PENDING_UPDATE;
+        const AABB& aabb = mPendingUpdates[i].aabb;
+        const ObjectIndex index = object->_mgsp_index;
+        diffLeafCells(object->_mgsp_aabb, aabb, mTmpDiffMatrices,
+            [&actions, index, &aabb](IndexType leaf, LeafChange change) {
+                actions.push_back(LeafAction(leaf, change, index, &aabb));
+            });
+        object->_mgsp_aabb = aabb;
+    }
 
-    // now we have to check all the objects that intersect this one
-    ObjectIndicesVec& cell = mLeafCells[lindex];
-    for (size_t i = 0; i < cell.size(); ++i) {
-        // get the object and check if intersects the point
-        ASSERT(cell[i] < mObjects.size());
-        Object* obj = mObjects[cell[i]];
-        if (obj->_mgsp_aabb.checkPointInside(point)) {
-            result.push_back(obj);
+    // 2) Apply all the actions sorted by leaf cell
+    std::sort(actions.begin(), actions.end());
+    for (size_t i = 0; i < actions.size(); ++i) {
+        const LeafAction& action = actions[i];
+        ASSERT(action.leaf < mLeafCells.size());
+        CellFlags& flags = mLeafFlags[action.leaf];
+        if (!flags.dirty) {
+            flags.dirty = 1;
+            mDirtyLeafCells.push_back(action.leaf);
+        }
+        LeafCell<IndexType>& cell = mLeafCells[action.leaf];
+        if (action.action == LEAF_ADD) {
+            cell.push_back(action.object, *action.aabb, mLeafPool);
+        } else if (action.action == LEAF_REMOVE) {
+            cell.remove(action.object, mLeafPool);
+            continue;
+        } else {
+            cell.updateBox(action.object, *action.aabb);
+        }
+        if (mLoose) {
+            addLooseObject(action.leaf, *action.aabb);
         }
     }
+    mPendingUpdates.clear();
 }
 
+
+////////////////////////////////////////////////////////////////////////////
+// Frozen layout methods
+
 ////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
 void
-MultiGridSpacePartition::getObjects(const AABB& aabb, ObjectPtrVec& result)
+MultiGridSpacePartitionT<IndexType>::freeze(void)
 {
-    // We will get all the elements here. We will also use a set to
-    // avoid duplicated elements when checking for collisions, since one element
-    // could be in multiple matrices we need to check this.
-    // We will an mem-expensive hash table. Could be a bitset or other data structure
-    // depending on the problem and number of elements
-    //
-    mTmpHash.clear();
-    result.clear();
+    if (mFrozen) {
+        return;
+    }
+    refitLooseBounds();
+
+    // calculate the offsets and allocate the exact memory we need
+    mFrozenOffsets.resize(mLeafCells.size() + 1);
+    uint32_t total = 0;
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        mFrozenOffsets[i] = total;
+        total += mLeafCells[i].size();
+    }
+    mFrozenOffsets.back() = total;
+    mFrozenOffsets.shrink_to_fit();
+    std::vector<IndexType>(total).swap(mFrozenIndices);
+    std::vector<float32>(total).swap(mFrozenMinX);
+    std::vector<float32>(total).swap(mFrozenMinY);
+    std::vector<float32>(total).swap(mFrozenMaxX);
+    std::vector<float32>(total).swap(mFrozenMaxY);
+
+    // copy the contents of each leaf cell and release its memory
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        const LeafView<IndexType> leaf = mLeafCells[i].view();
+        const uint32_t begin = mFrozenOffsets[i];
+        const size_t n = leaf.size();
+        std::copy(leaf.indices(), leaf.indices() + n, mFrozenIndices.data() + begin);
+        std::copy(leaf.minX(), leaf.minX() + n, mFrozenMinX.data() + begin);
+        std::copy(leaf.minY(), leaf.minY() + n, mFrozenMinY.data() + begin);
+        std::copy(leaf.maxX(), leaf.maxX() + n, mFrozenMaxX.data() + begin);
+        std::copy(leaf.maxY(), leaf.maxY() + n, mFrozenMaxY.data() + begin);
+        mLeafCells[i].release(mLeafPool);
+    }
+    mLeafPool.releaseIfUnused();
+    mFrozen = true;
+}
 
-    // get the indices of the leaf cells that intersects the aabb
-    getIDsFromAABB(aabb, mLeafTmpIndices);
-    for (size_t i = 0; i < mLeafTmpIndices.size(); ++i) {
-        ASSERT(mLeafTmpIndices[i] < mLeafCells.size());
-        // for each cell we need to check all the current objects
-        ObjectIndicesVec& cell = mLeafCells[mLeafTmpIndices[i]];
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::thaw(void)
+{
+    if (!mFrozen) {
+        return;
+    }
+
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        const LeafView<IndexType> leaf = getLeafView(i);
+        LeafCell<IndexType>& cell = mLeafCells[i];
+        cell.reserve(leaf.size(), mLeafPool);
+        for (size_t j = 0; j < leaf.size(); ++j) {
+            cell.push_back(leaf.index(j), leaf.box(j), mLeafPool);
+        }
+    }
+    clearFrozen();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::clearFrozen(void)
+{
+    mFrozen = false;
+    std::vector<uint32_t>().swap(mFrozenOffsets);
+    std::vector<IndexType>().swap(mFrozenIndices);
+    std::vector<float32>().swap(mFrozenMinX);
+    std::vector<float32>().swap(mFrozenMinY);
+    std::vector<float32>().swap(mFrozenMaxX);
+    std::vector<float32>().swap(mFrozenMaxY);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Loose mode methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::setLooseMode(bool loose)
+{
+    if (loose == mLoose) {
+        return;
+    }
+    mLoose = loose;
+    relocateObjects();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::relocateObjects(void)
+{
+    // we place again all the objects from scratch (the frozen arrays are
+    // not needed anymore)
+    clearFrozen();
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        mLeafCells[i].release(mLeafPool);
+    }
+    mLeafPool.clear();
+    configureSpanningLists();
+    mLooseBounds.assign(mLeafCells.size(), EMPTY_LOOSE_BOUNDS);
+    mLooseReach.assign(mMatrixCells.size(), Vector2());
+    if (mMatrixCells.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < mObjects.size(); ++i) {
+        const Object* object = mObjects[i];
+        if (object == 0) {
+            continue;
+        }
+        getObjectLeaves(object->_mgsp_aabb, mLeafTmpIndices, mTmpMatrixIds);
+        for (size_t j = 0; j < mLeafTmpIndices.size(); ++j) {
+            mLeafCells[mLeafTmpIndices[j]].push_back(object->_mgsp_index,
+                                                     object->_mgsp_aabb,
+                                                     mLeafPool);
+            if (mLoose) {
+                addLooseObject(mLeafTmpIndices[j], object->_mgsp_aabb);
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::refitLooseBounds(void)
+{
+    if (!mLoose) {
+        return;
+    }
+    mLooseBounds.assign(mLeafCells.size(), EMPTY_LOOSE_BOUNDS);
+    mLooseReach.assign(mMatrixCells.size(), Vector2());
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        if (mLeafParents[i] == NO_INDEX) {
+            continue;
+        }
+        const LeafView<IndexType> leaf = getLeafView(i);
+        for (size_t j = 0; j < leaf.size(); ++j) {
+            addLooseObject(i, leaf.box(j));
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Spanning object methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::setSpanningFraction(float32 fraction)
+{
+    ASSERT(fraction > 0.f);
+    if (fraction > 1.f) {
+        fraction = 1.f;
+    }
+    if (fraction == mSpanningFraction) {
+        return;
+    }
+    mSpanningFraction = fraction;
+    relocateObjects();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::configureSpanningLists(void)
+{
+    const bool enabled = mSpanningFraction < 1.f && !mLoose;
+    const uint64_t maxLeaves = CellType::MAX_INDEX + uint64_t(1);
+    for (size_t i = 0; i < mMatrixSpanning.size(); ++i) {
+        if (enabled && mMatrixSpanning[i] == NO_INDEX && mMatrixParents[i] != NO_INDEX) {
+            // if we cannot index more leaf cells the matrix will not have a
+            // spanning list (the objects will go to its cells)
+            if (!mFreeLeaves.empty() || mLeafCells.size() < maxLeaves) {
+                mMatrixSpanning[i] = allocateLeaf();
+            }
+        } else if (!enabled && mMatrixSpanning[i] != NO_INDEX) {
+            ASSERT(mLeafCells[mMatrixSpanning[i]].size() == 0);
+            mFreeLeaves.push_back(mMatrixSpanning[i]);
+            mMatrixSpanning[i] = NO_INDEX;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Adaptive refinement methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::splitLeaf(IndexType leaf,
+                                               uint8_t columns,
+                                               uint8_t rows)
+{
+    if (mQueueingUpdates || leaf >= mLeafCells.size() ||
+        mLeafParents[leaf] == NO_INDEX || columns == 0 || rows == 0) {
+        DEBUG_PRINT("Error: we cannot split the leaf cell " << leaf << std::endl);
+        return false;
+    }
+
+    // check that we can index all the new cells, leaf cells and the matrix
+    const uint64_t count = columns * rows;
+    const uint64_t maxCells = CellType::MAX_INDEX + uint64_t(1);
+    bool hasFreeBlock = false;
+    for (size_t i = 0; i < mFreeCells.size() && !hasFreeBlock; ++i) {
+        hasFreeBlock = mFreeCells[i].second >= count;
+    }
+    const bool spanning = mSpanningFraction < 1.f && !mLoose;
+    const uint64_t leaves = count - 1 + (spanning ? 1 : 0);
+    const uint64_t newLeaves = leaves > mFreeLeaves.size() ?
+        leaves - mFreeLeaves.size() : 0;
+    if ((!hasFreeBlock && mCells.size() + count > maxCells) ||
+        mLeafCells.size() + newLeaves > maxCells ||
+        (mFreeMatrices.empty() && mMatrixCells.size() + 1 > maxCells)) {
+        DEBUG_PRINT("Error: we cannot index more cells to split " << leaf << std::endl);
+        return false;
+    }
+
+    // the cells could be in a mapped file
+    mCells.detach();
+    mMatrixCells.detach();
+    if (mFrozen) {
+        thaw();
+    }
+
+    // the new matrix will map the space of the cell
+    const IndexType cindex = mLeafParents[leaf];
+    const IndexType owner = mCellOwners[cindex];
+    ASSERT(owner != NO_INDEX);
+    AABB bb;
+    {
+        const MatrixPartition<IndexType>& parent = mMatrixCells[owner];
+        const size_t position = cindex - parent.getCellIndex(0, 0);
+        bb = parent.getCellBoundingBox(position / parent.numColumns(),
+                                       position % parent.numColumns());
+    }
+    const IndexType begin = allocateCells(count);
+    const IndexType mindex = allocateMatrix();
+    mMatrixCells[mindex].construct(rows, columns, bb, begin);
+    mCells[cindex].configure(false, mindex);
+    mMatrixParents[mindex] = cindex;
+    if (spanning) {
+        mMatrixSpanning[mindex] = allocateLeaf();
+    }
+
+    // the first cell will reuse the current leaf cell
+    LeafCell<IndexType> objects;
+    objects.swap(mLeafCells[leaf]);
+    for (size_t i = 0; i < count; ++i) {
+        const IndexType child = i == 0 ? leaf : allocateLeaf();
+        mCells[begin + i].configure(true, child);
+        mCellOwners[begin + i] = mindex;
+        mLeafParents[child] = begin + i;
+    }
+
+    // move the objects into the new leaf cells (as insert() would do)
+    const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+    if (mLoose) {
+        for (size_t i = 0; i < count; ++i) {
+            mLooseBounds[mCells[begin + i].index()] = EMPTY_LOOSE_BOUNDS;
+        }
+        mLooseReach[mindex] = Vector2();
+    }
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const AABB box = objects.box(i);
+        if (mLoose) {
+            const IndexType child = mCells[matrix.getCellIndex(loosePoint(box))].index();
+            mLeafCells[child].push_back(objects.index(i), box, mLeafPool);
+            addLooseObject(child, box);
+            continue;
+        }
+        CellRange range;
+        if (!matrix.getCellRange(box, range)) {
+            continue;
+        }
+        if (isSpanning(mindex, range)) {
+            mLeafCells[mMatrixSpanning[mindex]].push_back(objects.index(i), box, mLeafPool);
+            continue;
+        }
+        for (size_t row = range.rowBegin; row <= range.rowEnd; ++row) {
+            for (size_t col = range.colBegin; col <= range.colEnd; ++col) {
+                const IndexType child = mCells[matrix.getCellIndex(row, col)].index();
+                mLeafCells[child].push_back(objects.index(i), box, mLeafPool);
+            }
+        }
+    }
+    objects.release(mLeafPool);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::mergeMatrix(IndexType mindex)
+{
+    if (mQueueingUpdates || mindex == 0 || mindex >= mMatrixCells.size() ||
+        mMatrixParents[mindex] == NO_INDEX) {
+        DEBUG_PRINT("Error: we cannot merge the matrix " << mindex << std::endl);
+        return false;
+    }
+
+    // the cells could be in a mapped file
+    mCells.detach();
+    mMatrixCells.detach();
+    if (mFrozen) {
+        thaw();
+    }
+
+    const MatrixPartition<IndexType>& matrix = mMatrixCells[mindex];
+    const size_t count = matrix.numRows() * matrix.numColumns();
+    for (size_t i = 0; i < count; ++i) {
+        if (!mCells[matrix.getCellIndex(i)].isLeaf()) {
+            DEBUG_PRINT("Error: we can only merge matrices of leaf cells\n");
+            return false;
+        }
+    }
+
+    // we keep the first leaf cell and add (once) all the objects of the
+    // others into it
+    const IndexType begin = matrix.getCellIndex(0, 0);
+    const IndexType leaf = mCells[begin].index();
+    LeafCell<IndexType>& merged = mLeafCells[leaf];
+    mQueryContext.newQuery(mObjects.size());
+    for (size_t i = 0; i < merged.size(); ++i) {
+        mQueryContext.visit(merged.index(i));
+    }
+    for (size_t i = 1; i < count; ++i) {
+        const IndexType child = mCells[begin + i].index();
+        LeafCell<IndexType>& cell = mLeafCells[child];
+        for (size_t j = 0; j < cell.size(); ++j) {
+            if (mQueryContext.visit(cell.index(j))) {
+                merged.push_back(cell.index(j), cell.box(j), mLeafPool);
+            }
+        }
+        cell.release(mLeafPool);
+        if (mLoose) {
+            mLooseBounds[leaf].increaseToContain(mLooseBounds[child]);
+        }
+        mLeafParents[child] = NO_INDEX;
+        mFreeLeaves.push_back(child);
+    }
+    // and the objects spanning the matrix
+    const IndexType span = mMatrixSpanning[mindex];
+    if (span != NO_INDEX) {
+        LeafCell<IndexType>& cell = mLeafCells[span];
         for (size_t j = 0; j < cell.size(); ++j) {
-            // if the object is colliding and not in the set we add it
-            ASSERT(cell[j] < mObjects.size());
-            Object* obj = mObjects[cell[j]];
-            if (obj->_mgsp_aabb.collide(aabb) &&
-                mTmpHash.insert(obj->_mgsp_index).second == true) {
-                // we need to add this one
-                result.push_back(obj);
-                // note that the element was already inserted in the if guard.
+            if (mQueryContext.visit(cell.index(j))) {
+                merged.push_back(cell.index(j), cell.box(j), mLeafPool);
             }
         }
+        cell.release(mLeafPool);
+        mFreeLeaves.push_back(span);
+        mMatrixSpanning[mindex] = NO_INDEX;
+    }
+
+    // the parent cell is now the leaf cell
+    const IndexType cindex = mMatrixParents[mindex];
+    mCells[cindex].configure(true, leaf);
+    mLeafParents[leaf] = cindex;
+    for (size_t i = 0; i < count; ++i) {
+        mCellOwners[begin + i] = NO_INDEX;
+    }
+    mFreeCells.push_back(std::make_pair(begin, IndexType(count)));
+    mMatrixParents[mindex] = NO_INDEX;
+    mFreeMatrices.push_back(mindex);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+unsigned int
+MultiGridSpacePartitionT<IndexType>::rebalance(void)
+{
+    if (mQueueingUpdates || mMatrixCells.empty()) {
+        return 0;
+    }
+    if (mFrozen) {
+        thaw();
+    }
+    const RefinementConfig& config = mRefinementConfig;
+    unsigned int changes = 0;
+
+    // split the crowded leaf cells (only the current ones)
+    const size_t numLeaves = mLeafCells.size();
+    for (size_t i = 0; i < numLeaves; ++i) {
+        if (mLeafParents[i] == NO_INDEX ||
+            mLeafCells[i].size() <= config.splitThreshold ||
+            matrixLevel(mCellOwners[mLeafParents[i]]) >= config.maxLevels) {
+            continue;
+        }
+        if (splitLeaf(i, config.splitColumns, config.splitRows)) {
+            ++changes;
+        }
+    }
+
+    // merge the matrices of leaf cells with few objects
+    for (size_t i = 1; i < mMatrixCells.size(); ++i) {
+        if (mMatrixParents[i] == NO_INDEX) {
+            continue;
+        }
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[i];
+        const size_t count = matrix.numRows() * matrix.numColumns();
+        size_t numObjects = 0;
+        bool onlyLeaves = true;
+        for (size_t j = 0; j < count && onlyLeaves; ++j) {
+            const CellType& cell = mCells[matrix.getCellIndex(j)];
+            onlyLeaves = cell.isLeaf();
+            numObjects += onlyLeaves ? mLeafCells[cell.index()].size() : 0;
+        }
+        if (onlyLeaves && numObjects <= config.mergeThreshold && mergeMatrix(i)) {
+            ++changes;
+        }
+    }
+    return changes;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+unsigned int
+MultiGridSpacePartitionT<IndexType>::numLevels(void) const
+{
+    unsigned int levels = 0;
+    for (size_t i = 0; i < mMatrixCells.size(); ++i) {
+        if (i == 0 || mMatrixParents[i] != NO_INDEX) {
+            levels = std::max(levels, matrixLevel(i));
+        }
     }
+    return levels;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Query methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const Vector2& point, ObjectPtrVec& result)
+{
+    getObjects(point, result, mQueryContext);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const Vector2& point,
+                                                ObjectPtrVec& result,
+                                                QueryContext& context) const
+{
+    result.clear();
+    visitPoint(point, context, [&result](Object* object) {
+        result.push_back(object);
+        return true;
+    });
 }
 
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const AABB& aabb, ObjectPtrVec& result)
+{
+    getObjects(aabb, result, mQueryContext);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const AABB& aabb,
+                                                ObjectPtrVec& result,
+                                                QueryContext& context) const
+{
+    result.clear();
+    queryAABB(aabb, context, result);
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const Vector2& center,
+                                                float32 radius,
+                                                ObjectPtrVec& result)
+{
+    getObjects(center, radius, result, mQueryContext);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjects(const Vector2& center,
+                                                float32 radius,
+                                                ObjectPtrVec& result,
+                                                QueryContext& context) const
+{
+    result.clear();
+    visitCircle(center, radius, context, [&result](Object* object) {
+        result.push_back(object);
+        return true;
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::queryAABB(const AABB& aabb,
+                                               QueryContext& context,
+                                               ObjectPtrVec& result) const
+{
+    visitAABB(aabb, context, [&result](Object* object) {
+        result.push_back(object);
+        return true;
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::raycast(const Vector2& origin,
+                                             const Vector2& dir,
+                                             float32 maxDist,
+                                             RaycastHitVec& result,
+                                             bool firstHitOnly)
+{
+    raycast(origin, dir, maxDist, result, mQueryContext, firstHitOnly);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::raycast(const Vector2& origin,
+                                             const Vector2& dir,
+                                             float32 maxDist,
+                                             RaycastHitVec& result,
+                                             QueryContext& context,
+                                             bool firstHitOnly) const
+{
+    result.clear();
+    context.newQuery(mObjects.size());
+    const float32 length = std::sqrt(dir.x * dir.x + dir.y * dir.y);
+    if (mMatrixCells.empty() || length <= 0.f || maxDist < 0.f) {
+        return;
+    }
+    const Vector2 ndir(dir.x / length, dir.y / length);
+    if (mLoose) {
+        raycastLoose(origin, ndir, maxDist, context, result, firstHitOnly);
+        MGSP_STAT(context.stats.hits = result.size();)
+        return;
+    }
+
+    // get where the ray enters in the world (if it does)
+    const MatrixPartition<IndexType>& root = getRootMatrix();
+    float32 tBegin;
+    context.spanningHits.clear();
+    if (root.boundingBox().intersectRay(origin, ndir, 0.f, maxDist, tBegin)) {
+        ASSERT(!mCells[0].isLeaf());
+        const bool done = raycastMatrix(mCells[0].index(), origin, ndir, tBegin,
+                                        maxDist, context, result, firstHitOnly);
+        // the hits of the spanning lists after the last leaf cell
+        std::vector<std::pair<float32, Object*> >& pending = context.spanningHits;
+        while (!done && !pending.empty()) {
+            result.push_back(RaycastHit(pending.back().second, pending.back().first));
+            pending.pop_back();
+            if (firstHitOnly) {
+                break;
+            }
+        }
+    }
+    // only count the hits reported (firstHitOnly)
+    MGSP_STAT(context.stats.hits = result.size();)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::raycastMatrix(IndexType matrixIndex,
+                                                   const Vector2& origin,
+                                                   const Vector2& dir,
+                                                   float32 tBegin,
+                                                   float32 tEnd,
+                                                   QueryContext& context,
+                                                   RaycastHitVec& result,
+                                                   bool firstHitOnly) const
+{
+    ASSERT(matrixIndex < mMatrixCells.size());
+    MGSP_STAT(++context.stats.matrices;)
+    const MatrixPartition<IndexType>& matrix = mMatrixCells[matrixIndex];
+    const AABB& bb = matrix.boundingBox();
+
+    // The objects spanning this matrix are not in its leaf cells, we keep
+    // their hits until we reach the leaf cell where they should be reported
+    // (see raycastLeaf()).
+    if (hasSpanningObjects(matrixIndex)) {
+        const LeafView<IndexType> span = getLeafView(mMatrixSpanning[matrixIndex]);
+        MGSP_STAT(++context.stats.leaves; context.stats.candidates += span.size();)
+        std::vector<std::pair<float32, Object*> >& pending = context.spanningHits;
+        for (size_t i = 0; i < span.size(); ++i) {
+            float32 t;
+            if (!span.box(i).intersectRay(origin, dir, 0.f, tEnd, t)) {
+                continue;
+            }
+            if (!context.visit(span.index(i))) {
+                MGSP_STAT(++context.stats.dedupHits;)
+                continue;
+            }
+            ASSERT(span.index(i) < mObjects.size());
+            pending.push_back(std::make_pair(t, mObjects[span.index(i)]));
+        }
+        std::sort(pending.begin(), pending.end(),
+                  std::greater<std::pair<float32, Object*> >());
+    }
+
+    const float32 cellWidth = matrix.cellWidth();
+    const float32 cellHeight = matrix.cellHeight();
+    const float32 infinity = std::numeric_limits<float32>::infinity();
+
+    // We start in the cell that contains the entry point. Note that we use
+    // the clamped row / column, so small precision errors between the parent
+    // cell and this matrix bounding box are not a problem.
+    const Vector2 entry = origin + dir * tBegin;
+    int row = static_cast<int>(matrix.getRow(entry.y));
+    int col = static_cast<int>(matrix.getColumn(entry.x));
+    const int numRows = static_cast<int>(matrix.numRows());
+    const int numColumns = static_cast<int>(matrix.numColumns());
+
+    // the t where we cross the next column / row and how much t we need to
+    // cross a full column / row
+    int stepX = 0, stepY = 0;
+    float32 tNextX = infinity, tNextY = infinity;
+    float32 tDeltaX = infinity, tDeltaY = infinity;
+    if (dir.x > 0.f) {
+        stepX = 1;
+        tNextX = (bb.tl.x + cellWidth * (col + 1) - origin.x) / dir.x;
+        tDeltaX = cellWidth / dir.x;
+    } else if (dir.x < 0.f) {
+        stepX = -1;
+        tNextX = (bb.tl.x + cellWidth * col - origin.x) / dir.x;
+        tDeltaX = -cellWidth / dir.x;
+    }
+    if (dir.y > 0.f) {
+        stepY = 1;
+        tNextY = (bb.br.y + cellHeight * (row + 1) - origin.y) / dir.y;
+        tDeltaY = cellHeight / dir.y;
+    } else if (dir.y < 0.f) {
+        stepY = -1;
+        tNextY = (bb.br.y + cellHeight * row - origin.y) / dir.y;
+        tDeltaY = -cellHeight / dir.y;
+    }
+
+    float32 tCell = tBegin;
+    while (true) {
+        float32 tExit = tNextX < tNextY ? tNextX : tNextY;
+        if (tExit > tEnd) {
+            tExit = tEnd;
+        }
+
+        const CellType& cell = mCells[matrix.getCellIndex(row, col)];
+        if (cell.isLeaf()) {
+            if (raycastLeaf(cell.index(), origin, dir, tExit,
+                            context, result, firstHitOnly)) {
+                return true;
+            }
+        } else if (raycastMatrix(cell.index(), origin, dir, tCell, tExit,
+                                 context, result, firstHitOnly)) {
+            return true;
+        }
+
+        if (tExit >= tEnd) {
+            break;
+        }
+        // move to the next cell
+        if (tNextX < tNextY) {
+            col += stepX;
+            tCell = tNextX;
+            tNextX += tDeltaX;
+            if (col < 0 || col >= numColumns) {
+                break;
+            }
+        } else {
+            row += stepY;
+            tCell = tNextY;
+            tNextY += tDeltaY;
+            if (row < 0 || row >= numRows) {
+                break;
+            }
+        }
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::raycastLeaf(IndexType leaf,
+                                                 const Vector2& origin,
+                                                 const Vector2& dir,
+                                                 float32 tExit,
+                                                 QueryContext& context,
+                                                 RaycastHitVec& result,
+                                                 bool firstHitOnly) const
+{
+    const LeafView<IndexType> cell = getLeafView(leaf);
+    MGSP_STAT(++context.stats.leaves; context.stats.candidates += cell.size();)
+    const size_t first = result.size();
+    for (size_t i = 0; i < cell.size(); ++i) {
+        float32 t;
+        // objects hit after leaving this cell will be reported (in order) by
+        // the cell containing the entry point, so we do not mark them yet.
+        if (!cell.box(i).intersectRay(origin, dir, 0.f, tExit, t)) {
+            continue;
+        }
+        if (!context.visit(cell.index(i))) {
+            MGSP_STAT(++context.stats.dedupHits;)
+            continue;
+        }
+        ASSERT(cell.index(i) < mObjects.size());
+        result.push_back(RaycastHit(mObjects[cell.index(i)], t));
+    }
+    // the hits of the spanning lists of the matrices over this cell that we
+    // enter before leaving it
+    std::vector<std::pair<float32, Object*> >& pending = context.spanningHits;
+    while (!pending.empty() && pending.back().first <= tExit) {
+        result.push_back(RaycastHit(pending.back().second, pending.back().first));
+        pending.pop_back();
+    }
+    if (result.size() == first) {
+        return false;
+    }
+    std::sort(result.begin() + first, result.end());
+    if (firstHitOnly) {
+        result.resize(first + 1);
+        return true;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::raycastLoose(const Vector2& origin,
+                                                  const Vector2& dir,
+                                                  float32 maxDist,
+                                                  QueryContext& context,
+                                                  RaycastHitVec& result,
+                                                  bool firstHitOnly) const
+{
+    // the objects can be outside of the world as far as the reach of the
+    // root matrix
+    const AABB& world = getRootMatrix().boundingBox();
+    const Vector2& reach = mLooseReach[0];
+    const AABB bounds(world.tl.y + reach.y, world.tl.x - reach.x,
+                      world.br.y - reach.y, world.br.x + reach.x);
+    float32 tBegin;
+    if (!bounds.intersectRay(origin, dir, 0.f, maxDist, tBegin)) {
+        return;
+    }
+
+    // get the AABB of the segment (clamped to the bounds, maxDist could be
+    // infinite)
+    AABB segment(origin, origin);
+    const Vector2 end(dir.x == 0.f ? origin.x : origin.x + dir.x * maxDist,
+                      dir.y == 0.f ? origin.y : origin.y + dir.y * maxDist);
+    segment.increaseToContain(end);
+    segment.tl.x = std::max(segment.tl.x, bounds.tl.x);
+    segment.tl.y = std::min(segment.tl.y, bounds.tl.y);
+    segment.br.x = std::min(segment.br.x, bounds.br.x);
+    segment.br.y = std::max(segment.br.y, bounds.br.y);
+
+    // each object is only in one leaf cell so we don't need the stamps, but
+    // the hits of different cells are not sorted
+    getLooseIDsFromAABB(segment, context.leafIndices, context.matrixIds, &context.stats);
+    MGSP_STAT(context.stats.leaves += context.leafIndices.size();)
+    for (size_t l = 0; l < context.leafIndices.size(); ++l) {
+        const LeafView<IndexType> cell = getLeafView(context.leafIndices[l]);
+        MGSP_STAT(context.stats.candidates += cell.size();)
+        for (size_t i = 0; i < cell.size(); ++i) {
+            float32 t;
+            if (cell.box(i).intersectRay(origin, dir, 0.f, maxDist, t)) {
+                ASSERT(cell.index(i) < mObjects.size());
+                result.push_back(RaycastHit(mObjects[cell.index(i)], t));
+            }
+        }
+    }
+    if (firstHitOnly && !result.empty()) {
+        std::swap(result.front(), *std::min_element(result.begin(), result.end()));
+        result.resize(1);
+    } else {
+        std::sort(result.begin(), result.end());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::nearestRingDistance(IndexType matrixIndex,
+                                                         const Vector2& point,
+                                                         uint16_t ring,
+                                                         float32& dist2) const
+{
+    ASSERT(matrixIndex < mMatrixCells.size());
+    const MatrixPartition<IndexType>& matrix = mMatrixCells[matrixIndex];
+    const AABB& bb = matrix.boundingBox();
+    const float32 width = matrix.cellWidth();
+    const float32 height = matrix.cellHeight();
+    const int row = static_cast<int>(matrix.getRow(point.y));
+    const int col = static_cast<int>(matrix.getColumn(point.x));
+    const int numRows = static_cast<int>(matrix.numRows());
+    const int numColumns = static_cast<int>(matrix.numColumns());
+    const int r = ring;
+    // in the loose mode the objects of a cell can be outside of it
+    const Vector2 reach = mLoose ? mLooseReach[matrixIndex] : Vector2();
+
+    // The ring is formed by 4 strips: the rows row - r and row + r and the
+    // columns col - r and col + r (each one clamped to the matrix). The
+    // distance to the ring is the minimum distance to any of them.
+    const int colBegin = std::max(col - r, 0);
+    const int colEnd = std::min(col + r, numColumns - 1);
+    const int rowBegin = std::max(row - r + 1, 0);
+    const int rowEnd = std::min(row + r - 1, numRows - 1);
+    bool found = false;
+    dist2 = std::numeric_limits<float32>::max();
+    const int strips[2] = {row - r, row + r};
+    for (int i = 0; i < (r == 0 ? 1 : 2); ++i) {
+        if (strips[i] < 0 || strips[i] >= numRows) {
+            continue;
+        }
+        const float32 bottom = bb.br.y + height * strips[i];
+        const float32 d2 = squaredDistance(point,
+                                           bb.tl.x + width * colBegin - reach.x,
+                                           bottom - reach.y,
+                                           bb.tl.x + width * (colEnd + 1) + reach.x,
+                                           bottom + height + reach.y);
+        dist2 = std::min(dist2, d2);
+        found = true;
+    }
+    if (r == 0 || rowBegin > rowEnd) {
+        return found;
+    }
+    const int colStrips[2] = {col - r, col + r};
+    for (int i = 0; i < 2; ++i) {
+        if (colStrips[i] < 0 || colStrips[i] >= numColumns) {
+            continue;
+        }
+        const float32 left = bb.tl.x + width * colStrips[i];
+        const float32 d2 = squaredDistance(point,
+                                           left - reach.x,
+                                           bb.br.y + height * rowBegin - reach.y,
+                                           left + width + reach.x,
+                                           bb.br.y + height * (rowEnd + 1) + reach.y);
+        dist2 = std::min(dist2, d2);
+        found = true;
+    }
+    return found;
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getNearest(const Vector2& point,
+                                                size_t k,
+                                                ObjectPtrVec& result)
+{
+    getNearest(point, k, result, mQueryContext);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getNearest(const Vector2& point,
+                                                size_t k,
+                                                ObjectPtrVec& result,
+                                                QueryContext& context) const
+{
+    result.clear();
+    context.newQuery(mObjects.size());
+    if (k == 0 || mMatrixCells.empty()) {
+        return;
+    }
+    std::vector<NearestNode>& nodes = context.nodes;
+    std::vector<NearestCandidate>& candidates = context.candidates;
+    nodes.clear();
+    candidates.clear();
+
+    // Best first search: we always expand the closest node (ring of cells of
+    // a matrix or leaf cell), starting from the ring 0 of the root matrix
+    // (the cell containing the point).
+    NearestNode node;
+    node.index = mCells[0].index();
+    node.ring = 0;
+    ASSERT(!mCells[0].isLeaf());
+    if (!nearestRingDistance(node.index, point, 0, node.dist2)) {
+        return;
+    }
+    nodes.push_back(node);
+    MGSP_STAT(++context.stats.matrices;)
+
+    while (!nodes.empty()) {
+        std::pop_heap(nodes.begin(), nodes.end());
+        const NearestNode current = nodes.back();
+        nodes.pop_back();
+        // if we already have k objects and the closest node is farther than
+        // the kth one then we are done
+        if (candidates.size() == k && current.dist2 >= candidates.front().first) {
+            break;
+        }
+
+        if (current.ring == NEAREST_LEAF) {
+            // check all the objects of the leaf cell
+            const LeafView<IndexType> cell = getLeafView(current.index);
+            MGSP_STAT(++context.stats.leaves; context.stats.candidates += cell.size();)
+            for (size_t i = 0; i < cell.size(); ++i) {
+                const float32 d2 = squaredDistance(point, cell.minX()[i],
+                    cell.minY()[i], cell.maxX()[i], cell.maxY()[i]);
+                if (candidates.size() == k && d2 >= candidates.front().first) {
+                    continue;
+                }
+                if (!mLoose && !context.visit(cell.index(i))) {
+                    MGSP_STAT(++context.stats.dedupHits;)
+                    continue;
+                }
+                if (candidates.size() == k) {
+                    std::pop_heap(candidates.begin(), candidates.end());
+                    candidates.pop_back();
+                }
+                ASSERT(cell.index(i) < mObjects.size());
+                candidates.push_back(NearestCandidate(d2, mObjects[cell.index(i)]));
+                std::push_heap(candidates.begin(), candidates.end());
+            }
+            continue;
+        }
+
+        // the first time we expand a matrix we add its spanning list, the
+        // distance of the ring 0 is the distance to the matrix
+        if (current.ring == 0 && hasSpanningObjects(current.index)) {
+            NearestNode span;
+            span.index = mMatrixSpanning[current.index];
+            span.ring = NEAREST_LEAF;
+            span.dist2 = current.dist2;
+            nodes.push_back(span);
+            std::push_heap(nodes.begin(), nodes.end());
+        }
+
+        // expand the ring: add all its cells and the next ring of the matrix
+        const MatrixPartition<IndexType>& matrix = mMatrixCells[current.index];
+        const int row = static_cast<int>(matrix.getRow(point.y));
+        const int col = static_cast<int>(matrix.getColumn(point.x));
+        const int r = current.ring;
+        for (int i = row - r; i <= row + r; ++i) {
+            if (i < 0 || i >= static_cast<int>(matrix.numRows())) {
+                continue;
+            }
+            // for the inner rows we only have the first and last columns
+            const int step = (i == row - r || i == row + r) ? 1 : 2 * r;
+            for (int j = col - r; j <= col + r; j += step) {
+                if (j < 0 || j >= static_cast<int>(matrix.numColumns())) {
+                    continue;
+                }
+                const CellType& cell = mCells[matrix.getCellIndex(i, j)];
+                NearestNode child;
+                child.index = cell.index();
+                if (cell.isLeaf()) {
+                    // in the loose mode we use the bounds of the objects
+                    const AABB bb = mLoose ? mLooseBounds[child.index] :
+                        matrix.getCellBoundingBox(i, j);
+                    if (bb.tl.x > bb.br.x) {
+                        // empty leaf cell (loose mode)
+                        continue;
+                    }
+                    child.ring = NEAREST_LEAF;
+                    child.dist2 = bb.squaredDistance(point);
+                } else {
+                    child.ring = 0;
+                    if (!nearestRingDistance(child.index, point, 0, child.dist2)) {
+                        continue;
+                    }
+                    MGSP_STAT(++context.stats.matrices;)
+                }
+                nodes.push_back(child);
+                std::push_heap(nodes.begin(), nodes.end());
+            }
+        }
+        NearestNode next;
+        next.index = current.index;
+        next.ring = current.ring + 1;
+        if (nearestRingDistance(next.index, point, next.ring, next.dist2)) {
+            nodes.push_back(next);
+            std::push_heap(nodes.begin(), nodes.end());
+        }
+    }
+
+    // the candidates are a max heap, sort them from the closest one
+    std::sort_heap(candidates.begin(), candidates.end());
+    result.reserve(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        result.push_back(candidates[i].second);
+    }
+    MGSP_STAT(context.stats.hits = result.size();)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjectsBatch(const AABB* queries,
+                                                     size_t count,
+                                                     ResultSink& result,
+                                                     ThreadPool* pool)
+{
+    const unsigned int numThreads = pool == 0 ? 1 : pool->numThreads();
+    if (mThreadContexts.size() < numThreads) {
+        mThreadContexts.resize(numThreads);
+        mThreadResults.resize(numThreads);
+    }
+    QueryStats batchStats;
+    runBatch(queries, count, result, pool, mThreadContexts.data(),
+             mThreadResults.data(), batchStats);
+    MGSP_STAT(if (count > 0) recordQueryStats(batchStats);)
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getObjectsBatch(const AABB* queries,
+                                                     size_t count,
+                                                     ResultSink& result,
+                                                     std::vector<QueryContext>& contexts,
+                                                     ThreadPool* pool) const
+{
+    const unsigned int numThreads = pool == 0 ? 1 : pool->numThreads();
+    if (contexts.size() < numThreads) {
+        contexts.resize(numThreads);
+    }
+    std::vector<ObjectPtrVec> threadResults(numThreads);
+    QueryStats batchStats;
+    runBatch(queries, count, result, pool, contexts.data(),
+             threadResults.data(), batchStats);
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::runBatch(const AABB* queries,
+                                              size_t count,
+                                              ResultSink& result,
+                                              ThreadPool* pool,
+                                              QueryContext* contexts,
+                                              ObjectPtrVec* threadResults,
+                                              QueryStats& stats) const
+{
+    ASSERT(queries != 0 || count == 0);
+    (void)stats;
+    result.clear();
+    result.offsets.resize(count + 1, 0);
+    if (count == 0) {
+        return;
+    }
+
+    // Each thread will add the objects of its queries into its own buffer,
+    // and we will save for each query where its objects are [thread, begin).
+    // The number of objects of each query is saved in offsets[i+1].
+    const unsigned int numThreads = pool == 0 ? 1 : pool->numThreads();
+    for (unsigned int t = 0; t < numThreads; ++t) {
+        threadResults[t].clear();
+    }
+    std::vector<uint32_t> queryThread(count);
+    std::vector<uint32_t> queryBegin(count);
+    MGSP_STAT(std::vector<QueryStats> threadStats(numThreads);)
+
+    auto runQueries = [&](size_t begin, size_t end, unsigned int thread) {
+        ObjectPtrVec& objects = threadResults[thread];
+        for (size_t i = begin; i < end; ++i) {
+            queryThread[i] = thread;
+            queryBegin[i] = objects.size();
+            queryAABB(queries[i], contexts[thread], objects);
+            result.offsets[i+1] = objects.size() - queryBegin[i];
+            MGSP_STAT(threadStats[thread] += contexts[thread].stats;)
+        }
+    };
+    if (pool == 0) {
+        runQueries(0, count, 0);
+    } else {
+        pool->parallelFor(count, 64, runQueries);
+    }
+
+#ifdef MGSP_STATS
+    for (unsigned int t = 0; t < numThreads; ++t) {
+        stats += threadStats[t];
+    }
+#endif
+
+    // now build the offsets and copy the objects in the query order
+    for (size_t i = 0; i < count; ++i) {
+        result.offsets[i+1] += result.offsets[i];
+    }
+    result.objects.resize(result.offsets.back());
+    for (size_t i = 0; i < count; ++i) {
+        const ObjectPtrVec& objects = threadResults[queryThread[i]];
+        std::copy(objects.begin() + queryBegin[i],
+                  objects.begin() + queryBegin[i] + result.numObjects(i),
+                  result.objects.begin() + result.offsets[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getLeafPairs(IndexType leaf,
+                                                  QueryContext& context,
+                                                  PairSink& result) const
+{
+    ASSERT(leaf < mLeafCells.size());
+    if (mLoose) {
+        getLooseLeafPairs(leaf, context, result);
+        return;
+    }
+    if (mLeafParents[leaf] == NO_INDEX) {
+        // free leaf cell or spanning list (see getSpanningPairs())
+        return;
+    }
+
+    // Two objects can share several leaf cells, to report the pair only once
+    // we will only report it in the leaf cell that contains the bottom left
+    // corner of the intersection of both. Since the cells where each object
+    // is are calculated clamping the same way than we get the leaf of a point
+    // that leaf is always one of the shared ones.
+    //
+    const LeafView<IndexType> cell = getLeafView(leaf);
+    for (size_t i = 0; i < cell.size(); ++i) {
+        const AABB abb(cell.maxY()[i], cell.minX()[i], cell.minY()[i], cell.maxX()[i]);
+        // check against all the next ones
+        for (size_t j = i + 1; j < cell.size(); j += AABB_MASK_BITS) {
+            uint32_t mask = cell.collideMask(j, abb);
+            while (mask != 0) {
+                const size_t k = j + __builtin_ctz(mask);
+                mask &= mask - 1;
+                const Vector2 corner(abb.tl.x > cell.minX()[k] ? abb.tl.x : cell.minX()[k],
+                                     abb.br.y > cell.minY()[k] ? abb.br.y : cell.minY()[k]);
+                if (getLeafIndex(corner) == leaf) {
+                    ASSERT(cell.index(i) < mObjects.size());
+                    ASSERT(cell.index(k) < mObjects.size());
+                    result.push(mObjects[cell.index(i)], mObjects[cell.index(k)]);
+                }
+            }
+        }
+    }
+
+    // Each object is only once in the path from the root matrix to the leaf
+    // cell of the corner (in a leaf cell or in a spanning list), the pairs
+    // of an object of this leaf cell and an object spanning one of the
+    // matrices over it are also reported here.
+    IndexType mindex = mCellOwners[mLeafParents[leaf]];
+    while (true) {
+        if (hasSpanningObjects(mindex)) {
+            const LeafView<IndexType> span = getLeafView(mMatrixSpanning[mindex]);
+            for (size_t i = 0; i < span.size(); ++i) {
+                const AABB abb = span.box(i);
+                for (size_t j = 0; j < cell.size(); j += AABB_MASK_BITS) {
+                    uint32_t mask = cell.collideMask(j, abb);
+                    while (mask != 0) {
+                        const size_t k = j + __builtin_ctz(mask);
+                        mask &= mask - 1;
+                        const Vector2 corner(std::max(abb.tl.x, cell.minX()[k]),
+                                             std::max(abb.br.y, cell.minY()[k]));
+                        if (getLeafIndex(corner) == leaf) {
+                            ASSERT(span.index(i) < mObjects.size());
+                            ASSERT(cell.index(k) < mObjects.size());
+                            result.push(mObjects[span.index(i)], mObjects[cell.index(k)]);
+                        }
+                    }
+                }
+            }
+        }
+        if (mindex == 0) {
+            break;
+        }
+        mindex = mCellOwners[mMatrixParents[mindex]];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getSpanningPairs(IndexType matrix,
+                                                      PairSink& result) const
+{
+    if (mMatrixParents[matrix] == NO_INDEX || !hasSpanningObjects(matrix)) {
+        return;
+    }
+
+    // same than getLeafPairs(): we report the pairs where both objects are in
+    // spanning lists and this one is the deepest of them in the path to the
+    // leaf cell of the corner.
+    const LeafView<IndexType> span = getLeafView(mMatrixSpanning[matrix]);
+    IndexType mindex = matrix;
+    while (true) {
+        if (hasSpanningObjects(mindex)) {
+            const LeafView<IndexType> other = getLeafView(mMatrixSpanning[mindex]);
+            for (size_t i = 0; i < span.size(); ++i) {
+                const AABB abb = span.box(i);
+                for (size_t j = mindex == matrix ? i + 1 : 0; j < other.size();
+                     j += AABB_MASK_BITS) {
+                    uint32_t mask = other.collideMask(j, abb);
+                    while (mask != 0) {
+                        const size_t k = j + __builtin_ctz(mask);
+                        mask &= mask - 1;
+                        const Vector2 corner(std::max(abb.tl.x, other.minX()[k]),
+                                             std::max(abb.br.y, other.minY()[k]));
+                        if (isMatrixOnPath(corner, matrix)) {
+                            ASSERT(span.index(i) < mObjects.size());
+                            ASSERT(other.index(k) < mObjects.size());
+                            result.push(mObjects[span.index(i)], mObjects[other.index(k)]);
+                        }
+                    }
+                }
+            }
+        }
+        if (mindex == 0) {
+            break;
+        }
+        mindex = mCellOwners[mMatrixParents[mindex]];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getLooseLeafPairs(IndexType leaf,
+                                                       QueryContext& context,
+                                                       PairSink& result) const
+{
+    // Each object is only in one leaf cell, so each pair is reported by the
+    // leaf cell with the lower index (or by the first object if both are in
+    // the same one).
+    //
+    const LeafView<IndexType> cell = getLeafView(leaf);
+    for (size_t i = 0; i < cell.size(); ++i) {
+        const AABB abb(cell.maxY()[i], cell.minX()[i], cell.minY()[i], cell.maxX()[i]);
+        getLooseIDsFromAABB(abb, context.leafIndices, context.matrixIds);
+        for (size_t l = 0; l < context.leafIndices.size(); ++l) {
+            const IndexType other = context.leafIndices[l];
+            if (other < leaf) {
+                continue;
+            }
+            const LeafView<IndexType> ocell = getLeafView(other);
+            for (size_t j = other == leaf ? i + 1 : 0; j < ocell.size(); j += AABB_MASK_BITS) {
+                uint32_t mask = ocell.collideMask(j, abb);
+                while (mask != 0) {
+                    const size_t k = j + __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    ASSERT(cell.index(i) < mObjects.size());
+                    ASSERT(ocell.index(k) < mObjects.size());
+                    result.push(mObjects[cell.index(i)], mObjects[ocell.index(k)]);
+                }
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::getAllOverlappingPairs(PairSink& result,
+                                                            ThreadPool* pool) const
+{
+    result.clear();
+    if (mLeafCells.empty()) {
+        return;
+    }
+
+    if (pool == 0 || pool->numThreads() == 1) {
+        QueryContext context;
+        for (size_t i = 0; i < mLeafCells.size(); ++i) {
+            getLeafPairs(i, context, result);
+        }
+        for (size_t i = 0; i < mMatrixSpanning.size(); ++i) {
+            getSpanningPairs(i, result);
+        }
+        return;
+    }
+
+    // each thread will write its own pairs and we will join them later. The
+    // leaf cells are taken in small chunks so the threads with less work
+    // will take more chunks.
+    std::vector<PairSink> threadPairs(pool->numThreads());
+    std::vector<QueryContext> contexts(pool->numThreads());
+    pool->parallelFor(mLeafCells.size(), 32,
+        [&](size_t begin, size_t end, unsigned int thread) {
+            for (size_t i = begin; i < end; ++i) {
+                getLeafPairs(i, contexts[thread], threadPairs[thread]);
+            }
+        });
+    pool->parallelFor(mMatrixSpanning.size(), 8,
+        [&](size_t begin, size_t end, unsigned int thread) {
+            for (size_t i = begin; i < end; ++i) {
+                getSpanningPairs(i, threadPairs[thread]);
+            }
+        });
+
+    size_t total = 0;
+    for (size_t i = 0; i < threadPairs.size(); ++i) {
+        total += threadPairs[i].size();
+    }
+    result.first.reserve(total);
+    result.second.reserve(total);
+    for (size_t i = 0; i < threadPairs.size(); ++i) {
+        const PairSink& pairs = threadPairs[i];
+        result.first.insert(result.first.end(), pairs.first.begin(), pairs.first.end());
+        result.second.insert(result.second.end(), pairs.second.begin(), pairs.second.end());
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+// Report methods
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+void
+MultiGridSpacePartitionT<IndexType>::report(StructureReport& report) const
+{
+    report = StructureReport();
+
+    // the cells and matrices are not in the heap if they are mapped
+    if (!mCells.isMapped()) {
+        report.cells.used = mCells.size() * sizeof(CellType);
+        report.cells.reserved = mCells.capacity() * sizeof(CellType);
+    }
+    if (!mMatrixCells.isMapped()) {
+        report.matrices.used = mMatrixCells.size() * sizeof(MatrixPartition<IndexType>);
+        report.matrices.reserved =
+            mMatrixCells.capacity() * sizeof(MatrixPartition<IndexType>);
+    }
+    report.mappedFileBytes = mStructureFile.size();
+
+    report.leafCells.add(mLeafCells);
+    report.leafFlags.add(mLeafFlags);
+    report.leafFlags.add(mDirtyLeafCells);
+    report.topology.add(mLeafParents);
+    report.topology.add(mMatrixParents);
+    report.topology.add(mCellOwners);
+    report.topology.add(mFreeLeaves);
+    report.topology.add(mFreeMatrices);
+    report.topology.add(mFreeCells);
+    report.looseBounds.add(mLooseBounds);
+    report.looseBounds.add(mLooseReach);
+    report.topology.add(mMatrixSpanning);
+    report.objects.add(mObjects);
+    // the queue has no capacity, we only count its elements
+    report.objects.used += mObjectFreeIndices.size() * sizeof(unsigned int);
+    report.objects.reserved += mObjectFreeIndices.size() * sizeof(unsigned int);
+    report.pendingUpdates.add(mPendingUpdates);
+    report.pendingUpdates.add(mPendingSlots);
+
+    // the temporary buffers
+    auto addContext = [&report](const QueryContext& context) {
+        report.scratch.add(context.matrixIds);
+        report.scratch.add(context.cellIndices);
+        report.scratch.add(context.leafIndices);
+        report.scratch.add(context.stamps);
+        report.scratch.add(context.nodes);
+        report.scratch.add(context.candidates);
+        report.scratch.add(context.spanningHits);
+    };
+    report.scratch.add(mTmpMatrixIds);
+    report.scratch.add(mTmpIndices);
+    report.scratch.add(mTmpDiffMatrices);
+    report.scratch.add(mLeafTmpIndices);
+    addContext(mQueryContext);
+    report.scratch.add(mThreadContexts);
+    for (size_t i = 0; i < mThreadContexts.size(); ++i) {
+        addContext(mThreadContexts[i]);
+    }
+    report.scratch.add(mThreadResults);
+    for (size_t i = 0; i < mThreadResults.size(); ++i) {
+        report.scratch.add(mThreadResults[i]);
+    }
+    report.scratch.add(mShards.items);
+    report.scratch.add(mShards.begins);
+    report.scratch.add(mShards.shared);
+    report.scratch.add(mWriterContexts);
+    for (size_t i = 0; i < mWriterContexts.size(); ++i) {
+        report.scratch.add(mWriterContexts[i].diffMatrices);
+        report.scratch.add(mWriterContexts[i].ids);
+        report.scratch.add(mWriterContexts[i].matrixIds);
+    }
+
+    // the leaf cells contents and occupancy (only the leaf cells in use)
+    size_t numEntries = 0;
+    report.leafContents.add(mFrozenOffsets);
+    report.leafContents.add(mFrozenIndices);
+    report.leafContents.add(mFrozenMinX);
+    report.leafContents.add(mFrozenMinY);
+    report.leafContents.add(mFrozenMaxX);
+    report.leafContents.add(mFrozenMaxY);
+    report.leafContents.reserved += mLeafPool.reservedBytes();
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        if (!mLeafCells[i].isInline()) {
+            report.leafContents.used += mLeafCells[i].usedBytes();
+            report.pooledLeafBytes += mLeafCells[i].reservedBytes();
+        }
+        const LeafView<IndexType> leaf = getLeafView(i);
+        if (i < mLeafParents.size() && mLeafParents[i] == NO_INDEX) {
+            // free leaf cells (empty) or spanning lists
+            report.numSpanningEntries += leaf.size();
+            continue;
+        }
+        ++report.numLeafCells;
+        numEntries += leaf.size();
+        report.maxResidents = std::max(report.maxResidents, leaf.size());
+        size_t bucket = 0;
+        for (size_t count = leaf.size(); count > 0; count >>= 1) {
+            ++bucket;
+        }
+        if (report.occupancyHistogram.size() <= bucket) {
+            report.occupancyHistogram.resize(bucket + 1, 0);
+        }
+        ++report.occupancyHistogram[bucket];
+    }
+
+    report.numCells = mCells.size();
+    for (size_t i = 0; i < mFreeCells.size(); ++i) {
+        report.numCells -= mFreeCells[i].second;
+    }
+    report.numMatrices = mMatrixCells.size() - mFreeMatrices.size();
+    report.numObjects = mObjects.size() - mObjectFreeIndices.size();
+    if (report.numLeafCells > 0) {
+        report.meanResidents = static_cast<float32>(numEntries) / report.numLeafCells;
+    }
+    if (report.numObjects > 0) {
+        report.meanReplication =
+            static_cast<float32>(numEntries + report.numSpanningEntries) / report.numObjects;
+    }
+
+    const StructureReport::Bytes* parts[] = {
+        &report.cells, &report.matrices, &report.leafCells, &report.leafContents,
+        &report.leafFlags, &report.topology, &report.looseBounds, &report.objects,
+        &report.pendingUpdates, &report.scratch
+    };
+    report.total.used = report.total.reserved = sizeof(*this);
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+        report.total += *parts[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::exportOccupancyHeatmap(const char* filename) const
+{
+    ASSERT(filename != 0);
+    std::ofstream out(filename, std::ios::out | std::ios::trunc);
+    if (!out) {
+        DEBUG_PRINT("Error: cannot open the file " << filename << std::endl);
+        return false;
+    }
+
+    out << "leaf,min_x,min_y,max_x,max_y,objects\n";
+    AABB bb;
+    for (size_t i = 0; i < mLeafCells.size(); ++i) {
+        if (!getLeafBoundingBox(i, bb)) {
+            continue;
+        }
+        out << i << ',' << bb.tl.x << ',' << bb.br.y << ',' << bb.br.x << ','
+            << bb.tl.y << ',' << getLeafView(i).size() << '\n';
+    }
+    return out.good();
+}
+
+////////////////////////////////////////////////////////////////////////////
+template <typename IndexType>
+bool
+MultiGridSpacePartitionT<IndexType>::getLeafBoundingBox(IndexType leaf, AABB& aabb) const
+{
+    if (leaf >= mLeafParents.size() || mLeafParents[leaf] == NO_INDEX) {
+        return false;
+    }
+    const IndexType cell = mLeafParents[leaf];
+    ASSERT(cell < mCellOwners.size() && mCellOwners[cell] != NO_INDEX);
+    const MatrixPartition<IndexType>& matrix = mMatrixCells[mCellOwners[cell]];
+    const size_t local = cell - matrix.getCellIndex(0, 0);
+    aabb = matrix.getCellBoundingBox(local / matrix.numColumns(),
+                                     local % matrix.numColumns());
+    return true;
+}
+
+
+// The versions we support
+//
+template class MultiGridSpacePartitionT<uint16_t>;
+template class MultiGridSpacePartitionT<uint32_t>;
+
 } /* namespace mgsp */
@@ -23,8 +23,8 @@
 #define MULTIGRIDSPACEPARTITION_H_
 
 #include <vector>
-#include <unordered_set>
 #include <queue>
+#include <algorithm>
 
 #include <math/AABB.h>
 #include <math/Vec2.h>
@@ -34,15 +34,157 @@
 #include "TypeDefs.h"
 #include "Object.h"
 #include "MatrixPartition.h"
+#include "MappedArray.h"
+#include "LeafCell.h"
+#include "QueryStats.h"
+#include "QueryContext.h"
 
 
 namespace mgsp {
 
+// forward declaration
+//
+class ThreadPool;
+
 // Some useful typedefs
 //
 typedef std::vector<Object*> ObjectPtrVec;
 typedef std::vector<ObjectIndex> ObjectIndicesVec;
 
+// The list of pairs of objects colliding, we will use two arrays (first and
+// second) instead of one array of pairs so it can be consumed directly.
+// The pair i is (first[i], second[i]).
+//
+struct PairSink {
+    std::vector<Object*> first;
+    std::vector<Object*> second;
+
+    inline void
+    clear(void) {first.clear(); second.clear();}
+    inline size_t
+    size(void) const {return first.size();}
+    inline void
+    push(Object* a, Object* b) {first.push_back(a); second.push_back(b);}
+};
+
+// The result of a batch of queries in compressed form: all the objects of all
+// the queries are in one array, and the objects of the query i are in the
+// range [offsets[i], offsets[i+1]).
+//
+struct ResultSink {
+    std::vector<uint32_t> offsets;
+    std::vector<Object*> objects;
+
+    inline void
+    clear(void) {offsets.clear(); objects.clear();}
+    inline size_t
+    numQueries(void) const {return offsets.empty() ? 0 : offsets.size() - 1;}
+    inline size_t
+    numObjects(size_t query) const {return offsets[query+1] - offsets[query];}
+    inline Object* const*
+    queryObjects(size_t query) const {return objects.data() + offsets[query];}
+};
+
+// One object hit by a ray: the object and the distance from the origin of the
+// ray to the point where the ray enters in the object AABB.
+//
+struct RaycastHit {
+    Object* object;
+    float32 distance;
+
+    RaycastHit(Object* o = 0, float32 d = 0.f) : object(o), distance(d) {}
+    inline bool
+    operator<(const RaycastHit& other) const {return distance < other.distance;}
+};
+typedef std::vector<RaycastHit> RaycastHitVec;
+
+// The memory used by the structure and how the objects are distributed in
+// the leaf cells (see MultiGridSpacePartitionT::report()).
+//
+struct StructureReport {
+    // The bytes of a part of the structure: used is size() * sizeof(element)
+    // and reserved includes the capacity slack of the containers.
+    //
+    struct Bytes {
+        size_t used;
+        size_t reserved;
+
+        Bytes() : used(0), reserved(0) {}
+
+        template <typename Container>
+        inline void
+        add(const Container& c)
+        {
+            used += c.size() * sizeof(typename Container::value_type);
+            reserved += c.capacity() * sizeof(typename Container::value_type);
+        }
+        inline Bytes&
+        operator+=(const Bytes& other)
+        {
+            used += other.used;
+            reserved += other.reserved;
+            return *this;
+        }
+    };
+
+    // the cells and matrices (0 if they live in the mapped file)
+    Bytes cells;
+    Bytes matrices;
+    // the LeafCell objects (with the contents that fit in their inline
+    // storage) and the contents in the pooled blocks (object indices and AABBs)
+    Bytes leafCells;
+    Bytes leafContents;
+    // the leaf cell flags and the dirty list
+    Bytes leafFlags;
+    // the parents / owners and free lists used to split / merge cells
+    Bytes topology;
+    // the bounds of the leaf cells and the reach of the matrices (loose mode)
+    Bytes looseBounds;
+    // the list of objects and their free indices
+    Bytes objects;
+    // the queued updates
+    Bytes pendingUpdates;
+    // the temporary buffers used by the operations and queries
+    Bytes scratch;
+    // the sum of all of them plus the size of the class itself
+    Bytes total;
+    // the size of the imported structure file (shared between processes)
+    size_t mappedFileBytes;
+    // the bytes of the pooled blocks held by the leaf cells (the rest of the
+    // pool in leafContents.reserved is free to be reused)
+    size_t pooledLeafBytes;
+
+    size_t numCells;
+    size_t numMatrices;
+    // the leaf cells in use (not counting the free ones)
+    size_t numLeafCells;
+    size_t numObjects;
+    // the number of objects in the fullest leaf cell and the mean
+    size_t maxResidents;
+    float32 meanResidents;
+    // the number of objects in the spanning lists of the matrices
+    size_t numSpanningEntries;
+    // the mean number of leaf cells (or spanning lists) each object is in
+    float32 meanReplication;
+    // occupancyHistogram[0] is the number of empty leaf cells and
+    // occupancyHistogram[i] the number of leaf cells with [2^(i-1), 2^i)
+    // objects.
+    std::vector<size_t> occupancyHistogram;
+
+    StructureReport() :
+        mappedFileBytes(0)
+    ,   pooledLeafBytes(0)
+    ,   numCells(0)
+    ,   numMatrices(0)
+    ,   numLeafCells(0)
+    ,   numObjects(0)
+    ,   maxResidents(0)
+    ,   meanResidents(0.f)
+    ,   numSpanningEntries(0)
+    ,   meanReplication(0.f)
+    {}
+};
+
 
 // Auxiliary class used to construct the MultiGrid, this is veeeery inefficient but
 // will be used only for debug, since the real version should be exported / imported
@@ -77,16 +219,16 @@ public:
     {
         ASSERT(row < mYSubDivisions);
         ASSERT(col < mXSubDivisions);
-        // this is assert(mYSubDivisions * row + col < mSubCells.size());
-        return mSubCells[mYSubDivisions * row + col];
+        // this is assert(mXSubDivisions * row + col < mSubCells.size());
+        return mSubCells[mXSubDivisions * row + col];
     }
     CellStructInfo&
     getSubCell(uint8_t row, uint8_t col)
     {
         ASSERT(row < mYSubDivisions);
         ASSERT(col < mXSubDivisions);
-        // this is assert(mYSubDivisions * row + col < mSubCells.size());
-        return mSubCells[mYSubDivisions * row + col];
+        // this is assert(mXSubDivisions * row + col < mSubCells.size());
+        return mSubCells[mXSubDivisions * row + col];
     }
 
     // @brief Recursive method to calculate the number of cells including
@@ -130,11 +272,22 @@ private:
 };
 
 
-class MultiGridSpacePartition
+// The IndexType (uint16_t or uint32_t) is the type we use to store the cell,
+// matrix and object indices in the structure. The 16 bits version is the most
+// compact one but is limited to 2^15 cells (leaf and matrix cells) and 2^16
+// objects, the 32 bits one is for the big worlds.
+//
+template <typename IndexType>
+class MultiGridSpacePartitionT
 {
 public:
-    MultiGridSpacePartition();
-    ~MultiGridSpacePartition();
+    // the cell type we use for this index type
+    typedef CellT<IndexType> CellType;
+    // the temporary buffers of the queries, see the const query methods
+    typedef QueryContextT<IndexType> QueryContext;
+
+    MultiGridSpacePartitionT();
+    ~MultiGridSpacePartitionT();
 
     ////////////////////////////////////////////////////////////////////////////
     // Construction methods
@@ -149,20 +302,51 @@ public:
     bool
     build(const AABB& worldSize, const CellStructInfo& info);
 
-    // TODO: add the import / export method to read all this from a file (we
-    // can serialize the structure directly into memory since we will use
-    // only indices and not pointers).
+    // @brief Export the current structure (cells, matrices and leaf information)
+    //        into a binary file that can be loaded later with importStructure().
+    //        Note that the objects are not exported, only the structure.
+    // @param filename  The file where we will write the structure
+    // @return true on success | false otherwise
     //
+    bool
+    exportStructure(const char* filename) const;
+
+    // @brief Import a structure previously exported with exportStructure().
+    //        The file will be mapped into memory (mmap) and used directly, so
+    //        loading is almost free and the pages are shared between all the
+    //        processes loading the same file.
+    // @param filename  The file to load
+    // @return true on success | false otherwise (the structure will be empty)
+    // @note This method will remove all the current objects (as build() does).
+    //
+    bool
+    importStructure(const char* filename);
 
     ////////////////////////////////////////////////////////////////////////////
     // Insertion / removal methods
 
-    // @brief Add an object to the multi grid.
+    // @brief Add an object to the multi grid. The object is not inserted if
+    //        IndexType cannot index more objects.
     // @param object        The object to add.
     //
     void
     insert(Object* object);
 
+    // @brief Add a list of objects at once. This is much faster than calling
+    //        insert() for each one since we first calculate the leaf cells of
+    //        all the objects, then reserve the exact space needed in each
+    //        leaf cell and finally fill them in one pass. The objects that
+    //        IndexType cannot index are not inserted.
+    // @param objects       The list of objects to add
+    // @param count         The number of objects in the list
+    // @param pool          If not null the leaf cells of the objects will be
+    //                      calculated in parallel using this pool, and the
+    //                      leaf cells filled in parallel by root cell (see the
+    //                      parallel writer methods).
+    //
+    void
+    insertBulk(Object** objects, size_t count, ThreadPool* pool = 0);
+
     // @brief Update the position / AABB from an object
     // @param object        The object to be updated
     // @param aabb          The new aabb of the object
@@ -176,9 +360,243 @@ public:
     void
     remove(Object* object);
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Parallel writer methods
+    //
+    // The objects are grouped by the root cell that contains them: the leaf
+    // cells below different root cells are disjoint, so each root cell is
+    // processed by one thread and different root cells run in parallel
+    // without locks. The objects crossing the boundaries of the root cells
+    // (before or after moving) are processed by the calling thread once the
+    // parallel part is done. The object slots (indices) are only allocated /
+    // released by the calling thread.
+    // Each object can appear only once in the list, and nobody else can read
+    // or write the structure meanwhile.
+
+    // @brief Update a list of objects, same than calling
+    //        update(objects[i], aabbs[i]) for each one.
+    // @param objects       The objects to update
+    // @param aabbs         The new AABB of each object
+    // @param count         The number of objects
+    // @param pool          The pool to use (if null everything runs in the
+    //                      calling thread)
+    //
+    void
+    updateParallel(Object* const* objects,
+                   const AABB* aabbs,
+                   size_t count,
+                   ThreadPool* pool);
+
+    // @brief Remove a list of objects, same than calling remove(objects[i])
+    //        for each one.
+    // @param objects       The objects to remove
+    // @param count         The number of objects
+    // @param pool          The pool to use (if null everything runs in the
+    //                      calling thread)
+    //
+    void
+    removeParallel(Object* const* objects, size_t count, ThreadPool* pool);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Deferred update methods
+    //
+    // When we move the same objects several times before querying we can
+    // queue the updates and apply all of them at once. Only the last AABB of
+    // each object will be applied, and all the leaf cells modifications will
+    // be done sorted by leaf cell.
+    // Note that the queries will return the old positions until commit() is
+    // called.
+
+    // @brief Start queueing the updates
+    //
+    void
+    beginUpdates(void);
+
+    // @brief Queue an update for an object. If the object was already queued
+    //        we will only keep the last AABB. If we are not in the
+    //        beginUpdates() / commit() mode this is the same than update().
+    // @param object        The object to be updated
+    // @param aabb          The new aabb of the object
+    //
+    void
+    queueUpdate(Object* object, const AABB& aabb);
+
+    // @brief Apply all the queued updates and stop queueing them. The leaf
+    //        cells that were modified will be marked as dirty.
+    //
+    void
+    commit(void);
+
+    // @brief Check if we are queueing updates (beginUpdates() was called)
+    //
+    inline bool
+    isQueueingUpdates(void) const;
+
+    // @brief Return the list of leaf cells (dirty) that were modified by the
+    //        last commit().
+    //
+    inline const std::vector<IndexType>&
+    getDirtyLeafCells(void) const;
+
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Frozen layout methods
+    //
+    // When the objects are not modified for a while we can pack the contents
+    // of all the leaf cells into contiguous arrays (in leaf cell order) with
+    // the offset of each leaf cell (CSR layout), releasing the memory of each
+    // leaf cell. The queries read the packed arrays directly. Any
+    // modification (insert, update, remove, commit, split / merge...) will
+    // thaw the structure first.
+
+    // @brief Pack the contents of the leaf cells (nothing if already frozen)
+    //
+    void
+    freeze(void);
+
+    // @brief Move the packed contents back to the leaf cells (nothing if not
+    //        frozen)
+    //
+    void
+    thaw(void);
+
+    // @brief Check if the structure is frozen
+    //
+    inline bool
+    isFrozen(void) const;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Loose mode methods
+    //
+    // In the loose mode each object is stored only in the leaf cell that
+    // contains its center (clamped to the world) instead of in all the leaf
+    // cells its AABB overlaps, so insert / update / remove touch only one
+    // leaf cell and the queries don't need to remove duplicates. Each leaf
+    // cell keeps the bounds of its objects and each matrix the maximum
+    // distance (per axis) its objects reach from their centers, the queries
+    // widen the cells they visit in each matrix by that distance.
+    // The bounds only grow when the objects move or are removed, see
+    // refitLooseBounds().
+
+    // @brief Enable / disable the loose mode, moving the current objects to
+    //        their new leaf cells.
+    //
+    void
+    setLooseMode(bool loose);
+
+    // @brief Check if we are in the loose mode
+    //
+    inline bool
+    isLooseMode(void) const;
+
+    // @brief Recalculate the bounds of the leaf cells and matrices from the
+    //        current objects (nothing if we are not in the loose mode).
+    //        This is also done by freeze().
+    //
+    void
+    refitLooseBounds(void);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Spanning object methods
+    //
+    // The objects covering a big part of a matrix would be copied in many of
+    // its leaf cells (and moving them means updating all of them). Instead of
+    // that, an object whose AABB covers more than a given fraction of the
+    // cells of a matrix is stored once in the spanning list of the matrix
+    // (and not in the cells below it), and the queries check the spanning
+    // lists of the matrices they traverse.
+    // The spanning lists are not used in the loose mode (each object is
+    // already stored only once).
+
+    // @brief Set the fraction of the cells of a matrix an object must cover
+    //        (and at least 2 cells) to be stored in its spanning list,
+    //        moving the current objects to their new places.
+    // @param fraction  The fraction in (0, 1], 1 (default) disables them.
+    //
+    void
+    setSpanningFraction(float32 fraction);
+    inline float32
+    spanningFraction(void) const;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Adaptive refinement methods
+    //
+    // The leaf cells with too many objects can be split into a new matrix of
+    // leaf cells, and the matrices (of leaf cells) with few objects can be
+    // merged back into a leaf cell, without rebuilding the structure.
+
+    // The thresholds used by rebalance()
+    //
+    struct RefinementConfig {
+        // split the leaf cells with more objects than this
+        unsigned int splitThreshold;
+        // merge the matrices whose leaf cells have this number of objects or
+        // less (counting the objects once per leaf cell)
+        unsigned int mergeThreshold;
+        // the size of the matrices created when splitting a leaf cell
+        uint8_t splitColumns;
+        uint8_t splitRows;
+        // the maximum number of matrix levels (the root matrix is the level 1)
+        unsigned int maxLevels;
+
+        RefinementConfig() :
+            splitThreshold(256)
+        ,   mergeThreshold(64)
+        ,   splitColumns(4)
+        ,   splitRows(4)
+        ,   maxLevels(6)
+        {}
+    };
+
+    // @brief Set / get the refinement configuration.
+    // @note The mergeThreshold should be smaller than the splitThreshold to
+    //       avoid splitting and merging the same cells all the time.
+    //
+    inline void
+    setRefinementConfig(const RefinementConfig& config);
+    inline const RefinementConfig&
+    refinementConfig(void) const;
+
+    // @brief Split all the leaf cells and merge all the matrices following the
+    //        refinement configuration thresholds. Each call only do one step
+    //        (a leaf cell created by a split will not be split again until the
+    //        next call).
+    // @return the number of leaf cells split plus the matrices merged
+    //
+    unsigned int
+    rebalance(void);
+
+    // @brief Split a leaf cell into a new matrix of leaf cells, moving all the
+    //        objects of the leaf cell into the new ones.
+    // @param leaf      The leaf cell index
+    // @param columns   The number of columns of the new matrix
+    // @param rows      The number of rows of the new matrix
+    // @return true on success | false otherwise (invalid leaf or we cannot
+    //         index more cells)
+    //
+    bool
+    splitLeaf(IndexType leaf, uint8_t columns, uint8_t rows);
+
+    // @brief Merge a matrix that only contains leaf cells into one leaf cell.
+    // @param matrix    The matrix index (the root matrix cannot be merged)
+    // @return true on success | false otherwise
+    //
+    bool
+    mergeMatrix(IndexType matrix);
+
+    // @brief Return the number of matrix levels of the structure
+    //
+    unsigned int
+    numLevels(void) const;
 
     ////////////////////////////////////////////////////////////////////////////
     // Query methods
+    //
+    // Each query has a const version that receives a QueryContext (the
+    // temporary buffers), so several threads can query the structure at the
+    // same time using one context each, as long as nobody modifies it.
+    // The versions without context use an internal one, so they cannot be
+    // called concurrently.
 
     // @brief Get all the elements that intersect a specific point
     // @param point         The position where we want to get all the objects
@@ -186,6 +604,8 @@ public:
     //
     void
     getObjects(const Vector2& point, ObjectPtrVec& result);
+    void
+    getObjects(const Vector2& point, ObjectPtrVec& result, QueryContext& context) const;
 
     // @brief Get all the elements that intersect a specific AABB
     // @param aabb          The region we want to check
@@ -193,24 +613,186 @@ public:
     //
     void
     getObjects(const AABB& aabb, ObjectPtrVec& result);
+    void
+    getObjects(const AABB& aabb, ObjectPtrVec& result, QueryContext& context) const;
+
+    // @brief Get all the elements that intersect a circle. Only the cells
+    //        touching the circle are visited (at every level) and each object
+    //        AABB is checked against the circle.
+    // @param center        The center of the circle
+    // @param radius        The radius of the circle
+    // @param result        The list of all objects intersecting the circle
+    //
+    void
+    getObjects(const Vector2& center, float32 radius, ObjectPtrVec& result);
+    void
+    getObjects(const Vector2& center,
+               float32 radius,
+               ObjectPtrVec& result,
+               QueryContext& context) const;
+
+    // @brief Call a visitor for each one of the objects that intersect a
+    //        specific AABB / point / circle, without building any list.
+    //        The visitor will be called as bool visitor(Object*), returning
+    //        false will stop the query.
+    // @param aabb / point  The region we want to check
+    // @param visitor       The visitor to call for each object
+    // @return true if all the objects were visited | false if the visitor
+    //         stopped the query
+    //
+    template <typename Visitor>
+    inline bool
+    forEachObject(const AABB& aabb, Visitor&& visitor);
+    template <typename Visitor>
+    inline bool
+    forEachObject(const Vector2& point, Visitor&& visitor);
+    template <typename Visitor>
+    inline bool
+    forEachObject(const Vector2& center, float32 radius, Visitor&& visitor);
+    template <typename Visitor>
+    inline bool
+    forEachObject(const AABB& aabb, QueryContext& context, Visitor&& visitor) const;
+    template <typename Visitor>
+    inline bool
+    forEachObject(const Vector2& point, QueryContext& context, Visitor&& visitor) const;
+    template <typename Visitor>
+    inline bool
+    forEachObject(const Vector2& center,
+                  float32 radius,
+                  QueryContext& context,
+                  Visitor&& visitor) const;
+
+    // @brief Get all the objects hit by a ray (or segment) sorted by distance
+    //        (front to back). We walk the cells crossed by the ray
+    //        matrix by matrix, so only the leaf cells the ray touches are
+    //        checked.
+    // @param origin        The origin of the ray
+    // @param dir           The direction of the ray (does not need to be
+    //                      normalized)
+    // @param maxDist       The length of the ray / segment (world units)
+    // @param result        The objects hit with their distance to the origin
+    // @param firstHitOnly  If true we will stop on the first (closest) hit
+    //
+    void
+    raycast(const Vector2& origin,
+            const Vector2& dir,
+            float32 maxDist,
+            RaycastHitVec& result,
+            bool firstHitOnly = false);
+    void
+    raycast(const Vector2& origin,
+            const Vector2& dir,
+            float32 maxDist,
+            RaycastHitVec& result,
+            QueryContext& context,
+            bool firstHitOnly = false) const;
+
+    // @brief Get the k objects closest to a point (using the distance from the
+    //        point to the object AABB), sorted from the closest one.
+    //        We start from the leaf cell containing the point and expand
+    //        through the neighbour cells (and matrices) in order of distance,
+    //        stopping when no cell left could contain a closer object.
+    // @param point         The point
+    // @param k             The (maximum) number of objects to return
+    // @param result        The closest objects
+    //
+    void
+    getNearest(const Vector2& point, size_t k, ObjectPtrVec& result);
+    void
+    getNearest(const Vector2& point,
+               size_t k,
+               ObjectPtrVec& result,
+               QueryContext& context) const;
+
+    // @brief Run a list of AABB queries at once (same than calling
+    //        getObjects(queries[i], ...) for each one).
+    // @param queries       The list of AABBs to query
+    // @param count         The number of queries
+    // @param result        The result of each query
+    // @param pool          If not null the queries will be split between the
+    //                      threads of the pool.
+    // @param contexts      The contexts used by each thread of the pool (it
+    //                      will be resized if needed), so several threads can
+    //                      run batches at the same time.
+    //
+    void
+    getObjectsBatch(const AABB* queries,
+                    size_t count,
+                    ResultSink& result,
+                    ThreadPool* pool = 0);
+    void
+    getObjectsBatch(const AABB* queries,
+                    size_t count,
+                    ResultSink& result,
+                    std::vector<QueryContext>& contexts,
+                    ThreadPool* pool = 0) const;
+
+    // @brief Get all the pairs of objects that are colliding. Each pair will
+    //        be reported only once even if both objects share several leaf
+    //        cells.
+    // @param result        The list of pairs
+    // @param pool          If not null the leaf cells will be processed in
+    //                      parallel using this pool.
+    //
+    void
+    getAllOverlappingPairs(PairSink& result, ThreadPool* pool = 0) const;
 
     // @brief Get the main (root) Matrix cell
     //
-    inline MatrixPartition<uint16_t>&
+    inline MatrixPartition<IndexType>&
     getRootMatrix(void);
-    inline const MatrixPartition<uint16_t>&
+    inline const MatrixPartition<IndexType>&
     getRootMatrix(void) const;
 
 
-#ifdef DEBUG
-    // This method will return the size of this structure.
+    ////////////////////////////////////////////////////////////////////////////
+    // Report methods
+
+    // @brief Fill a report with the memory used by each part of the structure
+    //        and the occupancy of the leaf cells.
+    // @param report    The report to fill
     //
-    inline unsigned int
+    void
+    report(StructureReport& report) const;
+
+    // @brief Export the occupancy of each leaf cell as CSV, one line per leaf
+    //        cell in use: "leaf,min_x,min_y,max_x,max_y,objects" (world
+    //        coordinates), so it can be drawn as a heatmap.
+    // @param filename  The file where we will write the CSV
+    // @return true on success | false otherwise
+    //
+    bool
+    exportOccupancyHeatmap(const char* filename) const;
+
+    // @brief Return the bytes reserved by this structure (see report()).
+    //
+    inline size_t
     memSize(void) const;
+
+#ifdef MGSP_STATS
+    // @brief Get the counters of the last query (getObjects(), forEachObject(),
+    //        raycast(), getNearest() or a full getObjectsBatch()) and the sum
+    //        of all the queries since the last resetQueryStats().
+    //        The queries run with a QueryContext are not counted here (see
+    //        QueryContext::queryStats()).
+    //        Only available when compiling with MGSP_STATS.
+    //
+    inline const QueryStats&
+    lastQueryStats(void) const;
+    inline const QueryStats&
+    totalQueryStats(void) const;
+    inline void
+    resetQueryStats(void);
 #endif
 
 private:
 
+    // @brief Remove all the cells, matrices and objects (and the mapped file
+    //        if any).
+    //
+    void
+    clearAll(void);
+
     // @brief Check if an object is handled by this class
     // @param object        The object we want to check
     // @return true on success | false otherwise
@@ -225,36 +807,508 @@ private:
     // @param ids       The resulting list of Leaf cell ids
     //
     void
-    getIDsFromAABB(const AABB& aabb, std::vector<uint16_t>& ids) const;
+    getIDsFromAABB(const AABB& aabb, std::vector<IndexType>& ids) const;
+
+    // @brief Same than before but using the given temporary buffers instead of
+    //        the internal ones (so it can be called from different threads).
+    // @param matrixIds     Temporary buffer for the matrix indices
+    // @param cellIndices   Temporary buffer for the cell indices
+    // @param stats         If not null we will count the matrices traversed
+    //                      (MGSP_STATS only)
+    //
+    void
+    getIDsFromAABB(const AABB& aabb,
+                   std::vector<IndexType>& ids,
+                   std::vector<IndexType>& matrixIds,
+                   std::vector<IndexType>& cellIndices,
+                   QueryStats* stats = 0) const;
+
+    // @brief Get the list of leaf cells that intersects a circle.
+    // @param center / radius   The circle
+    // @param ids               The resulting list of leaf cell ids
+    // @param matrixIds         Temporary buffer for the matrix indices
+    // @param cellIndices       Temporary buffer for the cell indices
+    // @param stats             If not null we will count the matrices
+    //                          traversed (MGSP_STATS only)
+    //
+    void
+    getIDsFromCircle(const Vector2& center,
+                     float32 radius,
+                     std::vector<IndexType>& ids,
+                     std::vector<IndexType>& matrixIds,
+                     std::vector<IndexType>& cellIndices,
+                     QueryStats* stats = 0) const;
+
+    // @brief Get the list of leaf cells that can contain objects intersecting
+    //        an AABB in the loose mode: in each matrix we visit the cells
+    //        touching the AABB widened by the reach of the matrix, and only
+    //        the leaf cells whose bounds touch the AABB are returned.
+    // @param aabb              The region
+    // @param ids               The resulting list of leaf cell ids
+    // @param matrixIds         Temporary buffer for the matrix indices
+    // @param stats             If not null we will count the matrices
+    //                          traversed (MGSP_STATS only)
+    //
+    void
+    getLooseIDsFromAABB(const AABB& aabb,
+                        std::vector<IndexType>& ids,
+                        std::vector<IndexType>& matrixIds,
+                        QueryStats* stats = 0) const;
+
+    // @brief Get the leaf cells where an object with a given AABB is stored:
+    //        all the ones overlapping the AABB (or the spanning lists of the
+    //        matrices it spans), or only the one containing its center in
+    //        the loose mode.
+    // @param aabb              The AABB of the object
+    // @param ids               The resulting list of leaf cell ids
+    // @param matrixIds         Temporary buffer for the matrix indices
+    //
+    void
+    getObjectLeaves(const AABB& aabb,
+                    std::vector<IndexType>& ids,
+                    std::vector<IndexType>& matrixIds) const;
+
+    // @brief Get the point used to place an object in the loose mode (the
+    //        center of the AABB clamped to the world), and the AABB used to
+    //        choose its root cell (the point in the loose mode or the AABB
+    //        itself otherwise).
+    //
+    inline Vector2
+    loosePoint(const AABB& aabb) const;
+    inline AABB
+    placementBox(const AABB& aabb) const;
+
+    // @brief Check if an object covering a range of cells of a matrix must
+    //        be stored in the spanning list of the matrix.
+    // @param matrix    The matrix index
+    // @param range     The cells covered by the object
+    //
+    inline bool
+    isSpanning(IndexType matrix, const CellRange& range) const;
+
+    // @brief Check if a matrix has objects in its spanning list
+    //
+    inline bool
+    hasSpanningObjects(IndexType matrix) const;
+
+    // @brief Create / release the spanning lists of all the matrices in use
+    //        depending if they are enabled or not (they must be empty).
+    //
+    void
+    configureSpanningLists(void);
+
+    // @brief Place again all the objects from scratch (after changing the
+    //        loose mode or the spanning lists).
+    //
+    void
+    relocateObjects(void);
+
+    // @brief Grow the bounds of a leaf cell and the reach of its matrices
+    //        to contain an object added to the leaf cell (loose mode).
+    // @param leaf      The leaf cell index
+    // @param aabb      The AABB of the object
+    //
+    void
+    addLooseObject(IndexType leaf, const AABB& aabb);
+
+    // @brief Calculate the topology (the cells pointing to each leaf cell /
+    //        matrix and the matrix of each cell) and the free lists (leaf
+    //        cells, matrices and cells not used) from the cells and matrices.
+    //
+    void
+    buildTopology(void);
+
+    // @brief Get a free leaf cell / matrix / block of count cells, adding
+    //        new ones if there is no free one.
+    //
+    IndexType
+    allocateLeaf(void);
+    IndexType
+    allocateMatrix(void);
+    IndexType
+    allocateCells(size_t count);
+
+    // @brief Get the level of a matrix (the root matrix is the level 1)
+    //
+    unsigned int
+    matrixLevel(IndexType matrix) const;
+
+    // @brief Get the world bounding box of a leaf cell in use
+    // @param leaf      The leaf cell index
+    // @param aabb      The resulting bounding box
+    // @return false if the leaf cell is not in use
+    //
+    bool
+    getLeafBoundingBox(IndexType leaf, AABB& aabb) const;
+
+    // @brief Clean the dirty flags of all the leaf cells
+    //
+    void
+    clearDirtyLeafCells(void);
+
+    // The nearest search nodes / candidates (see QueryContextT)
+    //
+    typedef typename QueryContext::NearestNode NearestNode;
+    typedef typename QueryContext::NearestCandidate NearestCandidate;
+    static const uint16_t NEAREST_LEAF = 0xFFFF;
+
+    // @brief Add all the objects that intersect an AABB to result (without
+    //        removing the current ones).
+    // @param aabb          The region we want to check
+    // @param context       The query context (temporary buffers) to use
+    // @param result        The list where we will add the objects
+    //
+    void
+    queryAABB(const AABB& aabb, QueryContext& context, ObjectPtrVec& result) const;
+
+    // @brief Call visitor(Object*) for each object intersecting an AABB / point
+    //        until the visitor returns false (see forEachObject()).
+    // @param aabb / point  The region we want to check
+    // @param context       The query context (temporary buffers) to use
+    // @param visitor       The visitor
+    // @return false if the visitor stopped the query | true otherwise
+    //
+    template <typename Visitor>
+    inline bool
+    visitAABB(const AABB& aabb, QueryContext& context, Visitor&& visitor) const;
+    template <typename Visitor>
+    inline bool
+    visitPoint(const Vector2& point, QueryContext& context, Visitor&& visitor) const;
+    template <typename Visitor>
+    inline bool
+    visitCircle(const Vector2& center,
+                float32 radius,
+                QueryContext& context,
+                Visitor&& visitor) const;
+
+    // @brief Walk the cells of a matrix crossed by the ray in the range
+    //        [tBegin, tEnd] (3D-DDA like), recursing on the matrix cells.
+    // @param matrix        The matrix index
+    // @param origin / dir  The ray (dir normalized)
+    // @param tBegin / tEnd The part of the ray inside of the matrix
+    // @param context       The query context (temporary buffers) to use
+    // @param result        Where we will add the hits
+    // @param firstHitOnly  Stop on the first hit
+    // @return true if we should stop (first hit found) | false otherwise
+    //
+    bool
+    raycastMatrix(IndexType matrix,
+                  const Vector2& origin,
+                  const Vector2& dir,
+                  float32 tBegin,
+                  float32 tEnd,
+                  QueryContext& context,
+                  RaycastHitVec& result,
+                  bool firstHitOnly) const;
+
+    // @brief Add the objects of a leaf hit by the ray before tExit (the
+    //        distance where the ray leaves the leaf cell), sorted.
+    // @return true if we should stop (first hit found) | false otherwise
+    //
+    bool
+    raycastLeaf(IndexType leaf,
+                const Vector2& origin,
+                const Vector2& dir,
+                float32 tExit,
+                QueryContext& context,
+                RaycastHitVec& result,
+                bool firstHitOnly) const;
+
+    // @brief Raycast in the loose mode: we check all the leaf cells that can
+    //        contain objects touching the segment AABB (the objects can be
+    //        outside of the cells the ray crosses) and sort the hits.
+    // @param origin / dir  The ray (dir normalized)
+    // @param maxDist       The length of the ray
+    // @param context       The query context (temporary buffers) to use
+    // @param result        Where we will add the hits
+    // @param firstHitOnly  Only keep the closest hit
+    //
+    void
+    raycastLoose(const Vector2& origin,
+                 const Vector2& dir,
+                 float32 maxDist,
+                 QueryContext& context,
+                 RaycastHitVec& result,
+                 bool firstHitOnly) const;
+
+    // @brief Compute the minimum squared distance from a point to the ring of
+    //        cells of a matrix around the cell containing the point.
+    // @param matrix        The matrix index
+    // @param point         The point
+    // @param ring          The ring number
+    // @param dist2         The resulting squared distance
+    // @return false if the ring has no cells (outside of the matrix)
+    //
+    bool
+    nearestRingDistance(IndexType matrix,
+                        const Vector2& point,
+                        uint16_t ring,
+                        float32& dist2) const;
+
+    // @brief Release the packed arrays and mark the structure as not frozen
+    //        (without moving anything back to the leaf cells)
+    //
+    void
+    clearFrozen(void);
+
+    // @brief Get a read only view of the objects of a leaf cell (from the
+    //        packed arrays if the structure is frozen)
+    // @param leaf      The leaf cell index
+    //
+    inline LeafView<IndexType>
+    getLeafView(IndexType leaf) const;
+
+    // @brief Get the leaf cell index that contains a point. If the point is
+    //        outside of the world we will use the closest leaf cell.
+    // @param point     The point
+    //
+    inline IndexType
+    getLeafIndex(const Vector2& point) const;
+
+    // @brief Run the queries of getObjectsBatch() using the given context and
+    //        result buffer for each thread of the pool.
+    // @param contexts      One context per thread
+    // @param threadResults One buffer per thread
+    // @param stats         The sum of the counters of all the queries (only
+    //                      filled when compiling with MGSP_STATS)
+    //
+    void
+    runBatch(const AABB* queries,
+             size_t count,
+             ResultSink& result,
+             ThreadPool* pool,
+             QueryContext* contexts,
+             ObjectPtrVec* threadResults,
+             QueryStats& stats) const;
+
+    // @brief Get all the colliding pairs of a leaf cell that "belong" to this
+    //        leaf cell (to report each pair only once).
+    // @param leaf      The leaf cell index
+    // @param context   The query context (temporary buffers) to use
+    // @param result    Where we will add the pairs
+    //
+    void
+    getLeafPairs(IndexType leaf, QueryContext& context, PairSink& result) const;
+
+    // @brief Get all the colliding pairs that "belong" to the spanning list of
+    //        a matrix: the pairs of objects of this list or of this list and
+    //        the lists of its parent matrices.
+    // @param matrix    The matrix index
+    // @param result    Where we will add the pairs
+    //
+    void
+    getSpanningPairs(IndexType matrix, PairSink& result) const;
+
+    // @brief Check if a matrix is one of the ones we traverse to get the
+    //        leaf cell of a point.
+    //
+    inline bool
+    isMatrixOnPath(const Vector2& point, IndexType matrix) const;
+
+    // @brief Same than getLeafPairs() in the loose mode: the objects of the
+    //        leaf cell are checked against the objects of the same leaf cell
+    //        and the next leaf cells that can contain objects touching them.
+    //
+    void
+    getLooseLeafPairs(IndexType leaf, QueryContext& context, PairSink& result) const;
+
+    // The changes we need to do in a leaf cell when an object moves, sorted
+    // in the order we want to apply them.
+    //
+    enum LeafChange {
+        LEAF_REMOVE = 0,
+        LEAF_ADD,
+        LEAF_UPDATE
+    };
+
+    // the matrices to visit in diffLeafCells() [matrix index, LeafChange]
+    typedef std::vector<std::pair<IndexType, uint8_t> > DiffMatrixVec;
+
+    // @brief Get the changes we need to do in the leaf cells when an object
+    //        moves from oldBB to newBB. For each matrix we only compare the
+    //        row / column ranges of both AABBs, going down only into the
+    //        matrices covered by them, so we never build the full lists of
+    //        leaf cells.
+    //        change(IndexType leafIndex, LeafChange) will be called for each
+    //        leaf cell (LEAF_UPDATE for the ones where the object stays).
+    // @param oldBB     The current AABB of the object
+    // @param newBB     The new AABB of the object
+    // @param matrices  Temporary buffer for the matrices to visit
+    // @param change    The function to call for each leaf cell
+    //
+    template <typename ChangeFunc>
+    void
+    diffLeafCells(const AABB& oldBB,
+                  const AABB& newBB,
+                  DiffMatrixVec& matrices,
+                  ChangeFunc&& change) const;
+
+    // @brief Move an object to a new AABB (update() without the checks)
+    // @param object    The object
+    // @param aabb      The new AABB
+    // @param matrices  Temporary buffer for diffLeafCells()
+    //
+    void
+    moveObject(Object* object, const AABB& aabb, DiffMatrixVec& matrices);
+
+    // The objects of a parallel write grouped by root cell: the items of the
+    // root cell (shard) i are items[begins[i], begins[i+1]) and shared are the
+    // items touching more than one root cell.
+    //
+    struct RootShards {
+        std::vector<uint32_t> items;
+        std::vector<uint32_t> begins;
+        std::vector<uint32_t> shared;
+    };
+
+    // The temporary buffers of each thread in the parallel writes
+    //
+    struct WriterContext {
+        DiffMatrixVec diffMatrices;
+        std::vector<IndexType> ids;
+        std::vector<IndexType> matrixIds;
+    };
+
+    // @brief Get the root cell that contains two AABBs
+    // @param a / b     The AABBs
+    // @param cell      The root cell (row * columns + column)
+    // @return false if they are not inside of the same root cell
+    //
+    inline bool
+    getRootCell(const AABB& a, const AABB& b, uint32_t& cell) const;
+
+    // @brief Group a list of items by root cell, rootCell(i, cell) should
+    //        return the root cell of the item i (see getRootCell()).
+    //
+    template <typename RootCellFunc>
+    void
+    groupByRootCell(size_t count, RootCellFunc&& rootCell, RootShards& shards) const;
+
+    // @brief Call task(item, thread) for all the items of all the shards, the
+    //        shards in parallel (the shared items are not processed).
+    //
+    template <typename Task>
+    void
+    runShards(const RootShards& shards, ThreadPool* pool, Task&& task);
+
+    // @brief Remove an object from the list of objects (releasing its index)
+    //        and discard its queued update if any.
+    // @param object        The object
+    //
+    void
+    releaseObject(Object* object);
+
+    // @brief Assign a new index to an object and add it to the list of objects
+    // @param object        The object
+    // @return true on success | false if IndexType cannot index more objects
+    //
+    inline bool
+    addObjectToList(Object* object);
+
+#ifdef MGSP_STATS
+    // @brief Save the counters of the last query and add them to the totals
+    //
+    inline void
+    recordQueryStats(const QueryStats& stats) const;
+#endif
 
 private:
     // the world size we are mapping
     AABB mWorld;
-    // the number of cells we have (in all the levels) and the pointer to them
-    std::vector<Cell> mCells;
+    // the number of cells we have (in all the levels) and the pointer to them.
+    // The cells and the matrices could live in a mapped file (importStructure)
+    MappedArray<CellType> mCells;
     // The array of cell (leaf) indices, each cell (leaf cell) will contain a list of
     // objects, this objects are in vectors, this probably is not the best option
     // but should work fine now.
-    // Each one of this ObjectIndicesVec will contain the ObjectIndex associated
-    // to the Object* in the mObjects vector
-    std::vector<ObjectIndicesVec> mLeafCells;
+    // Each one of this LeafCell will contain the ObjectIndex associated
+    // to the Object* in the mObjects vector and a copy of its AABB
+    std::vector<LeafCell<IndexType> > mLeafCells;
+    // The memory of the leaf cells that don't fit in their inline storage
+    LeafBlockPool mLeafPool;
+    // The packed leaf cells when the structure is frozen: the objects of the
+    // leaf cell i are in [mFrozenOffsets[i], mFrozenOffsets[i+1]) of the
+    // other arrays (and the LeafCells are empty).
+    bool mFrozen;
+    std::vector<uint32_t> mFrozenOffsets;
+    std::vector<IndexType> mFrozenIndices;
+    std::vector<float32> mFrozenMinX;
+    std::vector<float32> mFrozenMinY;
+    std::vector<float32> mFrozenMaxX;
+    std::vector<float32> mFrozenMaxY;
+    // The flags of each one of the leaf cells and the list of the dirty ones
+    std::vector<CellFlags> mLeafFlags;
+    std::vector<IndexType> mDirtyLeafCells;
     // The Matrix cells
-    std::vector<MatrixPartition<uint16_t> > mMatrixCells;
+    MappedArray<MatrixPartition<IndexType> > mMatrixCells;
+    // the file where the structure lives when it was imported
+    MappedFile mStructureFile;
+    // The topology used to split / merge cells: the cell pointing to each
+    // leaf cell and matrix, the matrix containing each cell (NO_INDEX if
+    // none) and the leaf cells, matrices and block of cells [begin, size]
+    // that are not used.
+    static const IndexType NO_INDEX = IndexType(~IndexType(0));
+    std::vector<IndexType> mLeafParents;
+    std::vector<IndexType> mMatrixParents;
+    std::vector<IndexType> mCellOwners;
+    std::vector<IndexType> mFreeLeaves;
+    std::vector<IndexType> mFreeMatrices;
+    std::vector<std::pair<IndexType, IndexType> > mFreeCells;
+    // The loose mode information: the bounds of the objects of each leaf cell
+    // and for each matrix the maximum distance (x, y) its objects (in all
+    // its levels) reach from their centers.
+    bool mLoose;
+    std::vector<AABB> mLooseBounds;
+    std::vector<Vector2> mLooseReach;
+    // The spanning lists: for each matrix the leaf cell (not attached to any
+    // cell) where we store the objects spanning it, or NO_INDEX.
+    float32 mSpanningFraction;
+    std::vector<IndexType> mMatrixSpanning;
+    RefinementConfig mRefinementConfig;
     // The list of objects we are currently handling
     std::vector<Object*> mObjects;
     std::queue<unsigned int> mObjectFreeIndices;
 
+    // The queued updates (beginUpdates / commit). For each object index we
+    // save the position in mPendingUpdates (or NO_PENDING_UPDATE).
+    struct PendingUpdate {
+        Object* object;
+        AABB aabb;
+        PendingUpdate(Object* o, const AABB& bb) : object(o), aabb(bb) {}
+    };
+    static const unsigned int NO_PENDING_UPDATE = ~0u;
+    bool mQueueingUpdates;
+    std::vector<PendingUpdate> mPendingUpdates;
+    std::vector<unsigned int> mPendingSlots;
+
     // Internal usage members, to avoid multiple reallocation in memory
     // TODO: Optimize: This vectors and queue should be replaced for a stack-mem
     //       version instead of a std one (allocated in the heap....) UGLY
-    mutable std::vector<uint16_t> mTmpMatrixIds;
-    mutable std::vector<uint16_t> mTmpIndices;
-    mutable std::vector<uint16_t> mTmpIndices2;
-    mutable std::vector<uint16_t> mLeafTmpIndices;
-    mutable std::unordered_set<uint16_t> mTmpHash;
+    mutable std::vector<IndexType> mTmpMatrixIds;
+    mutable std::vector<IndexType> mTmpIndices;
+    // the matrices to visit in diffLeafCells()
+    mutable DiffMatrixVec mTmpDiffMatrices;
+    mutable std::vector<IndexType> mLeafTmpIndices;
+    mutable QueryContext mQueryContext;
+    // the temporary buffers used by each thread in the batch queries
+    mutable std::vector<QueryContext> mThreadContexts;
+    mutable std::vector<ObjectPtrVec> mThreadResults;
+    // the shards and per thread buffers of the parallel writers
+    RootShards mShards;
+    std::vector<WriterContext> mWriterContexts;
+#ifdef MGSP_STATS
+    // the counters of the last query and the sum of all of them
+    mutable QueryStats mLastQueryStats;
+    mutable QueryStats mTotalQueryStats;
+#endif
 
 };
 
+// The default (compact) version of the structure
+//
+typedef MultiGridSpacePartitionT<uint16_t> MultiGridSpacePartition;
+
+
 
 
 
@@ -272,45 +1326,468 @@ private:
 // Inline stuff
 //
 
+template <typename IndexType>
 inline bool
-MultiGridSpacePartition::checkObjectExists(const Object* object) const
+MultiGridSpacePartitionT<IndexType>::checkObjectExists(const Object* object) const
 {
     ASSERT(object != 0);
     return object->_mgsp_index < mObjects.size() &&
         mObjects[object->_mgsp_index] == object;
 }
 
-inline MatrixPartition<uint16_t>&
-MultiGridSpacePartition::getRootMatrix(void)
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::addObjectToList(Object* object)
+{
+    // add it to the list, check if we have a free place to add it
+    if (mObjectFreeIndices.empty()) {
+        // the leaf cells store the index using IndexType and NO_INDEX is
+        // reserved
+        if (mObjects.size() >= size_t(NO_INDEX)) {
+            return false;
+        }
+        object->_mgsp_index = mObjects.size();
+        mObjects.push_back(object);
+    } else {
+        object->_mgsp_index = mObjectFreeIndices.front();
+        mObjectFreeIndices.pop();
+        mObjects[object->_mgsp_index] = object;
+    }
+    return true;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::getRootCell(const AABB& a,
+                                                 const AABB& b,
+                                                 uint32_t& cell) const
+{
+    const MatrixPartition<IndexType>& root = getRootMatrix();
+    CellRange ra, rb;
+    if (!root.getCellRange(a, ra) || !root.getCellRange(b, rb) ||
+        ra.rowBegin != ra.rowEnd || ra.colBegin != ra.colEnd ||
+        rb.rowBegin != ra.rowBegin || rb.rowEnd != ra.rowBegin ||
+        rb.colBegin != ra.colBegin || rb.colEnd != ra.colBegin) {
+        return false;
+    }
+    cell = ra.rowBegin * root.numColumns() + ra.colBegin;
+    return true;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::isSpanning(IndexType matrix,
+                                                const CellRange& range) const
+{
+    if (mMatrixSpanning[matrix] == NO_INDEX) {
+        return false;
+    }
+    const MatrixPartition<IndexType>& m = mMatrixCells[matrix];
+    const size_t covered = (range.rowEnd - range.rowBegin + 1) *
+        (range.colEnd - range.colBegin + 1);
+    return covered > 1 &&
+        covered > mSpanningFraction * static_cast<float32>(m.numRows() * m.numColumns());
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::hasSpanningObjects(IndexType matrix) const
+{
+    return mMatrixSpanning[matrix] != NO_INDEX &&
+        getLeafView(mMatrixSpanning[matrix]).size() > 0;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::isMatrixOnPath(const Vector2& point,
+                                                    IndexType matrix) const
+{
+    IndexType index = 0;
+    while (!mCells[index].isLeaf()) {
+        const IndexType mindex = mCells[index].index();
+        if (mindex == matrix) {
+            return true;
+        }
+        index = mMatrixCells[mindex].getCellIndex(point);
+    }
+    return false;
+}
+
+template <typename IndexType>
+inline Vector2
+MultiGridSpacePartitionT<IndexType>::loosePoint(const AABB& aabb) const
+{
+    const AABB& world = getRootMatrix().boundingBox();
+    const float32 x = (aabb.tl.x + aabb.br.x) * 0.5f;
+    const float32 y = (aabb.tl.y + aabb.br.y) * 0.5f;
+    return Vector2(x < world.tl.x ? world.tl.x : (x > world.br.x ? world.br.x : x),
+                   y < world.br.y ? world.br.y : (y > world.tl.y ? world.tl.y : y));
+}
+
+template <typename IndexType>
+inline AABB
+MultiGridSpacePartitionT<IndexType>::placementBox(const AABB& aabb) const
+{
+    if (!mLoose) {
+        return aabb;
+    }
+    const Vector2 point = loosePoint(aabb);
+    return AABB(point, point);
+}
+
+template <typename IndexType>
+inline LeafView<IndexType>
+MultiGridSpacePartitionT<IndexType>::getLeafView(IndexType leaf) const
+{
+    ASSERT(leaf < mLeafCells.size());
+    if (!mFrozen) {
+        return mLeafCells[leaf].view();
+    }
+    const uint32_t begin = mFrozenOffsets[leaf];
+    return LeafView<IndexType>(mFrozenIndices.data() + begin,
+                               mFrozenMinX.data() + begin,
+                               mFrozenMinY.data() + begin,
+                               mFrozenMaxX.data() + begin,
+                               mFrozenMaxY.data() + begin,
+                               mFrozenOffsets[leaf + 1] - begin);
+}
+
+template <typename IndexType>
+inline IndexType
+MultiGridSpacePartitionT<IndexType>::getLeafIndex(const Vector2& point) const
+{
+    // We will get cells until we hit a leaf one.
+    IndexType index = 0;
+    while (!mCells[index].isLeaf()) {
+        // is a matrix
+        const size_t mindex = mCells[index].index();
+        ASSERT(mindex < mMatrixCells.size());
+        // get the index of the cell that intersect the point
+        index = mMatrixCells[mindex].getCellIndex(point);
+    }
+    ASSERT(mCells[index].index() < mLeafCells.size());
+    return mCells[index].index();
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::visitAABB(const AABB& aabb,
+                                               QueryContext& context,
+                                               Visitor&& visitor) const
+{
+    // Since one element could be in multiple leaf cells we mark each object
+    // we check with the current query stamp to avoid visiting it twice (not
+    // needed in the loose mode).
+    //
+    context.newQuery(mObjects.size());
+
+    // get the indices of the leaf cells that intersects the aabb
+    if (mLoose) {
+        getLooseIDsFromAABB(aabb, context.leafIndices, context.matrixIds,
+                            &context.stats);
+    } else {
+        getIDsFromAABB(aabb, context.leafIndices, context.matrixIds,
+                       context.cellIndices, &context.stats);
+    }
+    MGSP_STAT(context.stats.leaves += context.leafIndices.size();)
+    for (size_t i = 0; i < context.leafIndices.size(); ++i) {
+        ASSERT(context.leafIndices[i] < mLeafCells.size());
+        // for each cell we need to check all the current objects
+        const LeafView<IndexType> cell = getLeafView(context.leafIndices[i]);
+        MGSP_STAT(context.stats.candidates += cell.size();)
+        for (size_t j = 0; j < cell.size(); j += AABB_MASK_BITS) {
+            uint32_t mask = cell.collideMask(j, aabb);
+            while (mask != 0) {
+                const size_t k = j + __builtin_ctz(mask);
+                mask &= mask - 1;
+                ASSERT(cell.index(k) < mObjects.size());
+                if (!mLoose && !context.visit(cell.index(k))) {
+                    MGSP_STAT(++context.stats.dedupHits;)
+                    continue;
+                }
+                MGSP_STAT(++context.stats.hits;)
+                if (!visitor(mObjects[cell.index(k)])) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::visitPoint(const Vector2& point,
+                                                QueryContext& context,
+                                                Visitor&& visitor) const
+{
+    // in the loose mode the objects containing the point can be in any of
+    // the near leaf cells
+    if (mLoose) {
+        return visitAABB(AABB(point, point), context, visitor);
+    }
+
+    // only one leaf cell (and the spanning lists of the matrices over it) is
+    // visited, each object is only once there so we don't need the stamps
+    MGSP_STAT(context.stats.reset(); context.stats.queries = 1;)
+
+    // check if the point is in the matrix
+    if (!getRootMatrix().isPointInMatrix(point)) {
+        return true;
+    }
+
+    const AABB pointBB(point, point);
+    auto visitCell = [&](IndexType leaf) {
+        const LeafView<IndexType> cell = getLeafView(leaf);
+        MGSP_STAT(++context.stats.leaves; context.stats.candidates += cell.size();)
+        for (size_t i = 0; i < cell.size(); i += AABB_MASK_BITS) {
+            uint32_t mask = cell.collideMask(i, pointBB);
+            while (mask != 0) {
+                const size_t j = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+                ASSERT(cell.index(j) < mObjects.size());
+                MGSP_STAT(++context.stats.hits;)
+                if (!visitor(mObjects[cell.index(j)])) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    // go down to the leaf cell of the point (as getLeafIndex())
+    IndexType index = 0;
+    while (!mCells[index].isLeaf()) {
+        const IndexType mindex = mCells[index].index();
+        ASSERT(mindex < mMatrixCells.size());
+        if (hasSpanningObjects(mindex) && !visitCell(mMatrixSpanning[mindex])) {
+            return false;
+        }
+        index = mMatrixCells[mindex].getCellIndex(point);
+    }
+    return visitCell(mCells[index].index());
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::visitCircle(const Vector2& center,
+                                                 float32 radius,
+                                                 QueryContext& context,
+                                                 Visitor&& visitor) const
+{
+    context.newQuery(mObjects.size());
+
+    // get only the leaf cells touching the circle (its AABB in the loose
+    // mode), then we filter the objects using the AABB of the circle (fast)
+    // and then the circle itself.
+    const AABB circleBB(center.y + radius, center.x - radius,
+                        center.y - radius, center.x + radius);
+    if (mLoose) {
+        getLooseIDsFromAABB(circleBB, context.leafIndices, context.matrixIds,
+                            &context.stats);
+    } else {
+        getIDsFromCircle(center, radius, context.leafIndices, context.matrixIds,
+                         context.cellIndices, &context.stats);
+    }
+    MGSP_STAT(context.stats.leaves += context.leafIndices.size();)
+    for (size_t i = 0; i < context.leafIndices.size(); ++i) {
+        ASSERT(context.leafIndices[i] < mLeafCells.size());
+        const LeafView<IndexType> cell = getLeafView(context.leafIndices[i]);
+        MGSP_STAT(context.stats.candidates += cell.size();)
+        for (size_t j = 0; j < cell.size(); j += AABB_MASK_BITS) {
+            uint32_t mask = cell.collideMask(j, circleBB);
+            while (mask != 0) {
+                const size_t k = j + __builtin_ctz(mask);
+                mask &= mask - 1;
+                ASSERT(cell.index(k) < mObjects.size());
+                if (!cell.box(k).collideCircle(center, radius)) {
+                    continue;
+                }
+                if (!mLoose && !context.visit(cell.index(k))) {
+                    MGSP_STAT(++context.stats.dedupHits;)
+                    continue;
+                }
+                MGSP_STAT(++context.stats.hits;)
+                if (!visitor(mObjects[cell.index(k)])) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const AABB& aabb, Visitor&& visitor)
+{
+    const bool completed = visitAABB(aabb, mQueryContext, visitor);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+    return completed;
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const Vector2& point, Visitor&& visitor)
+{
+    const bool completed = visitPoint(point, mQueryContext, visitor);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+    return completed;
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const Vector2& center,
+                                                   float32 radius,
+                                                   Visitor&& visitor)
+{
+    const bool completed = visitCircle(center, radius, mQueryContext, visitor);
+    MGSP_STAT(recordQueryStats(mQueryContext.stats);)
+    return completed;
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const AABB& aabb,
+                                                   QueryContext& context,
+                                                   Visitor&& visitor) const
+{
+    return visitAABB(aabb, context, visitor);
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const Vector2& point,
+                                                   QueryContext& context,
+                                                   Visitor&& visitor) const
+{
+    return visitPoint(point, context, visitor);
+}
+
+template <typename IndexType>
+template <typename Visitor>
+inline bool
+MultiGridSpacePartitionT<IndexType>::forEachObject(const Vector2& center,
+                                                   float32 radius,
+                                                   QueryContext& context,
+                                                   Visitor&& visitor) const
+{
+    return visitCircle(center, radius, context, visitor);
+}
+
+template <typename IndexType>
+inline void
+MultiGridSpacePartitionT<IndexType>::setRefinementConfig(const RefinementConfig& config)
+{
+    ASSERT(config.mergeThreshold < config.splitThreshold);
+    mRefinementConfig = config;
+}
+
+template <typename IndexType>
+inline const typename MultiGridSpacePartitionT<IndexType>::RefinementConfig&
+MultiGridSpacePartitionT<IndexType>::refinementConfig(void) const
+{
+    return mRefinementConfig;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::isFrozen(void) const
+{
+    return mFrozen;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::isLooseMode(void) const
+{
+    return mLoose;
+}
+
+template <typename IndexType>
+inline float32
+MultiGridSpacePartitionT<IndexType>::spanningFraction(void) const
+{
+    return mSpanningFraction;
+}
+
+template <typename IndexType>
+inline bool
+MultiGridSpacePartitionT<IndexType>::isQueueingUpdates(void) const
+{
+    return mQueueingUpdates;
+}
+
+template <typename IndexType>
+inline const std::vector<IndexType>&
+MultiGridSpacePartitionT<IndexType>::getDirtyLeafCells(void) const
+{
+    return mDirtyLeafCells;
+}
+
+template <typename IndexType>
+inline MatrixPartition<IndexType>&
+MultiGridSpacePartitionT<IndexType>::getRootMatrix(void)
 {
     return mMatrixCells[0];
 }
-inline const MatrixPartition<uint16_t>&
-MultiGridSpacePartition::getRootMatrix(void) const
+template <typename IndexType>
+inline const MatrixPartition<IndexType>&
+MultiGridSpacePartitionT<IndexType>::getRootMatrix(void) const
 {
     return mMatrixCells[0];
 }
 
+#ifdef MGSP_STATS
+template <typename IndexType>
+inline const QueryStats&
+MultiGridSpacePartitionT<IndexType>::lastQueryStats(void) const
+{
+    return mLastQueryStats;
+}
+
+template <typename IndexType>
+inline const QueryStats&
+MultiGridSpacePartitionT<IndexType>::totalQueryStats(void) const
+{
+    return mTotalQueryStats;
+}
 
-#ifdef DEBUG
-// This method will return the size of this structure
-//
-inline unsigned int
-MultiGridSpacePartition::memSize(void) const
+template <typename IndexType>
+inline void
+MultiGridSpacePartitionT<IndexType>::resetQueryStats(void)
 {
-    ASSERT(false && "TODO: Calculate all the mem size used with the new members");
-    unsigned int objSize = 0;
-    for (unsigned int i = 0; i < mLeafCells.size(); ++i) {
-        objSize += sizeof(ObjectIndex) * mLeafCells[i].size();
-    }
-    return sizeof(this) +
-           sizeof(Cell) * mCells.size() +
-           sizeof(ObjectIndicesVec) * mLeafCells.size() +
-           sizeof(MatrixPartition<uint16_t>) * mMatrixCells.size() +
-           sizeof(Object*) * mObjects.size();
+    mLastQueryStats.reset();
+    mTotalQueryStats.reset();
+}
+
+template <typename IndexType>
+inline void
+MultiGridSpacePartitionT<IndexType>::recordQueryStats(const QueryStats& stats) const
+{
+    mLastQueryStats = stats;
+    mTotalQueryStats += stats;
 }
 #endif
 
 
+template <typename IndexType>
+inline size_t
+MultiGridSpacePartitionT<IndexType>::memSize(void) const
+{
+    StructureReport result;
+    report(result);
+    return result.total.reserved;
+}
+
+
 } /* namespace mgsp */
 #endif /* MULTIGRIDSPACEPARTITION_H_ */
@@ -30,11 +30,14 @@ namespace mgsp {
 
 // forward declaration
 //
-class MultiGridSpacePartition;
+template <typename IndexType>
+class MultiGridSpacePartitionT;
 
 // useful typedefs
+// The index of the object in the partition, the partition itself decides how
+// many bits it uses internally (see MultiGridSpacePartitionT).
 //
-typedef uint16_t ObjectIndex;
+typedef uint32_t ObjectIndex;
 
 // This class represent the basic object we will handle in our structure.
 // Basically we need only an AABB to be able to use the MultiGrid so you
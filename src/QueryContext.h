@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef QUERYCONTEXT_H_
+#define QUERYCONTEXT_H_
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "debug.h"
+#include "TypeDefs.h"
+#include "Object.h"
+#include "QueryStats.h"
+
+namespace mgsp {
+
+// The temporary buffers used by the queries. The const query methods of
+// MultiGridSpacePartitionT take a context, so any number of threads can query
+// the same structure at the same time (while nobody modifies it) as long as
+// each one uses its own context. A context can be reused between queries to
+// avoid allocating memory each time.
+//
+template <typename IndexType>
+class QueryContextT
+{
+public:
+    QueryContextT() : stamp(0) {}
+
+#ifdef MGSP_STATS
+    // @brief Return the counters of the last query run with this context
+    //        (only available when compiling with MGSP_STATS).
+    //
+    inline const QueryStats&
+    queryStats(void) const {return stats;}
+#endif
+
+private:
+    friend class MultiGridSpacePartitionT<IndexType>;
+
+    // A node of the nearest search: a leaf cell or a ring of cells (the
+    // cells at a given distance, in cells, from the cell containing the point)
+    // of a matrix, with the minimum squared distance to the point.
+    //
+    struct NearestNode {
+        float32 dist2;
+        IndexType index;    // leaf index or matrix index
+        uint16_t ring;      // NEAREST_LEAF for leaf cells
+        // we want a min heap
+        inline bool
+        operator<(const NearestNode& other) const {return dist2 > other.dist2;}
+    };
+
+    // a candidate of the nearest search (max heap)
+    typedef std::pair<float32, Object*> NearestCandidate;
+
+    // @brief Start a new query over a given number of objects
+    //
+    inline void
+    newQuery(size_t numObjects)
+    {
+        MGSP_STAT(stats.reset(); stats.queries = 1;)
+        if (stamps.size() < numObjects) {
+            stamps.resize(numObjects, 0);
+        }
+        if (++stamp == 0) {
+            // we did a full round, reset all of them
+            std::fill(stamps.begin(), stamps.end(), 0);
+            stamp = 1;
+        }
+    }
+
+    // @brief Mark an object as visited in the current query.
+    // @return true if it was not visited before | false otherwise
+    //
+    inline bool
+    visit(ObjectIndex index)
+    {
+        ASSERT(index < stamps.size());
+        if (stamps[index] == stamp) {
+            return false;
+        }
+        stamps[index] = stamp;
+        return true;
+    }
+
+private:
+    std::vector<IndexType> matrixIds;
+    std::vector<IndexType> cellIndices;
+    std::vector<IndexType> leafIndices;
+    // To avoid checking the same object several times (since it could be in
+    // several leaf cells) we save for each object the last query (stamp)
+    // that visited it, so we don't need to clear anything between queries.
+    std::vector<uint32_t> stamps;
+    uint32_t stamp;
+    std::vector<NearestNode> nodes;
+    std::vector<NearestCandidate> candidates;
+    // the hits of the spanning lists not reported yet by the raycast (sorted
+    // from the farthest one)
+    std::vector<std::pair<float32, Object*> > spanningHits;
+    // the counters of the current query (MGSP_STATS only)
+    QueryStats stats;
+};
+
+} /* namespace mgsp */
+#endif /* QUERYCONTEXT_H_ */
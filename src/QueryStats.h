@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef QUERYSTATS_H_
+#define QUERYSTATS_H_
+
+#include "TypeDefs.h"
+
+// The query statistics are only collected when compiling with MGSP_STATS
+// since they add work in the inner loops of the queries.
+//
+#ifdef MGSP_STATS
+#define MGSP_STAT(x)    x
+#else
+#define MGSP_STAT(x)
+#endif
+
+
+namespace mgsp {
+
+// The counters of a query (or the sum of several queries). They can be used
+// to know why a query is slow (too many matrices / leaf cells visited or too
+// many false positives) and tune the structure (CellStructInfo).
+//
+struct QueryStats {
+    // the number of queries counted
+    uint64_t queries;
+    // the matrices traversed to find the leaf cells
+    uint64_t matrices;
+    // the leaf cells visited
+    uint64_t leaves;
+    // the objects (AABBs) of the leaf cells tested against the query
+    uint64_t candidates;
+    // the objects that passed the test but were already found in another
+    // leaf cell of the same query
+    uint64_t dedupHits;
+    // the objects reported
+    uint64_t hits;
+
+    QueryStats() {reset();}
+
+    inline void
+    reset(void)
+    {
+        queries = matrices = leaves = candidates = dedupHits = hits = 0;
+    }
+
+    inline QueryStats&
+    operator+=(const QueryStats& other)
+    {
+        queries += other.queries;
+        matrices += other.matrices;
+        leaves += other.leaves;
+        candidates += other.candidates;
+        dedupHits += other.dedupHits;
+        hits += other.hits;
+        return *this;
+    }
+};
+
+} /* namespace mgsp */
+#endif /* QUERYSTATS_H_ */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+#include "debug.h"
+#include "TypeDefs.h"
+
+namespace mgsp {
+
+// Very simple thread pool used to split work between a fixed number of threads.
+// The thread calling parallelFor() will also do work (it is the thread 0), so
+// a pool of N threads creates only N-1 worker threads.
+// The work is split in chunks of "grain" elements that the threads take
+// dynamically, so the threads that finish first will take more work from the
+// ones that are still working.
+//
+class ThreadPool
+{
+public:
+    // The function that process the elements [begin, end) in the thread
+    // threadIndex (0 <= threadIndex < numThreads())
+    //
+    typedef std::function<void(size_t begin, size_t end, unsigned int threadIndex)> RangeTask;
+
+public:
+    // @brief Create the pool with a given number of threads (including the
+    //        calling one). If numThreads is 0 we will use the hardware
+    //        concurrency.
+    //
+    explicit ThreadPool(unsigned int numThreads = 0);
+    ~ThreadPool();
+
+    // @brief Return the number of threads that can run a task (including the
+    //        calling one).
+    //
+    inline unsigned int
+    numThreads(void) const;
+
+    // @brief Process count elements in parallel calling task for each chunk
+    //        of at most grain elements. This method will block until all the
+    //        elements are processed.
+    // @param count     The number of elements to process
+    // @param grain     The number of elements each chunk will have
+    // @param task      The task to run over each chunk
+    // @note This method is not reentrant, only one thread can call it at the
+    //       same time and it cannot be called from inside of a task.
+    //
+    inline void
+    parallelFor(size_t count, size_t grain, const RangeTask& task);
+
+private:
+    // avoid copying
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    // @brief The main loop of the worker threads
+    //
+    inline void
+    workerLoop(unsigned int threadIndex);
+
+    // @brief Take chunks of the current task until there are no more
+    //
+    inline void
+    runChunks(unsigned int threadIndex);
+
+private:
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mWakeUp;
+    std::condition_variable mDone;
+    // the current task information
+    const RangeTask* mTask;
+    size_t mCount;
+    size_t mGrain;
+    std::atomic<size_t> mNext;
+    unsigned int mGeneration;
+    unsigned int mRunning;
+    bool mStop;
+};
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline stuff
+//
+
+inline
+ThreadPool::ThreadPool(unsigned int numThreads) :
+    mTask(0)
+,   mCount(0)
+,   mGrain(1)
+,   mNext(0)
+,   mGeneration(0)
+,   mRunning(0)
+,   mStop(false)
+{
+    if (numThreads == 0) {
+        numThreads = std::thread::hardware_concurrency();
+        if (numThreads == 0) {
+            numThreads = 1;
+        }
+    }
+    mWorkers.reserve(numThreads - 1);
+    for (unsigned int i = 1; i < numThreads; ++i) {
+        mWorkers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+inline
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWakeUp.notify_all();
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        mWorkers[i].join();
+    }
+}
+
+inline unsigned int
+ThreadPool::numThreads(void) const
+{
+    return static_cast<unsigned int>(mWorkers.size()) + 1;
+}
+
+inline void
+ThreadPool::parallelFor(size_t count, size_t grain, const RangeTask& task)
+{
+    if (count == 0) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    // if we have only one thread or one chunk we do not need to wake up anyone
+    if (mWorkers.empty() || count <= grain) {
+        task(0, count, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ASSERT(mTask == 0 && "parallelFor is not reentrant");
+        mTask = &task;
+        mCount = count;
+        mGrain = grain;
+        mNext.store(0);
+        mRunning = static_cast<unsigned int>(mWorkers.size());
+        ++mGeneration;
+    }
+    mWakeUp.notify_all();
+
+    // we also work
+    runChunks(0);
+
+    // wait for the rest of the threads
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mRunning > 0) {
+        mDone.wait(lock);
+    }
+    mTask = 0;
+}
+
+inline void
+ThreadPool::workerLoop(unsigned int threadIndex)
+{
+    unsigned int lastGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStop && mGeneration == lastGeneration) {
+                mWakeUp.wait(lock);
+            }
+            if (mStop) {
+                return;
+            }
+            lastGeneration = mGeneration;
+        }
+
+        runChunks(threadIndex);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            --mRunning;
+        }
+        mDone.notify_one();
+    }
+}
+
+inline void
+ThreadPool::runChunks(unsigned int threadIndex)
+{
+    ASSERT(mTask != 0);
+    while (true) {
+        const size_t begin = mNext.fetch_add(mGrain);
+        if (begin >= mCount) {
+            return;
+        }
+        const size_t end = begin + mGrain < mCount ? begin + mGrain : mCount;
+        (*mTask)(begin, end, threadIndex);
+    }
+}
+
+} /* namespace mgsp */
+#endif /* THREADPOOL_H_ */
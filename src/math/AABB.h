@@ -26,6 +26,12 @@
 #include <iostream>
 #endif
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <TypeDefs.h>
 
 #include "Vec2.h"
@@ -65,6 +71,22 @@ struct AABB
         return p.x >= tl.x && p.x <= br.x && p.y >= br.y && p.y <= tl.y;
     }
 
+    // squared distance from a point to the box (0 if it is inside)
+    inline float32
+    squaredDistance(const Vector2 &p) const
+    {
+        const float32 dx = p.x < tl.x ? tl.x - p.x : (p.x > br.x ? p.x - br.x : 0.f);
+        const float32 dy = p.y < br.y ? br.y - p.y : (p.y > tl.y ? p.y - tl.y : 0.f);
+        return dx * dx + dy * dy;
+    }
+
+    // check if a circle intersects the box
+    inline bool
+    collideCircle(const Vector2 &center, float32 radius) const
+    {
+        return squaredDistance(center) <= radius * radius;
+    }
+
     // translate the bounding box
     inline void
     translate(const Vector2 &v)
@@ -108,6 +130,62 @@ struct AABB
             || (tl.y < o.br.y));
     }
 
+    // @brief Check if a ray (origin + dir * t) intersects the box for some t in
+    //        [tMin, tMax].
+    // @param origin    The origin of the ray
+    // @param dir       The direction of the ray
+    // @param tMin      The minimum t to check
+    // @param tMax      The maximum t to check
+    // @param tEnter    The first t where the ray is inside the box (if any)
+    // @return true if there is an intersection | false otherwise
+    //
+    inline bool
+    intersectRay(const Vector2& origin,
+                 const Vector2& dir,
+                 float32 tMin,
+                 float32 tMax,
+                 float32& tEnter) const
+    {
+        // x slab
+        if (dir.x == 0.f) {
+            if (origin.x < tl.x || origin.x > br.x) {
+                return false;
+            }
+        } else {
+            const float32 inv = 1.f / dir.x;
+            float32 t0 = (tl.x - origin.x) * inv;
+            float32 t1 = (br.x - origin.x) * inv;
+            if (t0 > t1) {
+                const float32 tmp = t0; t0 = t1; t1 = tmp;
+            }
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+            if (tMin > tMax) {
+                return false;
+            }
+        }
+        // y slab
+        if (dir.y == 0.f) {
+            if (origin.y < br.y || origin.y > tl.y) {
+                return false;
+            }
+        } else {
+            const float32 inv = 1.f / dir.y;
+            float32 t0 = (br.y - origin.y) * inv;
+            float32 t1 = (tl.y - origin.y) * inv;
+            if (t0 > t1) {
+                const float32 tmp = t0; t0 = t1; t1 = tmp;
+            }
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+            if (tMin > tMax) {
+                return false;
+            }
+        }
+        tEnter = tMin;
+        return true;
+    }
+
     // @brief Increase the size of the current bounding box to contain another
     // @param other     The other bounding box to be contained
     //
@@ -174,6 +252,70 @@ struct AABB
 
 typedef AABB AlignedBox;
 
+
+// The maximum number of boxes we can check at once with collideMask()
+//
+#define AABB_MASK_BITS  32
+
+// @brief Check an AABB against a list of boxes given in separated arrays
+//        (minX = tl.x, minY = br.y, maxX = br.x, maxY = tl.y). The result is
+//        the same than calling aabb.collide() for each of them but checking
+//        4 (SSE2) or 8 (AVX) boxes at once when the compiler supports it
+//        (selected at compile time, the scalar version is used otherwise).
+// @param aabb      The box we want to check
+// @param minX      The minX of each box (and the same for the rest)
+// @param count     The number of boxes to check (count <= AABB_MASK_BITS)
+// @return the mask of boxes colliding (bit i set if box i collides)
+//
+inline uint32_t
+collideMask(const AABB& aabb,
+            const float32* minX,
+            const float32* minY,
+            const float32* maxX,
+            const float32* maxY,
+            size_t count)
+{
+    uint32_t mask = 0;
+    size_t i = 0;
+
+#if defined(__AVX__)
+    const __m256 qMinX = _mm256_set1_ps(aabb.tl.x);
+    const __m256 qMinY = _mm256_set1_ps(aabb.br.y);
+    const __m256 qMaxX = _mm256_set1_ps(aabb.br.x);
+    const __m256 qMaxY = _mm256_set1_ps(aabb.tl.y);
+    for (; i + 8 <= count; i += 8) {
+        const __m256 c0 = _mm256_cmp_ps(_mm256_loadu_ps(maxX + i), qMinX, _CMP_GE_OQ);
+        const __m256 c1 = _mm256_cmp_ps(_mm256_loadu_ps(minX + i), qMaxX, _CMP_LE_OQ);
+        const __m256 c2 = _mm256_cmp_ps(_mm256_loadu_ps(maxY + i), qMinY, _CMP_GE_OQ);
+        const __m256 c3 = _mm256_cmp_ps(_mm256_loadu_ps(minY + i), qMaxY, _CMP_LE_OQ);
+        const __m256 all = _mm256_and_ps(_mm256_and_ps(c0, c1), _mm256_and_ps(c2, c3));
+        mask |= static_cast<uint32_t>(_mm256_movemask_ps(all)) << i;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 qMinX4 = _mm_set1_ps(aabb.tl.x);
+    const __m128 qMinY4 = _mm_set1_ps(aabb.br.y);
+    const __m128 qMaxX4 = _mm_set1_ps(aabb.br.x);
+    const __m128 qMaxY4 = _mm_set1_ps(aabb.tl.y);
+    for (; i + 4 <= count; i += 4) {
+        const __m128 c0 = _mm_cmpge_ps(_mm_loadu_ps(maxX + i), qMinX4);
+        const __m128 c1 = _mm_cmple_ps(_mm_loadu_ps(minX + i), qMaxX4);
+        const __m128 c2 = _mm_cmpge_ps(_mm_loadu_ps(maxY + i), qMinY4);
+        const __m128 c3 = _mm_cmple_ps(_mm_loadu_ps(minY + i), qMaxY4);
+        const __m128 all = _mm_and_ps(_mm_and_ps(c0, c1), _mm_and_ps(c2, c3));
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(all)) << i;
+    }
+#endif
+
+    // the rest (or all of them if we have no SIMD support)
+    for (; i < count; ++i) {
+        const bool collide = maxX[i] >= aabb.tl.x && minX[i] <= aabb.br.x &&
+                             maxY[i] >= aabb.br.y && minY[i] <= aabb.tl.y;
+        mask |= static_cast<uint32_t>(collide) << i;
+    }
+    return mask;
+}
+
 }
 
 #endif /* AABB_H_ */
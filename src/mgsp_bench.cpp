@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2014 agudpp
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ */
+
+// Benchmark of the MultiGridSpacePartition. For each workload (distribution
+// of the objects) and grid layout we measure the build time and the latency
+// of each insert / update / remove / point query / AABB query, and we print
+// one JSON object per line with the throughput and the p50 / p99 / p999
+// latencies so the results can be compared between versions.
+//
+// Usage: mgsp_bench [numObjects] [seed]
+//
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+#include <math/AABB.h>
+#include <math/Vec2.h>
+#include <MultiGridSpacePartition.h>
+#include <CellStructBuilder.h>
+#include <TypeDefs.h>
+#include <Object.h>
+
+
+using namespace mgsp;
+
+typedef std::chrono::steady_clock Clock;
+typedef std::vector<Object> OV;
+typedef std::uniform_real_distribution<float32> RandDist;
+
+namespace {
+
+const AABB WORLD(2000.f, -2000.f, -2000.f, 2000.f);
+const unsigned int NUM_QUERIES = 20000;
+const unsigned int NUM_FRAMES = 5;
+
+// The latencies of one operation
+//
+struct Samples {
+    std::vector<double> ns;
+    double totalNs;
+
+    Samples() : totalNs(0) {}
+};
+
+// Run f() and return the elapsed nanoseconds
+//
+template <typename Func>
+inline double
+measure(Func&& f)
+{
+    const Clock::time_point begin = Clock::now();
+    f();
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+}
+
+template <typename Func>
+inline void
+sample(Samples& samples, Func&& f)
+{
+    const double ns = measure(f);
+    samples.ns.push_back(ns);
+    samples.totalNs += ns;
+}
+
+inline double
+percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.;
+    }
+    const size_t index = static_cast<size_t>(p * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Print the results of one operation as a JSON line
+//
+void
+report(const char* workload, const char* layout, const char* op, Samples& samples)
+{
+    std::sort(samples.ns.begin(), samples.ns.end());
+    const double seconds = samples.totalNs * 1e-9;
+    std::printf("{\"workload\":\"%s\",\"layout\":\"%s\",\"op\":\"%s\","
+                "\"count\":%zu,\"total_ms\":%.3f,\"ops_per_sec\":%.1f,"
+                "\"p50_ns\":%.1f,\"p99_ns\":%.1f,\"p999_ns\":%.1f}\n",
+                workload, layout, op, samples.ns.size(), samples.totalNs * 1e-6,
+                seconds > 0. ? samples.ns.size() / seconds : 0.,
+                percentile(samples.ns, 0.5), percentile(samples.ns, 0.99),
+                percentile(samples.ns, 0.999));
+}
+
+// Clamp an AABB inside of the world (keeping its size)
+//
+inline AABB
+clampToWorld(const AABB& aabb)
+{
+    Vector2 move(0.f, 0.f);
+    if (aabb.tl.x < WORLD.tl.x) move.x = WORLD.tl.x - aabb.tl.x;
+    if (aabb.br.x > WORLD.br.x) move.x = WORLD.br.x - aabb.br.x;
+    if (aabb.br.y < WORLD.br.y) move.y = WORLD.br.y - aabb.br.y;
+    if (aabb.tl.y > WORLD.tl.y) move.y = WORLD.tl.y - aabb.tl.y;
+    AABB result = aabb;
+    result.translate(move);
+    return result;
+}
+
+inline AABB
+boxAt(const Vector2& center, float32 halfWidth, float32 halfHeight)
+{
+    return clampToWorld(AABB(center.y + halfHeight, center.x - halfWidth,
+                             center.y - halfHeight, center.x + halfWidth));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Workloads
+
+// The objects and which ones move each frame
+//
+struct Workload {
+    const char* name;
+    OV objects;
+    std::vector<unsigned int> movers;
+    float32 maxStep;
+};
+
+void
+createUniform(std::default_random_engine& gen, unsigned int count, Workload& w)
+{
+    RandDist pos(WORLD.tl.x, WORLD.br.x);
+    RandDist size(1.f, 5.f);
+    w.name = "uniform";
+    w.objects.resize(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        w.objects[i]._mgsp_aabb = boxAt(Vector2(pos(gen), pos(gen)), size(gen), size(gen));
+        w.movers.push_back(i);
+    }
+    w.maxStep = 10.f;
+}
+
+void
+createClustered(std::default_random_engine& gen, unsigned int count, Workload& w)
+{
+    RandDist pos(WORLD.tl.x * 0.8f, WORLD.br.x * 0.8f);
+    RandDist size(1.f, 5.f);
+    std::normal_distribution<float32> spread(0.f, 80.f);
+    std::vector<Vector2> centers;
+    for (unsigned int i = 0; i < 8; ++i) centers.push_back(Vector2(pos(gen), pos(gen)));
+    w.name = "clustered";
+    w.objects.resize(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        const Vector2& c = centers[i % centers.size()];
+        w.objects[i]._mgsp_aabb = boxAt(Vector2(c.x + spread(gen), c.y + spread(gen)),
+                                        size(gen), size(gen));
+        w.movers.push_back(i);
+    }
+    w.maxStep = 10.f;
+}
+
+void
+createLargeObjects(std::default_random_engine& gen, unsigned int count, Workload& w)
+{
+    RandDist pos(WORLD.tl.x, WORLD.br.x);
+    RandDist size(1.f, 5.f);
+    RandDist largeSize(50.f, 250.f);
+    w.name = "large_objects";
+    w.objects.resize(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        // one of each five objects is big
+        const bool large = i % 5 == 0;
+        w.objects[i]._mgsp_aabb = boxAt(Vector2(pos(gen), pos(gen)),
+            large ? largeSize(gen) : size(gen), large ? largeSize(gen) : size(gen));
+        w.movers.push_back(i);
+    }
+    w.maxStep = 10.f;
+}
+
+void
+createMostlyStatic(std::default_random_engine& gen, unsigned int count, Workload& w)
+{
+    createUniform(gen, count, w);
+    w.name = "mostly_static";
+    // only one of each twenty objects moves
+    w.movers.clear();
+    for (unsigned int i = 0; i < count; i += 20) w.movers.push_back(i);
+    w.maxStep = 20.f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Layouts
+
+struct Layout {
+    std::string name;
+    CellStructInfo info;
+};
+
+void
+createLayouts(const Workload& w, std::vector<Layout>& layouts)
+{
+    layouts.clear();
+    layouts.resize(4);
+
+    // one level: 64 x 64
+    layouts[0].name = "1-level";
+    layouts[0].info.createSubDivisions(64, 64);
+
+    // two levels: 16 x 16 with 4 x 4 each
+    layouts[1].name = "2-level";
+    layouts[1].info.createSubDivisions(16, 16);
+    for (uint8_t r = 0; r < 16; ++r) {
+        for (uint8_t c = 0; c < 16; ++c) {
+            layouts[1].info.getSubCell(r, c).createSubDivisions(4, 4);
+        }
+    }
+
+    // three levels: 8 x 8, 4 x 4 and 2 x 2
+    layouts[2].name = "3-level";
+    layouts[2].info.createSubDivisions(8, 8);
+    for (uint8_t r = 0; r < 8; ++r) {
+        for (uint8_t c = 0; c < 8; ++c) {
+            CellStructInfo& sub = layouts[2].info.getSubCell(r, c);
+            sub.createSubDivisions(4, 4);
+            for (uint8_t sr = 0; sr < 4; ++sr) {
+                for (uint8_t sc = 0; sc < 4; ++sc) {
+                    sub.getSubCell(sr, sc).createSubDivisions(2, 2);
+                }
+            }
+        }
+    }
+
+    // generated from the objects
+    layouts[3].name = "builder";
+    std::vector<AABB> boxes;
+    for (size_t i = 0; i < w.objects.size(); ++i) boxes.push_back(w.objects[i]._mgsp_aabb);
+    CellStructBuilder builder;
+    if (!builder.build(WORLD, boxes, layouts[3].info)) {
+        layouts.pop_back();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The benchmark itself
+
+void
+run(std::default_random_engine& gen, Workload& w, const Layout& layout)
+{
+    const char* wname = w.name;
+    const char* lname = layout.name.c_str();
+    MultiGridSpacePartition mgsp;
+
+    Samples build;
+    bool built = false;
+    sample(build, [&]() {built = mgsp.build(WORLD, layout.info);});
+    if (!built) {
+        std::fprintf(stderr, "Error building the layout %s\n", lname);
+        return;
+    }
+    report(wname, lname, "build", build);
+
+    Samples insert;
+    for (size_t i = 0; i < w.objects.size(); ++i) {
+        Object* object = &w.objects[i];
+        sample(insert, [&]() {mgsp.insert(object);});
+    }
+    report(wname, lname, "insert", insert);
+
+    // move the objects some frames
+    Samples update;
+    RandDist step(-w.maxStep, w.maxStep);
+    for (unsigned int frame = 0; frame < NUM_FRAMES; ++frame) {
+        for (size_t i = 0; i < w.movers.size(); ++i) {
+            Object* object = &w.objects[w.movers[i]];
+            AABB aabb = object->_mgsp_aabb;
+            aabb.translate(Vector2(step(gen), step(gen)));
+            aabb = clampToWorld(aabb);
+            sample(update, [&]() {mgsp.update(object, aabb);});
+        }
+    }
+    report(wname, lname, "update", update);
+
+    // queries
+    RandDist pos(WORLD.tl.x, WORLD.br.x);
+    RandDist querySize(25.f, 100.f);
+    ObjectPtrVec result;
+    size_t found = 0;
+    Samples pointQuery;
+    for (unsigned int i = 0; i < NUM_QUERIES; ++i) {
+        const Vector2 point(pos(gen), pos(gen));
+        sample(pointQuery, [&]() {mgsp.getObjects(point, result);});
+        found += result.size();
+    }
+    report(wname, lname, "point_query", pointQuery);
+
+    Samples aabbQuery;
+    for (unsigned int i = 0; i < NUM_QUERIES; ++i) {
+        const AABB query = boxAt(Vector2(pos(gen), pos(gen)), querySize(gen), querySize(gen));
+        sample(aabbQuery, [&]() {mgsp.getObjects(query, result);});
+        found += result.size();
+    }
+    report(wname, lname, "aabb_query", aabbQuery);
+
+    Samples remove;
+    for (size_t i = 0; i < w.objects.size(); ++i) {
+        Object* object = &w.objects[i];
+        sample(remove, [&]() {mgsp.remove(object);});
+    }
+    report(wname, lname, "remove", remove);
+
+    // avoid the compiler removing the queries
+    if (found == size_t(-1)) {
+        std::fprintf(stderr, "%zu\n", found);
+    }
+}
+
+}
+
+int
+main(int argc, char** argv)
+{
+    const unsigned int numObjects = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const unsigned int seed = argc > 2 ? std::atoi(argv[2]) : 12345;
+    if (numObjects == 0 || numObjects > 0xFFFF) {
+        std::fprintf(stderr, "The number of objects should be in [1, 65535]\n");
+        return 1;
+    }
+
+    std::default_random_engine gen(seed);
+    typedef void (*CreateWorkload)(std::default_random_engine&, unsigned int, Workload&);
+    const CreateWorkload workloads[] = {createUniform, createClustered,
+                                        createLargeObjects, createMostlyStatic};
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        Workload workload;
+        workloads[i](gen, numObjects, workload);
+        std::vector<Layout> layouts;
+        createLayouts(workload, layouts);
+        for (size_t j = 0; j < layouts.size(); ++j) {
+            // each layout starts from the same positions
+            Workload copy = workload;
+            run(gen, copy, layouts[j]);
+        }
+    }
+    return 0;
+}
@@ -26,6 +26,10 @@
 #include <chrono>
 #include <random>
 #include <unordered_set>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
 
 #include <UnitTest++/UnitTest++.h>
 
@@ -33,6 +37,9 @@
 #include <math/AABB.h>
 #include <math/Vec2.h>
 #include <MultiGridSpacePartition.h>
+#include <CellStructBuilder.h>
+#include <LeafCell.h>
+#include <ThreadPool.h>
 #include <TypeDefs.h>
 #include <Object.h>
 
@@ -72,6 +79,19 @@ createCObjects(const AABB& world, const AABB& size, unsigned int count, OV& objs
     }
 }
 
+// Create a list of Objects of an specific size placed inside of a bb (the
+// ones of createCObjects() start at the origin instead of at the bb corner)
+//
+static void
+createWorldObjects(const AABB& world, const AABB& size, unsigned int count, OV& objs)
+{
+    createCObjects(world, size, count, objs);
+    const Vector2 corner(world.tl.x, world.br.y);
+    for (Object& o : objs) {
+        o._mgsp_aabb.translate(corner);
+    }
+}
+
 // Get the list of collisions from an object and the list of all objects
 //
 static void
@@ -109,6 +129,120 @@ getCollList(OV& objs, unsigned int index, OPHS& result)
     }\
 }\
 
+TEST(LeafCellLayout)
+{
+    LeafBlockPool pool;
+    LeafCell<ObjectIndex> cell;
+    cell.push_back(3, AABB(10, 0, 0, 10), pool);
+    cell.push_back(7, AABB(30, 20, 20, 30), pool);
+    CHECK_EQUAL(true, cell.isInline());
+    CHECK_EQUAL(0, pool.usedBytes());
+    cell.push_back(9, AABB(50, 40, 40, 50), pool);
+    CHECK_EQUAL(false, cell.isInline());
+    CHECK(pool.usedBytes() > 0);
+    CHECK_EQUAL(3, cell.size());
+    CHECK(cell.collide(1, AABB(25, 25, 22, 28)));
+    CHECK(!cell.collide(0, AABB(25, 25, 22, 28)));
+    CHECK(cell.checkPointInside(2, Vector2(45, 45)));
+
+    // remove the first one, the last one should take its place
+    CHECK_EQUAL(true, cell.remove(3, pool));
+    CHECK_EQUAL(false, cell.remove(3, pool));
+    CHECK_EQUAL(2, cell.size());
+    CHECK_EQUAL(9, cell.index(0));
+    CHECK_EQUAL(40.f, cell.minX()[0]);
+    CHECK_EQUAL(40.f, cell.minY()[0]);
+    CHECK_EQUAL(50.f, cell.maxX()[0]);
+    CHECK_EQUAL(50.f, cell.maxY()[0]);
+
+    // update the box of one of them
+    CHECK_EQUAL(true, cell.updateBox(7, AABB(5, -5, -5, 5)));
+    CHECK_EQUAL(false, cell.updateBox(3, AABB(5, -5, -5, 5)));
+    CHECK(cell.checkPointInside(1, Vector2(0, 0)));
+    CHECK(!cell.checkPointInside(1, Vector2(25, 25)));
+
+    // grow a lot (moving between blocks) and move the cell
+    for (unsigned int i = 0; i < 100; ++i) {
+        cell.push_back(100 + i, AABB(i + 1, i, i, i + 1), pool);
+    }
+    LeafCell<ObjectIndex> moved(std::move(cell));
+    CHECK_EQUAL(0, cell.size());
+    CHECK_EQUAL(102, moved.size());
+    CHECK_EQUAL(9, moved.index(0));
+    CHECK_EQUAL(7, moved.index(1));
+    for (unsigned int i = 0; i < 100; ++i) {
+        CHECK_EQUAL(100 + i, moved.index(2 + i));
+        CHECK(moved.checkPointInside(2 + i, Vector2(i + 0.5f, i + 0.5f)));
+    }
+
+    // removing objects moves them to smaller blocks and back to the inline
+    // storage
+    for (unsigned int i = 0; i < 90; ++i) {
+        CHECK_EQUAL(true, moved.remove(100 + i, pool));
+    }
+    CHECK_EQUAL(12, moved.size());
+    CHECK(moved.reservedBytes() <= 32 * LeafCell<ObjectIndex>::ENTRY_BYTES);
+    CHECK_EQUAL(moved.reservedBytes(), pool.usedBytes());
+    for (unsigned int i = 90; i < 100; ++i) {
+        CHECK_EQUAL(true, moved.remove(100 + i, pool));
+    }
+    CHECK_EQUAL(true, moved.isInline());
+    CHECK_EQUAL(0, pool.usedBytes());
+    CHECK_EQUAL(9, moved.index(0));
+    CHECK_EQUAL(7, moved.index(1));
+    CHECK(moved.checkPointInside(1, Vector2(0, 0)));
+    for (unsigned int i = 0; i < 100; ++i) {
+        moved.push_back(100 + i, AABB(i + 1, i, i, i + 1), pool);
+    }
+
+    // the released blocks are reused
+    const size_t reserved = pool.reservedBytes();
+    moved.release(pool);
+    CHECK_EQUAL(true, moved.isInline());
+    CHECK_EQUAL(0, pool.usedBytes());
+    for (unsigned int i = 0; i < 100; ++i) {
+        moved.push_back(i, AABB(i + 1, i, i, i + 1), pool);
+    }
+    CHECK_EQUAL(reserved, pool.reservedBytes());
+    moved.release(pool);
+    CHECK_EQUAL(true, pool.releaseIfUnused());
+    CHECK_EQUAL(0, pool.reservedBytes());
+}
+
+TEST(AABBCollideMask)
+{
+    AABB world(100, -100, -100, 100);
+    OV boxes;
+    createWorldObjects(world, AABB(20, -20, -20, 20), 37, boxes);
+    std::vector<float32> minX, minY, maxX, maxY;
+    for (Object& o : boxes) {
+        minX.push_back(o._mgsp_aabb.tl.x);
+        minY.push_back(o._mgsp_aabb.br.y);
+        maxX.push_back(o._mgsp_aabb.br.x);
+        maxY.push_back(o._mgsp_aabb.tl.y);
+    }
+
+    OV queries;
+    createWorldObjects(world, AABB(10, -15, -10, 15), 50, queries);
+    // touching boxes should collide too
+    queries[0]._mgsp_aabb = AABB(boxes[5]._mgsp_aabb.br.y, boxes[5]._mgsp_aabb.br.x,
+                                 boxes[5]._mgsp_aabb.br.y - 1, boxes[5]._mgsp_aabb.br.x + 1);
+    for (Object& q : queries) {
+        // check all the possible sizes and offsets
+        for (unsigned int begin = 0; begin < 5; ++begin) {
+            const unsigned int count = std::min<unsigned int>(AABB_MASK_BITS,
+                                                              boxes.size() - begin);
+            const uint32_t mask = collideMask(q._mgsp_aabb, &minX[begin], &minY[begin],
+                                              &maxX[begin], &maxY[begin], count);
+            for (unsigned int i = 0; i < count; ++i) {
+                CHECK_EQUAL(q._mgsp_aabb.collide(boxes[begin + i]._mgsp_aabb),
+                            ((mask >> i) & 1) == 1);
+            }
+            CHECK_EQUAL(0, count < 32 ? mask >> count : 0);
+        }
+    }
+}
+
 TEST(BasicOperations)
 {
     MGSP mgsp;
@@ -302,6 +436,1408 @@ TEST(TestTwoLevelStressColl)
     CHECK_EQUAL(objs.size(), queryResult.size());
 }
 
+TEST(ExportImportStructure)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    const char* filename = "mgsp_test_structure.bin";
+
+    // create a two level structure
+    binfo.createSubDivisions(8, 6);
+    for (uint8_t row = 0; row < 6; ++row) {
+        for (uint8_t col = 0; col < 8; ++col) {
+            if ((row + col) % 3 == 0) {
+                binfo.getSubCell(row, col).createSubDivisions(col + 2, row + 2);
+            }
+        }
+    }
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+    CHECK_EQUAL(true, mgsp.exportStructure(filename));
+
+    // load it in a new one and check that both behave the same way
+    MGSP loaded;
+    CHECK_EQUAL(true, loaded.importStructure(filename));
+    std::remove(filename);
+    CHECK(loaded.getRootMatrix().boundingBox() == world);
+
+    OV objs;
+    createWorldObjects(world, AABB(10, -10, -10, 10), 500, objs);
+    for (Object& o : objs) loaded.insert(&o);
+    ARE_COLL_CORRECT(loaded, objs);
+
+    // update them and check again
+    for (unsigned int i = 0; i < objs.size(); ++i) {
+        AABB npos = objs[i]._mgsp_aabb;
+        npos.translate(Vector2(i % 2 ? 4.f : -4.f, i % 3 ? 3.f : -3.f));
+        loaded.update(&(objs[i]), npos);
+    }
+    ARE_COLL_CORRECT(loaded, objs);
+
+    // invalid files should fail
+    MGSP invalid;
+    CHECK_EQUAL(false, invalid.importStructure("mgsp_not_existent_file.bin"));
+    FILE* file = std::fopen(filename, "wb");
+    std::fputs("MGSP is not a valid structure", file);
+    std::fclose(file);
+    CHECK_EQUAL(false, invalid.importStructure(filename));
+    std::remove(filename);
+
+    // a header whose section sizes wrap around (numMatrices and
+    // matricesOffset are the 2nd and 5th uint64 after the 40 bytes of the
+    // magic, the type sizes and the world)
+    const long numMatricesPos = 40 + 8;
+    const long matricesOffsetPos = 40 + 4 * 8;
+    const uint64_t badValues[2][2] = {
+        {numMatricesPos, (uint64_t(1) << 62) + 1},
+        {matricesOffsetPos, ~uint64_t(15)}
+    };
+    for (unsigned int i = 0; i < 2; ++i) {
+        CHECK_EQUAL(true, mgsp.exportStructure(filename));
+        file = std::fopen(filename, "r+b");
+        std::fseek(file, static_cast<long>(badValues[i][0]), SEEK_SET);
+        std::fwrite(&badValues[i][1], sizeof(uint64_t), 1, file);
+        std::fclose(file);
+        CHECK_EQUAL(false, invalid.importStructure(filename));
+        std::remove(filename);
+    }
+
+    // the padding of the structures is not written, so exporting the same
+    // structure gives the same file whatever the heap contained before
+    const char* otherFilename = "mgsp_test_structure_2.bin";
+    // (we fill freed memory of the size of the matrices with different values
+    // before building each one)
+    StructureReport report;
+    mgsp.report(report);
+    auto buildOverGarbage = [&](MGSP& target, char value) {
+        const size_t bytes = sizeof(MatrixPartition<uint16_t>) * report.numMatrices;
+        std::vector<std::vector<char> > garbage;
+        for (unsigned int i = 0; i < 8; ++i) {
+            garbage.push_back(std::vector<char>(bytes, value));
+        }
+        garbage.clear();
+        return target.build(world, binfo);
+    };
+    MGSP first, second;
+    CHECK_EQUAL(true, buildOverGarbage(first, char(0xAA)));
+    CHECK_EQUAL(true, buildOverGarbage(second, char(0x55)));
+    CHECK_EQUAL(true, first.exportStructure(filename));
+    CHECK_EQUAL(true, second.exportStructure(otherFilename));
+    std::ifstream firstFile(filename, std::ios::binary);
+    std::ifstream secondFile(otherFilename, std::ios::binary);
+    const std::string firstBytes((std::istreambuf_iterator<char>(firstFile)),
+                                 std::istreambuf_iterator<char>());
+    const std::string secondBytes((std::istreambuf_iterator<char>(secondFile)),
+                                  std::istreambuf_iterator<char>());
+    CHECK(!firstBytes.empty() && firstBytes == secondBytes);
+    std::remove(filename);
+    std::remove(otherFilename);
+}
+
+TEST(InsertBulk)
+{
+    AABB world(500,-500,-500, 500);
+    CSInfo binfo;
+    binfo.createSubDivisions(16, 16);
+    for (uint8_t row = 0; row < 16; row += 3) {
+        binfo.getSubCell(row, row).createSubDivisions(4, 4);
+    }
+
+    OV objs;
+    createWorldObjects(world, AABB(15, -15, -15, 15), 2000, objs);
+    std::vector<Object*> ptrs;
+    for (Object& o : objs) ptrs.push_back(&o);
+
+    // single thread, inserting some of them twice
+    MGSP mgsp;
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+    mgsp.insert(ptrs[10]);
+    mgsp.insertBulk(ptrs.data(), ptrs.size());
+    mgsp.insertBulk(ptrs.data(), 100);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // multi thread
+    ThreadPool pool(4);
+    CHECK_EQUAL(4, pool.numThreads());
+    MGSP mgspMT;
+    CHECK_EQUAL(true, mgspMT.build(world, binfo));
+    mgspMT.insertBulk(ptrs.data(), ptrs.size(), &pool);
+    ARE_COLL_CORRECT(mgspMT, objs);
+
+    // removing and adding again should reuse the indices
+    for (unsigned int i = 0; i < 500; ++i) mgspMT.remove(ptrs[i]);
+    mgspMT.insertBulk(ptrs.data(), 500, &pool);
+    ARE_COLL_CORRECT(mgspMT, objs);
+}
+
+TEST(DeferredUpdates)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(20, 20);
+    binfo.getSubCell(10, 10).createSubDivisions(5, 5);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(10, -10, -10, 10), 1000, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    // move each object several times, only the last one should be applied
+    OV moved;
+    createWorldObjects(world, AABB(10, -10, -10, 10), objs.size(), moved);
+    mgsp.beginUpdates();
+    CHECK_EQUAL(true, mgsp.isQueueingUpdates());
+    for (unsigned int i = 0; i < objs.size(); ++i) {
+        mgsp.queueUpdate(&objs[i], moved[(i + 1) % moved.size()]._mgsp_aabb);
+        mgsp.queueUpdate(&objs[i], moved[i]._mgsp_aabb);
+    }
+
+    // nothing should change until we commit
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // remove one of the objects while it is queued
+    mgsp.remove(&objs.back());
+    mgsp.commit();
+    CHECK_EQUAL(false, mgsp.isQueueingUpdates());
+    CHECK(!mgsp.getDirtyLeafCells().empty());
+
+    objs.pop_back();
+    for (unsigned int i = 0; i < objs.size(); ++i) {
+        CHECK(objs[i]._mgsp_aabb == moved[i]._mgsp_aabb);
+    }
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // without beginUpdates() the update is applied directly
+    mgsp.queueUpdate(&objs[0], moved.back()._mgsp_aabb);
+    CHECK(objs[0]._mgsp_aabb == moved.back()._mgsp_aabb);
+    ARE_COLL_CORRECT(mgsp, objs);
+}
+
+// Check that the pairs are all the colliding ones and only once each
+//
+static void
+checkPairs(OV& objs, const PairSink& pairs)
+{
+    std::set<std::pair<Object*, Object*> > expected;
+    for (unsigned int i = 0; i < objs.size(); ++i) {
+        for (unsigned int j = i + 1; j < objs.size(); ++j) {
+            if (objs[i]._mgsp_aabb.collide(objs[j]._mgsp_aabb)) {
+                expected.insert(std::make_pair(&objs[i], &objs[j]));
+            }
+        }
+    }
+    CHECK_EQUAL(pairs.first.size(), pairs.second.size());
+    CHECK_EQUAL(expected.size(), pairs.size());
+    std::set<std::pair<Object*, Object*> > found;
+    for (unsigned int i = 0; i < pairs.size(); ++i) {
+        Object* a = std::min(pairs.first[i], pairs.second[i]);
+        Object* b = std::max(pairs.first[i], pairs.second[i]);
+        CHECK(found.insert(std::make_pair(a, b)).second);
+        CHECK(expected.find(std::make_pair(a, b)) != expected.end());
+    }
+}
+
+TEST(AllOverlappingPairs)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(12, 10);
+    for (uint8_t row = 0; row < 10; ++row) {
+        binfo.getSubCell(row, row).createSubDivisions(3, 5);
+    }
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(40, -30, -40, 30), 800, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    PairSink pairs;
+    mgsp.getAllOverlappingPairs(pairs);
+    checkPairs(objs, pairs);
+
+    ThreadPool pool(3);
+    mgsp.getAllOverlappingPairs(pairs, &pool);
+    checkPairs(objs, pairs);
+}
+
+TEST(BatchQueries)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(16, 16);
+    binfo.getSubCell(3, 7).createSubDivisions(4, 6);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(10, -10, -10, 10), 1000, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+    OV queries;
+    createWorldObjects(world, AABB(50, -30, -50, 30), 3000, queries);
+    std::vector<AABB> boxes;
+    for (Object& q : queries) boxes.push_back(q._mgsp_aabb);
+
+    ThreadPool pool(4);
+    ResultSink results;
+    for (unsigned int run = 0; run < 2; ++run) {
+        mgsp.getObjectsBatch(boxes.data(), boxes.size(), results, run ? &pool : 0);
+        CHECK_EQUAL(boxes.size(), results.numQueries());
+        OPV single;
+        for (unsigned int i = 0; i < boxes.size(); ++i) {
+            mgsp.getObjects(boxes[i], single);
+            CHECK_EQUAL(single.size(), results.numObjects(i));
+            std::set<Object*> expected(single.begin(), single.end());
+            for (unsigned int j = 0; j < results.numObjects(i); ++j) {
+                CHECK(expected.count(results.queryObjects(i)[j]) == 1);
+            }
+        }
+    }
+
+    // several threads running batches at the same time with their contexts
+    const MGSP& reader = mgsp;
+    mgsp.getObjectsBatch(boxes.data(), boxes.size(), results);
+    ResultSink threadResults[2];
+    std::vector<MGSP::QueryContext> contexts[2];
+    std::thread readers[2];
+    for (unsigned int t = 0; t < 2; ++t) {
+        readers[t] = std::thread([&, t]() {
+            for (unsigned int run = 0; run < 4; ++run) {
+                reader.getObjectsBatch(boxes.data(), boxes.size(),
+                                       threadResults[t], contexts[t]);
+            }
+        });
+    }
+    for (unsigned int t = 0; t < 2; ++t) {
+        readers[t].join();
+        CHECK(threadResults[t].offsets == results.offsets);
+        CHECK(threadResults[t].objects == results.objects);
+    }
+}
+
+TEST(VisitorQueries)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(10, 10);
+    binfo.getSubCell(5, 5).createSubDivisions(4, 4);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(30, -30, -30, 30), 500, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    // the visitor should see the same objects than getObjects()
+    OPV queryResult;
+    const AABB query(100, -120, -80, 60);
+    mgsp.getObjects(query, queryResult);
+    std::set<Object*> visited;
+    CHECK_EQUAL(true, mgsp.forEachObject(query, [&visited](Object* o) {
+        CHECK(visited.insert(o).second);
+        return true;
+    }));
+    CHECK_EQUAL(queryResult.size(), visited.size());
+    for (Object* o : queryResult) CHECK(visited.count(o) == 1);
+
+    // stopping the query
+    if (!queryResult.empty()) {
+        unsigned int count = 0;
+        CHECK_EQUAL(false, mgsp.forEachObject(query, [&count](Object*) {
+            ++count;
+            return false;
+        }));
+        CHECK_EQUAL(1, count);
+    }
+
+    // points
+    const Vector2 point(objs[0]._mgsp_aabb.tl.x + 1.f, objs[0]._mgsp_aabb.br.y + 1.f);
+    mgsp.getObjects(point, queryResult);
+    visited.clear();
+    mgsp.forEachObject(point, [&visited](Object* o) {
+        visited.insert(o);
+        return true;
+    });
+    CHECK(visited.count(&objs[0]) == 1);
+    CHECK_EQUAL(queryResult.size(), visited.size());
+}
+
+TEST(UpdateThreeLevels)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(6, 6);
+    for (uint8_t row = 0; row < 6; ++row) {
+        for (uint8_t col = 0; col < 6; ++col) {
+            if ((row + col) % 2 == 0) {
+                CSInfo& sub = binfo.getSubCell(row, col);
+                sub.createSubDivisions(3, 4);
+                sub.getSubCell(1, 1).createSubDivisions(5, 2);
+            }
+        }
+    }
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // objects of different sizes, some of them covering several matrices
+    OV objs, small, big;
+    createWorldObjects(world, AABB(5, -5, -5, 5), 300, small);
+    createWorldObjects(world, AABB(200, -150, -200, 150), 50, big);
+    objs.insert(objs.end(), small.begin(), small.end());
+    objs.insert(objs.end(), big.begin(), big.end());
+    for (Object& o : objs) mgsp.insert(&o);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // small moves and jumps mixed
+    OV targets;
+    createWorldObjects(world, AABB(60, -40, -60, 40), objs.size(), targets);
+    for (unsigned int round = 0; round < 3; ++round) {
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            AABB npos = objs[i]._mgsp_aabb;
+            if ((i + round) % 3 == 0) {
+                npos = targets[(i + round) % targets.size()]._mgsp_aabb;
+            } else {
+                npos.translate(Vector2(round % 2 ? 3.f : -3.f, i % 2 ? 2.f : -2.f));
+            }
+            mgsp.update(&objs[i], npos);
+        }
+        ARE_COLL_CORRECT(mgsp, objs);
+    }
+
+    // removing all of them should leave the structure empty
+    for (Object& o : objs) mgsp.remove(&o);
+    OPV queryResult;
+    mgsp.getObjects(world, queryResult);
+    CHECK_EQUAL(0, queryResult.size());
+}
+
+TEST(Raycast)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(8, 8);
+    binfo.getSubCell(2, 5).createSubDivisions(4, 3);
+    binfo.getSubCell(2, 5).getSubCell(1, 1).createSubDivisions(3, 3);
+    binfo.getSubCell(6, 1).createSubDivisions(5, 5);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(20, -20, -20, 20), 400, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    RandDist posDist(-600.f, 600.f);
+    RandDist angleDist(0.f, 6.2831853f);
+    RaycastHitVec hits, first;
+    for (unsigned int i = 0; i < 200; ++i) {
+        const Vector2 origin(posDist(generator), posDist(generator));
+        const float32 angle = angleDist(generator);
+        // some axis aligned rays too
+        const Vector2 dir = i % 10 == 0 ? Vector2(i % 20 ? 1.f : 0.f, i % 20 ? 0.f : -2.f) :
+            Vector2(std::cos(angle), std::sin(angle));
+        const float32 maxDist = i % 2 ? 300.f : 2000.f;
+        mgsp.raycast(origin, dir, maxDist, hits);
+
+        // brute force
+        const float32 len = std::sqrt(dir.x * dir.x + dir.y * dir.y);
+        const Vector2 ndir(dir.x / len, dir.y / len);
+        std::vector<float32> expected;
+        for (Object& o : objs) {
+            float32 t;
+            if (o._mgsp_aabb.intersectRay(origin, ndir, 0.f, maxDist, t)) {
+                expected.push_back(t);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+        CHECK_EQUAL(expected.size(), hits.size());
+        std::set<Object*> unique;
+        for (unsigned int j = 0; j < hits.size(); ++j) {
+            CHECK(unique.insert(hits[j].object).second);
+            CHECK(j == 0 || hits[j-1].distance <= hits[j].distance);
+            if (j < expected.size()) {
+                CHECK_CLOSE(expected[j], hits[j].distance, 1e-3f);
+            }
+        }
+
+        mgsp.raycast(origin, dir, maxDist, first, true);
+        CHECK_EQUAL(expected.empty() ? 0 : 1, first.size());
+        if (!expected.empty() && !first.empty()) {
+            CHECK_CLOSE(expected[0], first[0].distance, 1e-3f);
+        }
+    }
+
+    // a ray missing the world
+    mgsp.raycast(Vector2(-600.f, 600.f), Vector2(-1.f, 0.f), 1000.f, hits);
+    CHECK_EQUAL(0, hits.size());
+}
+
+static float32
+squaredDistance(const AABB& aabb, const Vector2& p)
+{
+    const float32 dx = std::max(std::max(aabb.tl.x - p.x, p.x - aabb.br.x), 0.f);
+    const float32 dy = std::max(std::max(aabb.br.y - p.y, p.y - aabb.tl.y), 0.f);
+    return dx * dx + dy * dy;
+}
+
+TEST(NearestQueries)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(7, 9);
+    binfo.getSubCell(3, 4).createSubDivisions(4, 4);
+    binfo.getSubCell(3, 4).getSubCell(2, 2).createSubDivisions(3, 2);
+    binfo.getSubCell(8, 0).createSubDivisions(2, 5);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(15, -15, -15, 15), 300, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    RandDist posDist(-700.f, 700.f);
+    OPV nearest;
+    const size_t ks[] = {1, 5, 17, 400};
+    for (unsigned int i = 0; i < 100; ++i) {
+        const Vector2 point(posDist(generator), posDist(generator));
+        std::vector<float32> expected;
+        for (Object& o : objs) expected.push_back(squaredDistance(o._mgsp_aabb, point));
+        std::sort(expected.begin(), expected.end());
+
+        const size_t k = ks[i % 4];
+        mgsp.getNearest(point, k, nearest);
+        CHECK_EQUAL(std::min(k, objs.size()), nearest.size());
+        std::set<Object*> unique(nearest.begin(), nearest.end());
+        CHECK_EQUAL(nearest.size(), unique.size());
+        for (unsigned int j = 0; j < nearest.size(); ++j) {
+            CHECK_CLOSE(expected[j], squaredDistance(nearest[j]->_mgsp_aabb, point), 1e-2f);
+        }
+    }
+
+    // an empty structure
+    for (Object& o : objs) mgsp.remove(&o);
+    mgsp.getNearest(Vector2(0, 0), 3, nearest);
+    CHECK_EQUAL(0, nearest.size());
+}
+
+TEST(CircleQueries)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(10, 10);
+    binfo.getSubCell(4, 4).createSubDivisions(4, 4);
+    binfo.getSubCell(4, 4).getSubCell(0, 3).createSubDivisions(3, 3);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(20, -20, -20, 20), 500, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    RandDist posDist(-550.f, 550.f);
+    RandDist radiusDist(0.f, 300.f);
+    OPV queryResult;
+    for (unsigned int i = 0; i < 100; ++i) {
+        const Vector2 center(posDist(generator), posDist(generator));
+        const float32 radius = radiusDist(generator);
+        mgsp.getObjects(center, radius, queryResult);
+
+        OPHS expected;
+        for (Object& o : objs) {
+            if (o._mgsp_aabb.collideCircle(center, radius)) expected.insert(&o);
+        }
+        CHECK_EQUAL(expected.size(), queryResult.size());
+        for (Object* o : queryResult) CHECK(expected.count(o) == 1);
+
+        unsigned int count = 0;
+        CHECK_EQUAL(true, mgsp.forEachObject(center, radius, [&](Object* o) {
+            CHECK(expected.count(o) == 1);
+            ++count;
+            return true;
+        }));
+        CHECK_EQUAL(expected.size(), count);
+    }
+}
+
+TEST(WideIndices)
+{
+    // 200 x 200 leaf cells cannot be indexed with the 16 bits cells
+    CSInfo binfo;
+    AABB world(1000,-1000,-1000, 1000);
+    const char* filename = "mgsp_test_wide_structure.bin";
+    binfo.createSubDivisions(200, 200);
+    binfo.getSubCell(10, 10).createSubDivisions(3, 3);
+    MGSP compact;
+    CHECK_EQUAL(false, compact.build(world, binfo));
+
+    MultiGridSpacePartitionT<uint32_t> mgsp;
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // more objects than a 16 bits index can handle
+    OV objs;
+    createWorldObjects(AABB(980,-980,-980, 980), AABB(3, -3, -3, 3), 70000, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+    for (unsigned int i = 0; i < objs.size(); i += 7) {
+        AABB npos = objs[i]._mgsp_aabb;
+        npos.translate(Vector2(i % 2 ? 9.f : -9.f, i % 3 ? 5.f : -5.f));
+        mgsp.update(&objs[i], npos);
+    }
+    for (unsigned int i = 0; i < objs.size(); i += 11) mgsp.remove(&objs[i]);
+
+    OV queries;
+    createWorldObjects(world, AABB(40, -40, -40, 40), 30, queries);
+    OPV queryResult;
+    for (Object& q : queries) {
+        mgsp.getObjects(q._mgsp_aabb, queryResult);
+        OPHS expected;
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            if (i % 11 != 0 && objs[i]._mgsp_aabb.collide(q._mgsp_aabb)) {
+                expected.insert(&objs[i]);
+            }
+        }
+        CHECK_EQUAL(expected.size(), queryResult.size());
+        for (Object* o : queryResult) CHECK(expected.count(o) == 1);
+    }
+
+    // the index width is part of the file format
+    CHECK_EQUAL(true, mgsp.exportStructure(filename));
+    CHECK_EQUAL(false, compact.importStructure(filename));
+    MultiGridSpacePartitionT<uint32_t> loaded;
+    CHECK_EQUAL(true, loaded.importStructure(filename));
+    std::remove(filename);
+    CHECK(loaded.getRootMatrix().boundingBox() == world);
+}
+
+TEST(ObjectIndexLimit)
+{
+    // a 16 bits partition can index 0xFFFF objects (0xFFFF is reserved)
+    CSInfo binfo;
+    AABB world(1000,-1000,-1000, 1000);
+    binfo.createSubDivisions(16, 16);
+    MultiGridSpacePartitionT<uint16_t> mgsp;
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    const size_t limit = 0xFFFF;
+    OV objs;
+    createWorldObjects(AABB(980,-980,-980, 980), AABB(3, -3, -3, 3), limit + 2, objs);
+    std::vector<Object*> ptrs;
+    for (size_t i = 0; i < limit - 1; ++i) ptrs.push_back(&objs[i]);
+    mgsp.insertBulk(ptrs.data(), ptrs.size());
+    mgsp.insert(&objs[limit - 1]);
+    StructureReport report;
+    mgsp.report(report);
+    CHECK_EQUAL(limit, report.numObjects);
+
+    // the next ones are rejected instead of wrapping the index
+    mgsp.insert(&objs[limit]);
+    Object* extra = &objs[limit + 1];
+    mgsp.insertBulk(&extra, 1);
+    mgsp.report(report);
+    CHECK_EQUAL(limit, report.numObjects);
+
+    OPV queryResult;
+    mgsp.getObjects(world, queryResult);
+    CHECK_EQUAL(limit, queryResult.size());
+    CHECK(std::find(queryResult.begin(), queryResult.end(),
+                    &objs[limit - 1]) != queryResult.end());
+    CHECK(std::find(queryResult.begin(), queryResult.end(),
+                    &objs[limit]) == queryResult.end());
+    CHECK(std::find(queryResult.begin(), queryResult.end(),
+                    extra) == queryResult.end());
+
+    // removing one object frees an index again
+    mgsp.remove(&objs[0]);
+    mgsp.insert(&objs[limit]);
+    mgsp.getObjects(world, queryResult);
+    CHECK_EQUAL(limit, queryResult.size());
+    CHECK(std::find(queryResult.begin(), queryResult.end(),
+                    &objs[limit]) != queryResult.end());
+}
+
+TEST(CellStructBuilder)
+{
+    AABB world(500,-500,-500, 500);
+    // a sparse background and a dense cluster in the top right corner
+    OV objs, cluster;
+    createWorldObjects(world, AABB(10, -10, -10, 10), 300, objs);
+    createWorldObjects(AABB(400, 250, 250, 400), AABB(3, -3, -3, 3), 2000, cluster);
+    objs.insert(objs.end(), cluster.begin(), cluster.end());
+    std::vector<AABB> boxes;
+    for (Object& o : objs) boxes.push_back(o._mgsp_aabb);
+
+    CellStructBuilder builder;
+    CSInfo binfo;
+    CHECK_EQUAL(true, builder.build(world, boxes, binfo));
+    CHECK(!binfo.isLeaf());
+    const std::pair<unsigned int, unsigned int> numCells = binfo.getNumCells();
+    CHECK(numCells.first + numCells.second + 1 <= builder.config().maxCells);
+    // the cluster should be subdivided more than the rest of the world
+    CHECK(numCells.second > 0);
+
+    MGSP mgsp;
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+    for (Object& o : objs) mgsp.insert(&o);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // the cell budget is respected
+    CellStructBuilder::Config config;
+    config.maxCells = 50;
+    builder.setConfig(config);
+    CHECK_EQUAL(true, builder.build(world, boxes, binfo));
+    const std::pair<unsigned int, unsigned int> fewCells = binfo.getNumCells();
+    CHECK(fewCells.first + fewCells.second + 1 <= 50);
+
+    // queries much bigger than the objects need less cells
+    std::vector<AABB> queries;
+    OV bigQueries;
+    createWorldObjects(world, AABB(200, -200, -200, 200), 100, bigQueries);
+    for (Object& o : bigQueries) queries.push_back(o._mgsp_aabb);
+    builder.setConfig(CellStructBuilder::Config());
+    CSInfo bigInfo;
+    CHECK_EQUAL(true, builder.build(world, boxes, queries, bigInfo));
+    const std::pair<unsigned int, unsigned int> bigCells = bigInfo.getNumCells();
+    CHECK(bigCells.first + bigCells.second <= numCells.first + numCells.second);
+    CHECK_EQUAL(true, mgsp.build(world, bigInfo));
+
+    // invalid world
+    CHECK_EQUAL(false, builder.build(AABB(0, 0, 0, 0), boxes, binfo));
+}
+
+TEST(AdaptiveRefinement)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    const char* filename = "mgsp_test_refined_structure.bin";
+    binfo.createSubDivisions(4, 4);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+    CHECK_EQUAL(1, mgsp.numLevels());
+
+    MGSP::RefinementConfig config;
+    config.splitThreshold = 32;
+    config.mergeThreshold = 8;
+    config.splitColumns = 2;
+    config.splitRows = 3;
+    config.maxLevels = 4;
+    mgsp.setRefinementConfig(config);
+
+    // a crowded region and some objects around
+    OV objs, cluster;
+    createWorldObjects(world, AABB(10, -10, -10, 10), 50, objs);
+    createWorldObjects(AABB(-300, -400, -450, -250), AABB(4, -4, -4, 4), 400, cluster);
+    objs.insert(objs.end(), cluster.begin(), cluster.end());
+    for (Object& o : objs) mgsp.insert(&o);
+
+    // split until nothing changes
+    unsigned int steps = 0;
+    while (mgsp.rebalance() > 0 && steps < 10) ++steps;
+    CHECK(steps > 0 && steps < 10);
+    CHECK_EQUAL(4, mgsp.numLevels());
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // the refined structure can be exported and loaded (and refined again)
+    CHECK_EQUAL(true, mgsp.exportStructure(filename));
+    MGSP loaded;
+    CHECK_EQUAL(true, loaded.importStructure(filename));
+    std::remove(filename);
+    CHECK_EQUAL(4, loaded.numLevels());
+    loaded.setRefinementConfig(config);
+    for (Object& o : objs) loaded.insert(&o);
+    ARE_COLL_CORRECT(loaded, objs);
+    for (Object& o : objs) loaded.remove(&o);
+    CHECK(loaded.rebalance() > 0);
+    for (Object& o : objs) loaded.insert(&o);
+    ARE_COLL_CORRECT(loaded, objs);
+    for (Object& o : objs) loaded.remove(&o);
+
+    // spread the cluster (in a grid), the matrices should be merged again
+    for (unsigned int i = 50; i < objs.size(); ++i) {
+        const float32 x = -475.f + 50.f * ((i - 50) % 20);
+        const float32 y = -475.f + 50.f * ((i - 50) / 20);
+        mgsp.update(&objs[i], AABB(y + 4.f, x - 4.f, y - 4.f, x + 4.f));
+    }
+    ARE_COLL_CORRECT(mgsp, objs);
+    steps = 0;
+    while (mgsp.rebalance() > 0 && steps < 10) ++steps;
+    CHECK(steps < 10);
+    CHECK(mgsp.numLevels() < 4);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // moving them back will reuse the free cells
+    for (unsigned int i = 50; i < objs.size(); ++i) {
+        mgsp.update(&objs[i], cluster[i - 50]._mgsp_aabb);
+    }
+    while (mgsp.rebalance() > 0 && steps < 20) ++steps;
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // invalid operations
+    CHECK_EQUAL(false, mgsp.mergeMatrix(0));
+    CHECK_EQUAL(false, mgsp.splitLeaf(60000, 2, 2));
+}
+
+
+TEST(StructureReport)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(100,-100,-100, 100);
+    binfo.createSubDivisions(2, 2);
+    binfo.getSubCell(1, 1).createSubDivisions(2, 2);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // one object in 4 leaf cells and 3 in the bottom left one
+    OV objs(4);
+    objs[0]._mgsp_aabb = AABB(10, -10, -10, 10);
+    for (unsigned int i = 1; i < objs.size(); ++i) {
+        objs[i]._mgsp_aabb = AABB(-90, -100, -100, -90);
+    }
+    for (Object& o : objs) mgsp.insert(&o);
+
+    StructureReport report;
+    mgsp.report(report);
+    CHECK_EQUAL(4 + 4 + 1, report.numCells);
+    CHECK_EQUAL(2, report.numMatrices);
+    CHECK_EQUAL(7, report.numLeafCells);
+    CHECK_EQUAL(4, report.numObjects);
+    CHECK_EQUAL(4, report.maxResidents);
+    CHECK_CLOSE(7.f / 7.f, report.meanResidents, 1e-5f);
+    CHECK_CLOSE(7.f / 4.f, report.meanReplication, 1e-5f);
+    // 3 empty, 3 with 1 object and 1 with 4
+    CHECK_EQUAL(4, report.occupancyHistogram.size());
+    CHECK_EQUAL(3, report.occupancyHistogram[0]);
+    CHECK_EQUAL(3, report.occupancyHistogram[1]);
+    CHECK_EQUAL(0, report.occupancyHistogram[2]);
+    CHECK_EQUAL(1, report.occupancyHistogram[3]);
+
+    // only the leaf cell with 4 objects doesn't fit in the inline storage
+    const size_t entrySize = sizeof(uint16_t) + 4 * sizeof(float32);
+    CHECK_EQUAL(4 * entrySize, report.leafContents.used);
+    CHECK(report.leafContents.reserved >= report.leafContents.used);
+    CHECK_EQUAL(9 * sizeof(Cell), report.cells.used);
+    CHECK(report.total.reserved >= report.total.used);
+    CHECK(report.total.used > report.cells.used + report.leafContents.used);
+    CHECK_EQUAL(report.total.reserved, mgsp.memSize());
+    CHECK(report.pooledLeafBytes > 0);
+
+    // the heatmap has one line per leaf cell with its world coordinates
+    const char* filename = "/tmp/mgsp_test_heatmap.csv";
+    CHECK_EQUAL(true, mgsp.exportOccupancyHeatmap(filename));
+    std::ifstream in(filename);
+    std::string line;
+    std::getline(in, line);
+    CHECK_EQUAL(std::string("leaf,min_x,min_y,max_x,max_y,objects"), line);
+    unsigned int numLines = 0, numObjects = 0;
+    bool foundCorner = false;
+    while (std::getline(in, line)) {
+        float32 minX, minY, maxX, maxY;
+        unsigned int leaf, count;
+        CHECK_EQUAL(6, std::sscanf(line.c_str(), "%u,%f,%f,%f,%f,%u",
+                                   &leaf, &minX, &minY, &maxX, &maxY, &count));
+        foundCorner = foundCorner || (minX == -100.f && minY == -100.f &&
+                                      maxX == 0.f && maxY == 0.f && count == 4);
+        ++numLines;
+        numObjects += count;
+    }
+    CHECK_EQUAL(7, numLines);
+    CHECK_EQUAL(7, numObjects);
+    CHECK(foundCorner);
+    std::remove(filename);
+
+    // the crowded leaf cells give back their blocks when the objects leave
+    // (moving to another leaf cell and being removed), keeping at most 4
+    // times the used bytes
+    OV crowd(200);
+    for (Object& o : crowd) {
+        o._mgsp_aabb = AABB(-60, -100, -100, -60);
+        mgsp.insert(&o);
+    }
+    mgsp.report(report);
+    CHECK(report.pooledLeafBytes >= 204 * entrySize);
+    for (Object& o : crowd) {
+        mgsp.update(&o, AABB(90, 60, 60, 90));
+    }
+    for (Object& o : crowd) {
+        mgsp.remove(&o);
+    }
+    mgsp.report(report);
+    CHECK_EQUAL(4 * entrySize, report.leafContents.used);
+    CHECK(report.pooledLeafBytes <= 4 * report.leafContents.used);
+}
+
+TEST(ConcurrentQueryContexts)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(8, 8);
+    for (uint8_t r = 0; r < 8; r += 2) {
+        binfo.getSubCell(r, r).createSubDivisions(4, 4);
+    }
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(world, AABB(20, -20, -20, 20), 2000, objs);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    // the expected results computed with the internal context
+    const unsigned int numQueries = 200;
+    RandDist posDist(-500.f, 500.f);
+    std::vector<AABB> queries;
+    std::vector<Vector2> points;
+    std::vector<OPHS> expectedAABB(numQueries);
+    std::vector<OPHS> expectedNearest(numQueries);
+    OPV queryResult;
+    for (unsigned int i = 0; i < numQueries; ++i) {
+        const Vector2 p(posDist(generator), posDist(generator));
+        points.push_back(p);
+        queries.push_back(AABB(p.y + 50, p.x - 50, p.y - 50, p.x + 50));
+        mgsp.getObjects(queries.back(), queryResult);
+        expectedAABB[i].insert(queryResult.begin(), queryResult.end());
+        mgsp.getNearest(p, 5, queryResult);
+        expectedNearest[i].insert(queryResult.begin(), queryResult.end());
+    }
+
+    // now several threads querying the same structure (const) at the same
+    // time, each one with its own context
+    const MGSP& cmgsp = mgsp;
+    const unsigned int numThreads = 4;
+    std::vector<unsigned int> errors(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            MGSP::QueryContext context;
+            OPV result;
+            for (unsigned int round = 0; round < 10; ++round) {
+                for (unsigned int i = 0; i < numQueries; ++i) {
+                    cmgsp.getObjects(queries[i], result, context);
+                    if (OPHS(result.begin(), result.end()) != expectedAABB[i]) {
+                        ++errors[t];
+                    }
+                    cmgsp.getNearest(points[i], 5, result, context);
+                    if (OPHS(result.begin(), result.end()) != expectedNearest[i]) {
+                        ++errors[t];
+                    }
+                    unsigned int count = 0;
+                    cmgsp.forEachObject(queries[i], context, [&count](Object*) {
+                        ++count;
+                        return true;
+                    });
+                    if (count != expectedAABB[i].size()) {
+                        ++errors[t];
+                    }
+                }
+            }
+        }));
+    }
+    for (std::thread& thread : threads) thread.join();
+    for (unsigned int t = 0; t < numThreads; ++t) {
+        CHECK_EQUAL(0, errors[t]);
+    }
+}
+
+TEST(ParallelWriters)
+{
+    AABB world(500,-500,-500, 500);
+    CSInfo binfo;
+    binfo.createSubDivisions(8, 8);
+    for (uint8_t row = 0; row < 8; row += 3) {
+        binfo.getSubCell(row, row).createSubDivisions(4, 4);
+    }
+
+    OV objs;
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(15, -15, -15, 15), 3000, objs);
+    std::vector<Object*> ptrs;
+    for (Object& o : objs) ptrs.push_back(&o);
+
+    ThreadPool pool(4);
+    MGSP mgsp;
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+    mgsp.insertBulk(ptrs.data(), ptrs.size(), &pool);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // move all of them some frames, small moves (most of them stay in their
+    // root cell) and some big ones (crossing root cells)
+    RandDist smallStep(-5.f, 5.f);
+    RandDist bigStep(-200.f, 200.f);
+    std::vector<AABB> aabbs(objs.size());
+    for (unsigned int frame = 0; frame < 5; ++frame) {
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            RandDist& step = i % 10 == 0 ? bigStep : smallStep;
+            aabbs[i] = objs[i]._mgsp_aabb;
+            aabbs[i].translate(Vector2(step(generator), step(generator)));
+            if (!world.checkPointInside(aabbs[i].tl) ||
+                !world.checkPointInside(aabbs[i].br)) {
+                aabbs[i] = objs[i]._mgsp_aabb;
+            }
+        }
+        mgsp.updateParallel(ptrs.data(), aabbs.data(), ptrs.size(), &pool);
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            CHECK(objs[i]._mgsp_aabb == aabbs[i]);
+        }
+        ARE_COLL_CORRECT(mgsp, objs);
+    }
+
+    // remove the first half (the second half is checked against the queries)
+    mgsp.removeParallel(ptrs.data(), ptrs.size() / 2, &pool);
+    // removing them again does nothing
+    mgsp.removeParallel(ptrs.data(), 10, &pool);
+    OPV queryResult;
+    for (unsigned int i = objs.size() / 2; i < objs.size(); ++i) {
+        mgsp.getObjects(objs[i]._mgsp_aabb, queryResult);
+        unsigned int expected = 0;
+        for (unsigned int j = objs.size() / 2; j < objs.size(); ++j) {
+            if (objs[i]._mgsp_aabb.collide(objs[j]._mgsp_aabb)) ++expected;
+        }
+        CHECK_EQUAL(expected, queryResult.size());
+        for (Object* o : queryResult) CHECK(o >= &objs[objs.size() / 2]);
+    }
+
+    // and they can be added again (reusing the indices)
+    mgsp.insertBulk(ptrs.data(), ptrs.size() / 2, &pool);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // without pool
+    mgsp.removeParallel(ptrs.data(), ptrs.size(), 0);
+    mgsp.getObjects(world, queryResult);
+    CHECK_EQUAL(0, queryResult.size());
+}
+
+TEST(FrozenLayout)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(8, 8);
+    binfo.getSubCell(3, 3).createSubDivisions(4, 4);
+    binfo.getSubCell(3, 3).getSubCell(1, 2).createSubDivisions(2, 2);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    OV objs;
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(20, -20, -20, 20), 1500, objs);
+    // insert them one by one so the leaf cells have some capacity slack
+    for (Object& o : objs) mgsp.insert(&o);
+
+    // the results of some queries before freezing
+    RandDist posDist(-500.f, 500.f);
+    std::vector<Vector2> points;
+    for (unsigned int i = 0; i < 100; ++i) {
+        points.push_back(Vector2(posDist(generator), posDist(generator)));
+    }
+    auto runQueries = [&](std::vector<OPHS>& results) {
+        results.clear();
+        OPV queryResult;
+        RaycastHitVec hits;
+        for (const Vector2& p : points) {
+            mgsp.getObjects(AABB(p.y + 40, p.x - 40, p.y - 40, p.x + 40), queryResult);
+            results.push_back(OPHS(queryResult.begin(), queryResult.end()));
+            mgsp.getObjects(p, queryResult);
+            results.push_back(OPHS(queryResult.begin(), queryResult.end()));
+            mgsp.getObjects(p, 60.f, queryResult);
+            results.push_back(OPHS(queryResult.begin(), queryResult.end()));
+            mgsp.getNearest(p, 4, queryResult);
+            results.push_back(OPHS(queryResult.begin(), queryResult.end()));
+            mgsp.raycast(p, Vector2(1.f, 0.5f), 300.f, hits);
+            results.push_back(OPHS());
+            for (const RaycastHit& hit : hits) results.back().insert(hit.object);
+        }
+        PairSink pairs;
+        mgsp.getAllOverlappingPairs(pairs);
+        results.push_back(OPHS(pairs.first.begin(), pairs.first.end()));
+        results.push_back(OPHS(pairs.second.begin(), pairs.second.end()));
+    };
+    std::vector<OPHS> before, after;
+    runQueries(before);
+    StructureReport reportBefore, reportAfter;
+    mgsp.report(reportBefore);
+
+    CHECK_EQUAL(false, mgsp.isFrozen());
+    mgsp.freeze();
+    CHECK_EQUAL(true, mgsp.isFrozen());
+    runQueries(after);
+    CHECK(before == after);
+
+    // the packed arrays have no slack
+    mgsp.report(reportAfter);
+    CHECK_EQUAL(reportBefore.numLeafCells, reportAfter.numLeafCells);
+    CHECK_EQUAL(reportBefore.maxResidents, reportAfter.maxResidents);
+    CHECK(reportAfter.leafContents.reserved < reportBefore.leafContents.reserved);
+
+    // any modification thaws the structure
+    AABB moved = objs[0]._mgsp_aabb;
+    moved.translate(Vector2(5, 5));
+    mgsp.update(&objs[0], moved);
+    CHECK_EQUAL(false, mgsp.isFrozen());
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    mgsp.freeze();
+    mgsp.thaw();
+    CHECK_EQUAL(false, mgsp.isFrozen());
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // and removing / inserting while frozen
+    mgsp.freeze();
+    mgsp.remove(&objs[1]);
+    CHECK_EQUAL(false, mgsp.isFrozen());
+    mgsp.freeze();
+    mgsp.insert(&objs[1]);
+    CHECK_EQUAL(false, mgsp.isFrozen());
+    mgsp.freeze();
+    ARE_COLL_CORRECT(mgsp, objs);
+}
+
+// The results of some queries around a list of points, to compare different
+// configurations with the same objects
+//
+struct QueryResults {
+    std::vector<OPHS> objects;
+    // the nearest objects are compared by distance (a point can be inside
+    // several objects)
+    std::vector<float32> nearest;
+    std::set<std::pair<Object*, Object*> > pairs;
+
+    bool
+    operator==(const QueryResults& o) const
+    {
+        return objects == o.objects && nearest == o.nearest && pairs == o.pairs;
+    }
+};
+
+static void
+runQueries(MGSP& mgsp, const std::vector<Vector2>& points, QueryResults& results)
+{
+    results = QueryResults();
+    OPV queryResult;
+    RaycastHitVec hits, firstHit;
+    for (const Vector2& p : points) {
+        mgsp.getObjects(AABB(p.y + 40, p.x - 40, p.y - 40, p.x + 40), queryResult);
+        results.objects.push_back(OPHS(queryResult.begin(), queryResult.end()));
+        mgsp.getObjects(p, queryResult);
+        results.objects.push_back(OPHS(queryResult.begin(), queryResult.end()));
+        mgsp.getObjects(p, 60.f, queryResult);
+        results.objects.push_back(OPHS(queryResult.begin(), queryResult.end()));
+        mgsp.getNearest(p, 4, queryResult);
+        for (Object* o : queryResult) {
+            results.nearest.push_back(squaredDistance(o->_mgsp_aabb, p));
+        }
+        mgsp.raycast(p, Vector2(1.f, 0.5f), 300.f, hits);
+        results.objects.push_back(OPHS());
+        for (const RaycastHit& hit : hits) results.objects.back().insert(hit.object);
+        CHECK(std::is_sorted(hits.begin(), hits.end()));
+        mgsp.raycast(p, Vector2(1.f, 0.5f), 300.f, firstHit, true);
+        CHECK_EQUAL(std::min(hits.size(), size_t(1)), firstHit.size());
+        if (!hits.empty() && !firstHit.empty()) {
+            CHECK_EQUAL(hits[0].distance, firstHit[0].distance);
+        }
+    }
+    PairSink pairs;
+    mgsp.getAllOverlappingPairs(pairs);
+    CHECK_EQUAL(pairs.first.size(), pairs.second.size());
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Object* a = std::min(pairs.first[i], pairs.second[i]);
+        Object* b = std::max(pairs.first[i], pairs.second[i]);
+        // each pair is reported once
+        CHECK(results.pairs.insert(std::make_pair(a, b)).second);
+    }
+}
+
+TEST(LooseMode)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(8, 8);
+    binfo.getSubCell(3, 3).createSubDivisions(4, 4);
+    binfo.getSubCell(3, 3).getSubCell(1, 2).createSubDivisions(2, 2);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // small objects and some big ones covering several cells
+    OV objs, bigObjs;
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(10, -10, -10, 10), 1200, objs);
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(90, -120, -90, 120), 40, bigObjs);
+    objs.insert(objs.end(), bigObjs.begin(), bigObjs.end());
+    std::vector<Object*> ptrs;
+    for (Object& o : objs) ptrs.push_back(&o);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    RandDist posDist(-500.f, 500.f);
+    std::vector<Vector2> points;
+    for (unsigned int i = 0; i < 100; ++i) {
+        points.push_back(Vector2(posDist(generator), posDist(generator)));
+    }
+
+    // the same results than the normal mode
+    QueryResults before, after;
+    runQueries(mgsp, points, before);
+    CHECK_EQUAL(false, mgsp.isLooseMode());
+    mgsp.setLooseMode(true);
+    CHECK_EQUAL(true, mgsp.isLooseMode());
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // each object is stored only once
+    StructureReport report;
+    mgsp.report(report);
+    CHECK_CLOSE(1.f, report.meanReplication, 1e-5f);
+    CHECK(report.looseBounds.used > 0);
+
+    // move them (in parallel and deferred)
+    ThreadPool pool(4);
+    RandDist smallStep(-5.f, 5.f);
+    RandDist bigStep(-200.f, 200.f);
+    std::vector<AABB> aabbs(objs.size());
+    for (unsigned int frame = 0; frame < 4; ++frame) {
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            RandDist& step = i % 10 == 0 ? bigStep : smallStep;
+            aabbs[i] = objs[i]._mgsp_aabb;
+            aabbs[i].translate(Vector2(step(generator), step(generator)));
+            if (!world.checkPointInside(aabbs[i].tl) ||
+                !world.checkPointInside(aabbs[i].br)) {
+                aabbs[i] = objs[i]._mgsp_aabb;
+            }
+        }
+        if (frame % 2 == 0) {
+            mgsp.updateParallel(ptrs.data(), aabbs.data(), ptrs.size(), &pool);
+        } else {
+            mgsp.beginUpdates();
+            for (unsigned int i = 0; i < objs.size(); ++i) {
+                mgsp.queueUpdate(&objs[i], aabbs[i]);
+            }
+            mgsp.commit();
+        }
+        ARE_COLL_CORRECT(mgsp, objs);
+    }
+
+    // remove / insert them again
+    mgsp.removeParallel(ptrs.data(), ptrs.size() / 2, &pool);
+    mgsp.insertBulk(ptrs.data(), ptrs.size() / 2, &pool);
+    for (unsigned int i = 0; i < 10; ++i) mgsp.remove(&objs[i]);
+    for (unsigned int i = 0; i < 10; ++i) mgsp.insert(&objs[i]);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // split / merge the cells
+    MGSP::RefinementConfig config;
+    config.splitThreshold = 16;
+    config.mergeThreshold = 4;
+    config.maxLevels = 5;
+    mgsp.setRefinementConfig(config);
+    unsigned int steps = 0;
+    while (mgsp.rebalance() > 0 && steps < 10) ++steps;
+    CHECK(steps > 0);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // the frozen layout (refitting the bounds) gives the same results than
+    // the normal mode
+    runQueries(mgsp, points, before);
+    mgsp.freeze();
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    mgsp.setLooseMode(false);
+    CHECK_EQUAL(false, mgsp.isLooseMode());
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    ARE_COLL_CORRECT(mgsp, objs);
+}
+
+TEST(SpanningObjects)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(500,-500,-500, 500);
+    binfo.createSubDivisions(8, 8);
+    binfo.getSubCell(3, 3).createSubDivisions(8, 8);
+    binfo.getSubCell(3, 3).getSubCell(1, 2).createSubDivisions(4, 4);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // small objects, some big ones covering several cells and some huge ones
+    OV objs, bigObjs, hugeObjs;
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(10, -10, -10, 10), 1000, objs);
+    createWorldObjects(AABB(480,-480,-480, 480), AABB(40, -60, -40, 60), 60, bigObjs);
+    createWorldObjects(world, AABB(200, -300, -200, 300), 10, hugeObjs);
+    objs.insert(objs.end(), bigObjs.begin(), bigObjs.end());
+    objs.insert(objs.end(), hugeObjs.begin(), hugeObjs.end());
+    // and one spanning the sub matrix of the root cell (3, 3)
+    objs.push_back(Object());
+    objs.back()._mgsp_aabb = AABB(-30, -100, -90, -20);
+    std::vector<Object*> ptrs;
+    for (Object& o : objs) ptrs.push_back(&o);
+    for (Object& o : objs) mgsp.insert(&o);
+
+    RandDist posDist(-500.f, 500.f);
+    std::vector<Vector2> points;
+    for (unsigned int i = 0; i < 100; ++i) {
+        points.push_back(Vector2(posDist(generator), posDist(generator)));
+    }
+    // and some inside the sub matrices
+    RandDist subDist(-250.f, -125.f);
+    for (unsigned int i = 0; i < 50; ++i) {
+        points.push_back(Vector2(subDist(generator) + 125.f, subDist(generator) + 125.f));
+    }
+
+    // the same results storing the big objects in the spanning lists
+    QueryResults before, after;
+    runQueries(mgsp, points, before);
+    StructureReport reportBefore, reportAfter;
+    mgsp.report(reportBefore);
+    CHECK_EQUAL(0, reportBefore.numSpanningEntries);
+    CHECK_EQUAL(1.f, mgsp.spanningFraction());
+    mgsp.setSpanningFraction(0.25f);
+    CHECK_EQUAL(0.25f, mgsp.spanningFraction());
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    ARE_COLL_CORRECT(mgsp, objs);
+    PairSink pairs;
+    mgsp.getAllOverlappingPairs(pairs);
+    checkPairs(objs, pairs);
+
+    mgsp.report(reportAfter);
+    CHECK(reportAfter.numSpanningEntries > hugeObjs.size());
+    CHECK(reportAfter.meanReplication < reportBefore.meanReplication);
+
+    // move them (in parallel and deferred), the big ones will enter / leave
+    // the spanning lists of the sub matrices
+    ThreadPool pool(4);
+    RandDist smallStep(-5.f, 5.f);
+    RandDist bigStep(-200.f, 200.f);
+    std::vector<AABB> aabbs(objs.size());
+    for (unsigned int frame = 0; frame < 4; ++frame) {
+        for (unsigned int i = 0; i < objs.size(); ++i) {
+            RandDist& step = i % 10 == 0 ? bigStep : smallStep;
+            aabbs[i] = objs[i]._mgsp_aabb;
+            aabbs[i].translate(Vector2(step(generator), step(generator)));
+            if (!world.checkPointInside(aabbs[i].tl) ||
+                !world.checkPointInside(aabbs[i].br)) {
+                aabbs[i] = objs[i]._mgsp_aabb;
+            }
+        }
+        if (frame % 2 == 0) {
+            mgsp.updateParallel(ptrs.data(), aabbs.data(), ptrs.size(), &pool);
+        } else {
+            mgsp.beginUpdates();
+            for (unsigned int i = 0; i < objs.size(); ++i) {
+                mgsp.queueUpdate(&objs[i], aabbs[i]);
+            }
+            mgsp.commit();
+        }
+        ARE_COLL_CORRECT(mgsp, objs);
+    }
+    mgsp.getAllOverlappingPairs(pairs, &pool);
+    checkPairs(objs, pairs);
+
+    // remove / insert them again
+    mgsp.removeParallel(ptrs.data(), ptrs.size() / 2, &pool);
+    mgsp.insertBulk(ptrs.data(), ptrs.size() / 2, &pool);
+    for (unsigned int i = objs.size() - 20; i < objs.size(); ++i) mgsp.remove(&objs[i]);
+    for (unsigned int i = objs.size() - 20; i < objs.size(); ++i) mgsp.insert(&objs[i]);
+    ARE_COLL_CORRECT(mgsp, objs);
+
+    // split / merge the cells (the new matrices have spanning lists too)
+    MGSP::RefinementConfig config;
+    config.splitThreshold = 16;
+    config.mergeThreshold = 4;
+    config.splitColumns = 4;
+    config.splitRows = 4;
+    mgsp.setRefinementConfig(config);
+    unsigned int steps = 0;
+    while (mgsp.rebalance() > 0 && steps < 10) ++steps;
+    CHECK(steps > 0);
+    ARE_COLL_CORRECT(mgsp, objs);
+    mgsp.getAllOverlappingPairs(pairs);
+    checkPairs(objs, pairs);
+
+    // the frozen layout and disabling them give the same results
+    runQueries(mgsp, points, before);
+    mgsp.freeze();
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    mgsp.setSpanningFraction(1.f);
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    mgsp.report(reportAfter);
+    CHECK_EQUAL(0, reportAfter.numSpanningEntries);
+
+    // the loose mode doesn't use them
+    mgsp.setSpanningFraction(0.25f);
+    mgsp.setLooseMode(true);
+    mgsp.report(reportAfter);
+    CHECK_EQUAL(0, reportAfter.numSpanningEntries);
+    runQueries(mgsp, points, after);
+    CHECK(before == after);
+    mgsp.setLooseMode(false);
+    mgsp.report(reportAfter);
+    CHECK(reportAfter.numSpanningEntries > 0);
+    ARE_COLL_CORRECT(mgsp, objs);
+}
+
+#ifdef MGSP_STATS
+TEST(QueryStats)
+{
+    MGSP mgsp;
+    CSInfo binfo;
+    AABB world(100,-100,-100, 100);
+    binfo.createSubDivisions(2, 2);
+    binfo.getSubCell(1, 1).createSubDivisions(2, 2);
+    CHECK_EQUAL(true, mgsp.build(world, binfo));
+
+    // one object in the center (in all the root cells) and one in the corner
+    // of the bottom left cell
+    OV objs(2);
+    objs[0]._mgsp_aabb = AABB(10, -10, -10, 10);
+    objs[1]._mgsp_aabb = AABB(-90, -100, -100, -90);
+    mgsp.insert(&objs[0]);
+    mgsp.insert(&objs[1]);
+    mgsp.resetQueryStats();
+
+    // the full world: 2 matrices, 3 + 4 leaf cells, the center object is in 4
+    // of them (3 dedup hits)
+    OPV queryResult;
+    mgsp.getObjects(world, queryResult);
+    CHECK_EQUAL(2, queryResult.size());
+    QueryStats stats = mgsp.lastQueryStats();
+    CHECK_EQUAL(1, stats.queries);
+    CHECK_EQUAL(2, stats.matrices);
+    CHECK_EQUAL(7, stats.leaves);
+    CHECK_EQUAL(5, stats.candidates);
+    CHECK_EQUAL(3, stats.dedupHits);
+    CHECK_EQUAL(2, stats.hits);
+
+    // only the bottom left cell
+    mgsp.getObjects(AABB(-50, -100, -100, -50), queryResult);
+    CHECK_EQUAL(1, queryResult.size());
+    stats = mgsp.lastQueryStats();
+    CHECK_EQUAL(1, stats.matrices);
+    CHECK_EQUAL(1, stats.leaves);
+    CHECK_EQUAL(2, stats.candidates);
+    CHECK_EQUAL(0, stats.dedupHits);
+    CHECK_EQUAL(1, stats.hits);
+
+    // point query
+    mgsp.getObjects(Vector2(-95, -95), queryResult);
+    stats = mgsp.lastQueryStats();
+    CHECK_EQUAL(1, stats.leaves);
+    CHECK_EQUAL(2, stats.candidates);
+    CHECK_EQUAL(1, stats.hits);
+
+    // the totals
+    stats = mgsp.totalQueryStats();
+    CHECK_EQUAL(3, stats.queries);
+    CHECK_EQUAL(9, stats.leaves);
+    CHECK_EQUAL(4, stats.hits);
+
+    // a batch is counted as a whole
+    const AABB queries[] = {world, AABB(-50, -100, -100, -50)};
+    ResultSink sink;
+    mgsp.getObjectsBatch(queries, 2, sink);
+    stats = mgsp.lastQueryStats();
+    CHECK_EQUAL(2, stats.queries);
+    CHECK_EQUAL(8, stats.leaves);
+    CHECK_EQUAL(3, stats.hits);
+    CHECK_EQUAL(5, mgsp.totalQueryStats().queries);
+
+    mgsp.resetQueryStats();
+    CHECK_EQUAL(0, mgsp.totalQueryStats().queries);
+}
+#endif
 
 int
 main(void)